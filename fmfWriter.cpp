@@ -1,31 +1,64 @@
-#include <windows.h>
+#include "ufmfPlatform.h"
 #include <stdio.h>
 #include "fmfWriter.h"
 
 fmfWriter::fmfWriter(){
 	writeFlag = false;
+	output = NULL;
+	logger = NULL;
+	records = NULL;
+	_writeThread = NULL;
+	lock = NULL;
+	frameFreeSignal = NULL;
+	frameQueuedSignal = NULL;
+	stopSignal = NULL;
 }
 
 
 fmfWriter::~fmfWriter(){
 	stopWrite();
+	deallocateThreadStuff();
+	if(output != NULL){
+		delete output;
+		output = NULL;
+	}
+	if(logger != NULL){
+		delete logger;
+		logger = NULL;
+	}
 };
 
-bool fmfWriter::startWrite(const char * fileName, unsigned __int32 pWidth, unsigned __int32 pHeight, FILE* out){
+bool fmfWriter::startWrite(const char * fileName, unsigned __int32 pWidth, unsigned __int32 pHeight, FILE* out,
+						   ufmfOutputBackend outputBackend, unsigned __int64 preallocateBytes, const char * outputTargets,
+						   int nFrameBuffers){
 	
 	nInput = 0;
 	nWritten = 0;
+	nFramesBuffered = 0;
+	maxFramesBuffered = 0;
+	nFramesDroppedExternal = 0;
+	nFramesBufferedExternal = 0;
+	writeFailed = false;
 
 	// log output
 	logFID = out;
+	if(logger == NULL){
+		logger = new ufmfLogger(logFID);
+	}
 
 	//capture height/width
 	wWidth = pWidth;
 	wHeight = pHeight;
 
 	//Open File and Write FMF Header
-	pFile = fopen(fileName,"wb");
-	if(pFile == NULL){
+	if(output != NULL){
+		delete output;
+	}
+	output = new ufmfOutput(logger,NULL,4 << 20,4,false,outputBackend,preallocateBytes);
+	if(outputTargets != NULL && strlen(outputTargets) > 0){
+		output->setTargets(outputTargets);
+	}
+	if(!output->open(fileName)){
 		fprintf(logFID,"Error opening file %s for writing\n",fileName);
 		return false;
 	}
@@ -33,13 +66,39 @@ bool fmfWriter::startWrite(const char * fileName, unsigned __int32 pWidth, unsig
 	unsigned __int32 fmfVersion = 1;
 	unsigned __int64 bytesPerChunk = (unsigned __int64)wHeight*(unsigned __int64)wWidth+(unsigned __int64)8;
 
-	fwrite(&fmfVersion,4,1,pFile);		//write version number (int32)
-	fwrite(&wHeight,4,1,pFile);			//write image height (int32)
-	fwrite(&wWidth,4,1,pFile);			//write image width (int32)
-	fwrite(&bytesPerChunk,8,1,pFile);	//write frame size + timestamp (double)
-	fwrite(&nWritten,8,1,pFile);		//write number of frames (will need to be updated at end) (double)
+	output->write(&fmfVersion,4);		//write version number (int32)
+	output->write(&wHeight,4);			//write image height (int32)
+	output->write(&wWidth,4);			//write image width (int32)
+	output->write(&bytesPerChunk,8);	//write frame size + timestamp (double)
+	output->write(&nWritten,8);		//write number of frames (will need to be updated at end) (double)
 	fprintf(logFID,"FMF Header Written\n");
 	
+	// allocate the frame queue. each record is laid out as it is in the file
+	deallocateThreadStuff();
+	this->nFrameBuffers = max(nFrameBuffers,1);
+	recordSize = bytesPerChunk;
+	records = new unsigned __int8[(size_t)(recordSize*this->nFrameBuffers)];
+	queueHead = 0;
+	queueTail = 0;
+
+	lock = CreateSemaphore(NULL,1,1,NULL);
+	frameFreeSignal = CreateSemaphore(NULL,this->nFrameBuffers,this->nFrameBuffers,NULL);
+	frameQueuedSignal = CreateSemaphore(NULL,0,this->nFrameBuffers,NULL);
+	stopSignal = CreateSemaphore(NULL,0,1,NULL);
+	if(lock == NULL || frameFreeSignal == NULL || frameQueuedSignal == NULL || stopSignal == NULL){
+		fprintf(logFID,"Error creating fmf write semaphores\n");
+		deallocateThreadStuff();
+		return false;
+	}
+
+	// start the write thread
+	_writeThread = CreateThread(NULL,0,writeThread,this,0,NULL);
+	if(_writeThread == NULL){
+		fprintf(logFID,"Error creating fmf write thread\n");
+		deallocateThreadStuff();
+		return false;
+	}
+
 	writeFlag = true;
 
 	return true;
@@ -50,22 +109,146 @@ unsigned __int64 fmfWriter::stopWrite(){
 
 	writeFlag = false;
 
+	// the write thread stops once the frames already queued are written. it uses the records and
+	// the output until then, so nothing can be freed before it has exited, however long that takes
+	ReleaseSemaphore(stopSignal,1,NULL);
+	if(WaitForSingleObject(_writeThread,INFINITE) != WAIT_OBJECT_0){
+		logger->log(UFMF_ERROR,"Error shutting down fmf write thread\n");
+		return 0;
+	}
+	CloseHandle(_writeThread);
+	_writeThread = NULL;
+
+	logger->log(UFMF_DEBUG_3,"Wrote %llu of %llu frames, at most %d of %d frames queued, %llu frames dropped externally\n",
+		nWritten,nInput,maxFramesBuffered,nFrameBuffers,nFramesDroppedExternal);
+
 	//Close the file
-	fseek(pFile,20,0);
-	fwrite(&nWritten,8,1,pFile);
-	fclose(pFile);
+	bool res = output->finish() && output->writeAt(20,&nWritten,8);
+	res = output->close() && res;
+	if(!res){
+		logger->log(UFMF_ERROR,"Error finishing the fmf file\n");
+	}
 
-	return nWritten;
+	deallocateThreadStuff();
+
+	return res ? nWritten : 0;
 }
-bool fmfWriter::addFrame(char * frame, double timestamp){
 
-	nWritten++;
+// copy the frame into the queue. waits only if nFrameBuffers frames are already queued
+bool fmfWriter::addFrame(char * frame, double timestamp, unsigned __int64 nFramesDroppedExternal, unsigned __int64 nFramesBufferedExternal){
+
+	unsigned __int8 * record;
+
+	if(!writeFlag || writeFailed) return false;
+
+	if(WaitForSingleObject(frameFreeSignal,FMFWAITTIMEMS) != WAIT_OBJECT_0){
+		logger->log(UFMF_ERROR,"Error waiting for a free fmf frame buffer\n");
+		return false;
+	}
+
+	// write timestamp and frame
+	record = records + queueTail*recordSize;
+	memcpy(record,&timestamp,8);
+	memcpy(record+8,frame,(size_t)wWidth*wHeight);
+	queueTail = (queueTail+1) % nFrameBuffers;
+
+	Lock();
+	nInput++;
+	nFramesBuffered++;
+	if(nFramesBuffered > maxFramesBuffered) maxFramesBuffered = nFramesBuffered;
+	this->nFramesDroppedExternal = nFramesDroppedExternal;
+	this->nFramesBufferedExternal = nFramesBufferedExternal;
+	Unlock();
 
-	// write timestamp
-	fwrite(&timestamp,8,1,pFile);
-						
-	//Write entire frame at once
-	fwrite(frame,1,wWidth*wHeight,pFile);
+	ReleaseSemaphore(frameQueuedSignal,1,NULL);
 
 	return true;
-}
\ No newline at end of file
+}
+
+DWORD WINAPI fmfWriter::writeThread(void* param){
+	fmfWriter* writer = reinterpret_cast<fmfWriter*>(param);
+
+	ufmfSetThreadName("fmf write");
+	SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_ABOVE_NORMAL);
+
+	while(writer->ProcessNextWrite());
+
+	return 0;
+}
+
+// write every record queued, up to the end of the ring, in one write
+bool fmfWriter::ProcessNextWrite(){
+
+	HANDLE signals[2] = {frameQueuedSignal,stopSignal};
+	DWORD waitResult;
+	int n;
+
+	// frames come first, so we only stop once they are all written
+	waitResult = WaitForMultipleObjects(2,signals,false,INFINITE);
+	if(waitResult == WAIT_OBJECT_0 + 1){
+		return false;
+	}
+	if(waitResult != WAIT_OBJECT_0){
+		logger->log(UFMF_ERROR,"Error waiting for an fmf frame to write: %x\n",waitResult);
+		return false;
+	}
+
+	n = 1;
+	while(queueHead + n < nFrameBuffers && WaitForSingleObject(frameQueuedSignal,0) == WAIT_OBJECT_0){
+		n++;
+	}
+
+	if(!writeFailed){
+		if(output->write(records + queueHead*recordSize,recordSize*n)){
+			nWritten += n;
+		}
+		else{
+			logger->log(UFMF_ERROR,"Error writing %d fmf frames, discarding the rest\n",n);
+			writeFailed = true;
+		}
+	}
+	queueHead = (queueHead+n) % nFrameBuffers;
+
+	Lock();
+	nFramesBuffered -= n;
+	Unlock();
+
+	ReleaseSemaphore(frameFreeSignal,n,NULL);
+
+	return true;
+}
+
+void fmfWriter::deallocateThreadStuff(){
+	if(records != NULL){
+		delete [] records;
+		records = NULL;
+	}
+	if(lock != NULL){
+		CloseHandle(lock);
+		lock = NULL;
+	}
+	if(frameFreeSignal != NULL){
+		CloseHandle(frameFreeSignal);
+		frameFreeSignal = NULL;
+	}
+	if(frameQueuedSignal != NULL){
+		CloseHandle(frameQueuedSignal);
+		frameQueuedSignal = NULL;
+	}
+	if(stopSignal != NULL){
+		CloseHandle(stopSignal);
+		stopSignal = NULL;
+	}
+}
+
+bool fmfWriter::Lock(){
+	if(WaitForSingleObject(lock,FMFWAITTIMEMS) != WAIT_OBJECT_0){
+		logger->log(UFMF_ERROR,"Waited Too Long For fmf Lock\n");
+		return false;
+	}
+	return true;
+}
+bool fmfWriter::Unlock(){
+	ReleaseSemaphore(lock,1,NULL);
+	return true;
+}
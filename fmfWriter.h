@@ -1,8 +1,17 @@
 #ifndef __FMFWRITER_H
 #define __FMFWRITER_H
 
-#include "windows.h"
+#include "ufmfPlatform.h"
+#include "ufmfLogger.h"
+#include "ufmfOutput.h"
 
+#define FMFNFRAMEBUFFERS 32 // default number of frames that can be queued for the write thread
+#define FMFWAITTIMEMS 10000 // how long addFrame waits for a free buffer, and Lock for the lock
+
+// frames are copied into a ring of nFrameBuffers (timestamp, frame) records, which is exactly
+// the fmf layout, and written by a write thread. the write thread takes every record queued
+// at once and writes each contiguous run of them with a single write, so the caller of
+// addFrame only waits on the disk when the ring is full
 class fmfWriter {
 public:
 		fmfWriter();
@@ -11,21 +20,48 @@ public:
 
 		unsigned __int64 nInput;  //Track number of frames fed into system
 		unsigned __int64 nWritten; //Track number of frames written to disk
-		
-		bool startWrite(const char * fileName, unsigned __int32 pWidth, unsigned __int32 pHeight, FILE* out);
-		bool addFrame(char * frame, double timestamp);
-		unsigned __int64 stopWrite();
+		int nFramesBuffered; // frames queued for the write thread
+		int maxFramesBuffered; // most frames queued at once
+		unsigned __int64 nFramesDroppedExternal; // Number of frames dropped by the external process
+		unsigned __int64 nFramesBufferedExternal; // Number of frames buffered by the external process
 
-//private:
+		bool startWrite(const char * fileName, unsigned __int32 pWidth, unsigned __int32 pHeight, FILE* out,
+			ufmfOutputBackend outputBackend = UFMF_OUTPUT_THREADED, unsigned __int64 preallocateBytes = 0,
+			const char * outputTargets = NULL, int nFrameBuffers = FMFNFRAMEBUFFERS);
+		bool addFrame(char * frame, double timestamp, unsigned __int64 nFramesDroppedExternal=0, unsigned __int64 nFramesBufferedExternal=0);
+		unsigned __int64 stopWrite(); // number of frames written, 0 if the file could not be finished
 
+//private:
 
+		// write thread
+		static DWORD WINAPI writeThread(void* param);
+		bool ProcessNextWrite();
+		void deallocateThreadStuff();
+		bool Lock();
+		bool Unlock();
 
 		unsigned int wWidth; //Image Width
 		unsigned int wHeight; //Image Height
 		bool writeFlag; //Status
-	
-		FILE * pFile; //File Target
-		FILE * logFID; 
+
+		ufmfOutput * output; //File Target
+		FILE * logFID;
+		ufmfLogger * logger; // logs output errors to logFID
+
+		// frame queue
+		unsigned __int8 * records; // nFrameBuffers records of recordSize bytes
+		unsigned __int64 recordSize; // timestamp + frame
+		int nFrameBuffers;
+		int queueHead; // next record to write; only touched by the write thread
+		int queueTail; // next record to fill; only touched by addFrame
+		bool writeFailed; // set by the write thread, after which frames are discarded
+
+		// threading
+		HANDLE _writeThread;
+		HANDLE lock;
+		HANDLE frameFreeSignal; // counts free records
+		HANDLE frameQueuedSignal; // counts queued records
+		HANDLE stopSignal; // released by stopWrite once the last frame is queued
 };
 
 #endif
\ No newline at end of file
@@ -78,6 +78,8 @@ public:
 	tPvFrame** pFrameBuffer;
 	unsigned long* timestampLoBuffer;
 	unsigned long* timestampHiBuffer;
+	// buffers lent to the ufmf writer. they are requeued, in order, once it releases them
+	volatile bool* frameLent;
 
 	// output file name
 	char videoFileName[CHARARRAYSIZE];
@@ -93,6 +95,10 @@ public:
 	fmfWriter* FMFwriter;
 	ufmfWriter* UFMFwriter;
 	VideoFormatType videoFormat;
+	ufmfOutputBackend fmfOutputBackend; // how fmf output is written
+	char fmfOutputTargets[CHARARRAYSIZE]; // directories fmf output is striped across, separated by commas
+	int fmfNFrameBuffers; // frames that can be queued for the fmf write thread
+	bool ufmfNoCopy; // lend buffers to the ufmf writer instead of having it copy them
 
 	// start time
 	time_t startTime;
@@ -138,9 +144,15 @@ public:
 	// frame grabbed callback
 	friend void _STDCALL frameGrabbedCallback(tPvFrame* pFrame);
 
+	// called by the ufmf writer once it is done with a lent buffer
+	friend void frameReleasedCallback(void* context, unsigned char* frame);
+
 	// process a grabbed frame
 	bool processFrame();
 
+	// give free buffers back to the camera
+	void queueFrames();
+
 	bool startRecording();
 
 	bool stopRecording();
@@ -207,6 +219,10 @@ void GigeRecord::initGigeRecord(){
 	// initialize video file name
 	strcpy(videoFileName,"test.avi");
 	strcpy(videoParamFileName,"");
+	fmfOutputBackend = UFMF_OUTPUT_THREADED;
+	strcpy(fmfOutputTargets,"");
+	fmfNFrameBuffers = FMFNFRAMEBUFFERS;
+	ufmfNoCopy = true;
 
 	// initialize buffer stuff to be empty
 	nFramesBuffer = 1000;
@@ -222,6 +238,7 @@ void GigeRecord::initGigeRecord(){
 	pFrameBuffer = NULL;
 	timestampLoBuffer = NULL;
 	timestampHiBuffer = NULL;
+	frameLent = NULL;
 
 	// initialize video state
 	videoOpen = false;
@@ -386,6 +403,10 @@ bool GigeRecord::initializeBuffers(){
 		fprintf(logFID,"Error allocating timestampHi buffer\n");
 		return false;
 	}
+	frameLent = new volatile bool[nFramesBuffer];
+	for(unsigned __int64 i = 0; i < nFramesBuffer; i++){
+		frameLent[i] = false;
+	}
 
 	queueableStart = 0;
 	nFramesQueued = 0;
@@ -429,7 +450,7 @@ bool GigeRecord::initializeVideoWriter(){
 			fprintf(logFID,"Error allocating FMFwriter\n");
 			return false;
 		}
-		if(!FMFwriter->startWrite(videoFileName,frameWidth,frameHeight,logFID)){
+		if(!FMFwriter->startWrite(videoFileName,frameWidth,frameHeight,logFID,fmfOutputBackend,0,fmfOutputTargets,fmfNFrameBuffers)){
 			fprintf(logFID,"Error starting FMF writing\n");
 			return false;
 		}
@@ -486,7 +507,11 @@ bool GigeRecord::closeVideoWriter(){
 
 	case UFMF:
 
-		UFMFwriter->stopWrite();
+		// stopWrite returns 0 if the movie could not be finished
+		if(UFMFwriter->stopWrite() == 0 && UFMFwriter->NumWritten() > 0){
+			fprintf(logFID,"Error finishing the ufmf video, its index may be missing\n");
+			return false;
+		}
 		fprintf(stderr,"stopped writing\n");
 		//delete UFMFwriter;
 		break;
@@ -546,6 +571,10 @@ GigeRecord::~GigeRecord(){
 		delete [] timestampHiBuffer;
 		timestampHiBuffer = NULL;
 	}
+	if(frameLent != NULL){
+		delete [] frameLent;
+		frameLent = NULL;
+	}
 	if( (logFID != NULL) && strcmp(logFileName,"") ){
 		fprintf(stderr,"closing log file\n");
 		fclose(logFID);
@@ -754,12 +783,27 @@ void _STDCALL frameGrabbedCallback(tPvFrame* pFrame)
 
 }
 
+// context is the buffer's frame, which knows the recorder and its index
+void frameReleasedCallback(void* context, unsigned char* frame)
+{
+	tPvFrame* pFrame = (tPvFrame*)context;
+	GigeRecord * rec = (GigeRecord*)(pFrame->Context[0]);
+	int j = (int)(pFrame->Context[1]);
+
+	rec->frameLent[j] = false;
+}
+
 bool GigeRecord::processFrame(){
 
 	//char fileName[CHARARRAYSIZE];
 	unsigned __int64 timestampBoth;
 	double timestamp;
 
+	// buffers released by the ufmf writer since the last call
+	if(isAcquiring){
+		queueFrames();
+	}
+
 	if(nFramesProcessable == 0){
 		return true;
 	}
@@ -794,13 +838,23 @@ bool GigeRecord::processFrame(){
 
 		case FMF:
 
-			if(!FMFwriter->addFrame(imageBuffer[processableStart]->imageData,timestamp))
+			if(!FMFwriter->addFrame(imageBuffer[processableStart]->imageData,timestamp,nFramesDropped,nFramesProcessable))
 				return false;
 			break;
 
 		case UFMF:
 
-			if(!UFMFwriter->addFrame((unsigned char*)imageBuffer[processableStart]->imageData,timestamp,nFramesDropped,nFramesProcessable))
+			// never wait for the writer: if it is overloaded, its overload policy drops a frame
+			if(ufmfNoCopy){
+				// the buffer stays out of the camera's queue until the writer is done with it
+				frameLent[processableStart] = true;
+				if(!UFMFwriter->tryAddFrameNoCopy((unsigned char*)imageBuffer[processableStart]->imageData,timestamp,
+					frameReleasedCallback,pFrameBuffer[processableStart],0,nFramesDropped,nFramesProcessable)){
+					frameLent[processableStart] = false;
+					return false;
+				}
+			}
+			else if(!UFMFwriter->tryAddFrame((unsigned char*)imageBuffer[processableStart]->imageData,timestamp,0,nFramesDropped,nFramesProcessable))
 				return false;
 			break;
 
@@ -824,18 +878,25 @@ bool GigeRecord::processFrame(){
 
 	// fill up the queue
 	if(isAcquiring){
-		while(nFramesQueueable > 0 && nFramesQueued < MAXNFRAMESENQUEUE){
-			PvCaptureQueueFrame(cameraHandle,pFrameBuffer[queueableStart],frameGrabbedCallback);
-			queueableStart = (queueableStart+1) % nFramesBuffer;
-			nFramesQueueable--;
-			nFramesQueued++;
-		}
+		queueFrames();
 	}
 
 	return true;
 
 }
 
+// buffers are requeued in order, so a lent buffer holds back the ones after it
+void GigeRecord::queueFrames(){
+
+	while(nFramesQueueable > 0 && nFramesQueued < MAXNFRAMESENQUEUE && !frameLent[queueableStart]){
+		PvCaptureQueueFrame(cameraHandle,pFrameBuffer[queueableStart],frameGrabbedCallback);
+		queueableStart = (queueableStart+1) % nFramesBuffer;
+		nFramesQueueable--;
+		nFramesQueued++;
+	}
+
+}
+
 bool GigeRecord::startRecording(){
 
 	if(!initializeVideoWriter()){
@@ -1169,6 +1230,27 @@ void GigeRecord::readExperimentAttribute(char* aLine)
 				else
 					fprintf(logFID,"Unknown video format %s\n",lValue);
 			}
+			else if(!strcmp(lLabel,"fmfOutputBackend")){
+				if(!strcmp(lValue,"STDIO"))
+					fmfOutputBackend = UFMF_OUTPUT_STDIO;
+				else if(!strcmp(lValue,"THREADED"))
+					fmfOutputBackend = UFMF_OUTPUT_THREADED;
+				else if(!strcmp(lValue,"OVERLAPPED"))
+					fmfOutputBackend = UFMF_OUTPUT_OVERLAPPED;
+				else if(!strcmp(lValue,"MAPPED"))
+					fmfOutputBackend = UFMF_OUTPUT_MAPPED;
+				else
+					fprintf(logFID,"Unknown fmf output backend %s\n",lValue);
+			}
+			else if(!strcmp(lLabel,"fmfOutputTargets")){
+				strcpy(fmfOutputTargets,lValue);
+			}
+			else if(!strcmp(lLabel,"fmfNFrameBuffers")){
+				fmfNFrameBuffers = atoi(lValue);
+			}
+			else if(!strcmp(lLabel,"ufmfNoCopy")){
+				ufmfNoCopy = atoi(lValue) != 0;
+			}
 			else if(!strcmp(lLabel,"videoParamFileName")){
 				strcpy(videoParamFileName,lValue);
 			}
@@ -117,6 +117,7 @@ DWORD WINAPI previewVideo::previewThread(void* param){
 
 	cvNamedWindow( "Preview", CV_WINDOW_AUTOSIZE );
 
+	ufmfSetThreadName("preview");
 	SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_BELOW_NORMAL);
 	
 	// Signal that we are ready to begin writing
@@ -1,7 +1,7 @@
 #ifndef __PREVIEWVIDEO_H
 #define __PREVIEWVIDEO_H
 
-#include "windows.h"
+#include "ufmfPlatform.h"
 #include "cv.h"
 #include "highgui.h"
 #include <stdio.h>
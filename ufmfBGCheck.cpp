@@ -0,0 +1,129 @@
+// ufmfBGCheck: check that the incremental median (UFMFBGIncrementalMedian) gives the same background
+// model as rescanning the counts.
+//
+// usage: ufmfBGCheck [nPixels] [nFrames] [seed]
+//
+// for each case, the same frames are added to a BackgroundModel with each median, and after every
+// update the two must agree at every pixel. the cases cover a slowly drifting background, pure noise,
+// a background that jumps across most of the bins, and one with no resets, in which the 8-bit counts
+// wrap. prints the first pixel that differs and returns 1, or returns 0 if every case agrees.
+
+#include "ufmfPlatform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ufmfWriter.h"
+
+typedef enum {
+	BGCHECK_DRIFT = 0, // background moves one bin every 50 frames, a few bins of noise
+	BGCHECK_NOISE, // every pixel uniform over all the bins
+	BGCHECK_JUMP, // background jumps half way across the bins every 200 frames
+	BGCHECK_WRAP, // two bins per pixel and no resets, so counts wrap past 255, the lower one below the median
+	BGCHECK_NUM_CASES
+} bgCheckCase;
+
+static const char * caseNames[BGCHECK_NUM_CASES] = {"drift","noise","jump","wrap"};
+
+#define BGCHECKUPDATEPERIOD 5 // frames added between model updates
+#define BGCHECKRESETFRAMES 37 // minNFramesReset, for the cases that reset
+
+static unsigned __int32 rngState = 1;
+
+// xorshift, so that the frames are the same whichever C library we're built with
+static unsigned __int32 nextRandom(){
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+	return rngState;
+}
+
+static void makeFrame(bgCheckCase c, int f, unsigned __int8 * im, int nPixels){
+
+	int i;
+
+	for(i = 0; i < nPixels; i++){
+		switch(c){
+		case BGCHECK_DRIFT:
+			im[i] = (unsigned __int8)((i*7 + f/50 + nextRandom()%9) % 256);
+			break;
+		case BGCHECK_NOISE:
+			im[i] = (unsigned __int8)(nextRandom() % 256);
+			break;
+		case BGCHECK_JUMP:
+			im[i] = (unsigned __int8)((i*7 + (f/200)*128 + nextRandom()%5) % 256);
+			break;
+		case BGCHECK_WRAP:
+			im[i] = (unsigned __int8)((i*7 + 100 + nextRandom()%2) % 256);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+// returns false at the first update at which the models differ
+static bool checkCase(bgCheckCase c, int nPixels, int nFrames){
+
+	int minNFramesReset = c == BGCHECK_WRAP ? nFrames + 1 : BGCHECKRESETFRAMES;
+	BackgroundModel scan(nPixels,minNFramesReset,false);
+	BackgroundModel incremental(nPixels,minNFramesReset,true);
+	unsigned __int8 * im = new unsigned __int8[nPixels];
+	const float * scanCenter;
+	const float * incrementalCenter;
+	int f, i, nUpdates = 0;
+	bool res = true;
+
+	for(f = 0; f < nFrames && res; f++){
+		makeFrame(c,f,im,nPixels);
+		scan.addFrame(im,(double)f);
+		incremental.addFrame(im,(double)f);
+		if(f % BGCHECKUPDATEPERIOD != BGCHECKUPDATEPERIOD-1){
+			continue;
+		}
+		scan.updateModel();
+		incremental.updateModel();
+		nUpdates++;
+		scanCenter = scan.getBGCenter();
+		incrementalCenter = incremental.getBGCenter();
+		for(i = 0; i < nPixels; i++){
+			if(scanCenter[i] != incrementalCenter[i]){
+				printf("%s: frame %d, pixel %d: incremental median %f, full scan %f\n",
+					caseNames[c],f,i,incrementalCenter[i],scanCenter[i]);
+				res = false;
+				break;
+			}
+		}
+	}
+
+	if(res){
+		printf("%s: %d updates of %d pixels agree\n",caseNames[c],nUpdates,nPixels);
+	}
+	delete [] im;
+	return res;
+}
+
+int main(int argc, char * argv[]){
+
+	int nPixels = 5000;
+	int nFrames = 1000;
+	int c;
+	bool res = true;
+
+	if(argc > 4){
+		fprintf(stderr,"usage: ufmfBGCheck [nPixels] [nFrames] [seed]\n");
+		return 1;
+	}
+	if(argc > 1) nPixels = atoi(argv[1]);
+	if(argc > 2) nFrames = atoi(argv[2]);
+	if(argc > 3) rngState = (unsigned __int32)strtoul(argv[3],NULL,10);
+	if(nPixels <= 0 || nFrames <= 0 || rngState == 0){
+		fprintf(stderr,"nPixels, nFrames and seed must be positive\n");
+		return 1;
+	}
+
+	for(c = 0; c < BGCHECK_NUM_CASES; c++){
+		res = checkCase((bgCheckCase)c,nPixels,nFrames) && res;
+	}
+
+	return res ? 0 : 1;
+}
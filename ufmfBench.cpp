@@ -0,0 +1,388 @@
+// ufmfBench: time the writer and its per-pixel kernels on synthetic frames.
+//
+// usage: ufmfBench movie.ufmf [width height nFrames [paramsFile]]
+//
+// each kernel is timed against the code it replaced, which is kept here as the reference:
+//   background model: constructing the model, and the cost of each addFrame and updateModel, with
+//     the counts in one block against a separate allocation per pixel
+//   accumulate: BackgroundModel::addFrame at 1 to 4 MP, against the bounds-checked loop
+//   threshold: the foreground mask of a frame, as packed bits against a bool per pixel, in frames per
+//     second on one compression thread
+// then nFrames frames of width x height (1024 x 1024 x 1000 by default) are written to movie.ufmf with
+// UFMFNThreads at 1, 2, 4, 8, 16 and 32, and added as fast as the writer takes them. for each it
+// prints the frames written per second and how long addFrame held the caller. the other parameters
+// come from paramsFile if given, otherwise they are the writer's defaults. how the rate changes
+// with the thread count depends on the cores the machine has.
+
+#include "ufmfPlatform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ufmfWriter.h"
+#include "ufmfKernels.h"
+
+#define BENCHNBINS 256 // BGNBins with BGBinSize 1, as BackgroundModel has it
+#define BENCHNFRAMES 64 // distinct frames generated; longer runs cycle through them
+#define BENCHNFLIES 20 // blobs moving across each frame
+#define BENCHBACKSUBTHRESH 15 // threshold the bounds are set from, as UFMFBackSubThresh
+#define BENCHFPS 100.0 // frame rate the timestamps are made up at
+#define BENCHMAXTHREADS 32
+
+static volatile unsigned __int64 sink = 0; // results go here, so the work being timed can't be optimized out
+
+static unsigned __int32 hash32(unsigned __int32 x){
+	x ^= x >> 16; x *= 0x7feb352d;
+	x ^= x >> 15; x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+// a lit arena with a little noise, and dark blobs that move a few pixels a frame
+static void makeFrame(unsigned __int8 * im, int width, int height, int f){
+
+	int r, c, k, r0, c0, size;
+
+	for(r = 0; r < height; r++){
+		for(c = 0; c < width; c++){
+			im[r*width+c] = (unsigned __int8)(150 + (r+c)%32 + hash32((unsigned __int32)(r*width+c)*7919u + (unsigned __int32)f*104729u)%5);
+		}
+	}
+	for(k = 0; k < BENCHNFLIES; k++){
+		size = 6 + (k*5)%14;
+		r0 = (int)((hash32(k*2) + (unsigned __int32)f*(1+k%3)) % (unsigned __int32)max(1,height-size));
+		c0 = (int)((hash32(k*2+1) + (unsigned __int32)f*(2+k%4)) % (unsigned __int32)max(1,width-size));
+		for(r = r0; r < r0+size && r < height; r++){
+			for(c = c0; c < c0+size && c < width; c++){
+				im[r*width+c] = (unsigned __int8)(20 + hash32(r*31+c+k)%40);
+			}
+		}
+	}
+}
+
+static double secondsSince(ULARGE_INTEGER t0){
+	return (double)(ufmfWriterStats::getTime().QuadPart - t0.QuadPart) / 1e7;
+}
+
+// *** reference implementations, as they were before the kernels replaced them ***
+
+// the background model with a separately allocated row of counts per pixel. the original never
+// freed the rows; here they are freed, so that one run can time several models
+class oldBackgroundModel {
+
+public:
+
+	oldBackgroundModel(int nPixels){
+		this->nPixels = nPixels;
+		BGZ = 0;
+		BGCounts = new unsigned __int8*[nPixels];
+		for(int i = 0; i < nPixels; i++){
+			BGCounts[i] = new unsigned __int8[BENCHNBINS];
+			memset(BGCounts[i],0,BENCHNBINS*sizeof(unsigned __int8));
+		}
+		BGCenter = new float[nPixels];
+		memset(BGCenter,0,nPixels*sizeof(float));
+	}
+
+	~oldBackgroundModel(){
+		for(int i = 0; i < nPixels; i++){
+			delete [] BGCounts[i];
+		}
+		delete [] BGCounts;
+		delete [] BGCenter;
+	}
+
+	bool addFrame(unsigned __int8 * im){
+		for(int i = 0; i < nPixels; i++){
+			if(im[i] >= BENCHNBINS){
+				return false;
+			}
+			BGCounts[i][im[i]]++;
+		}
+		BGZ++;
+		return true;
+	}
+
+	void updateModel(){
+		unsigned __int8 off = (unsigned __int8)(BGZ/2);
+		unsigned __int32 countscurr;
+		int i, j;
+		for(i = 0; i < nPixels; i++){
+			for(j = 0, countscurr = 0; j < BENCHNBINS && countscurr <= off; j++){
+				countscurr += (unsigned __int32)BGCounts[i][j];
+			}
+			BGCenter[i] = (float)(j-1);
+		}
+	}
+
+	int nPixels;
+	float BGZ;
+	unsigned __int8 ** BGCounts;
+	float * BGCenter;
+
+};
+
+// a bool per pixel, and a count of the foreground
+static int oldThreshold(const unsigned __int8 * im, const unsigned __int8 * lower, const unsigned __int8 * upper,
+						bool * isFore, int nPixels){
+	int numFore = 0;
+	for(int i = 0; i < nPixels; i++){
+		isFore[i] = (im[i] < lower[i]) || (im[i] > upper[i]);
+		if(isFore[i]) numFore++;
+	}
+	return numFore;
+}
+
+// *** benchmarks ***
+
+// construction, and time per addFrame and updateModel, of each layout
+static void benchBackgroundModel(unsigned __int8 ** frames, int nPixels, int nCalls){
+
+	ULARGE_INTEGER t0;
+	double constructOld, constructNew, addOld, addNew, updateOld, updateNew;
+	int f;
+
+	t0 = ufmfWriterStats::getTime();
+	oldBackgroundModel * oldModel = new oldBackgroundModel(nPixels);
+	constructOld = secondsSince(t0);
+	t0 = ufmfWriterStats::getTime();
+	for(f = 0; f < nCalls; f++){
+		oldModel->addFrame(frames[f % BENCHNFRAMES]);
+	}
+	addOld = secondsSince(t0) / nCalls;
+	t0 = ufmfWriterStats::getTime();
+	for(f = 0; f < nCalls; f++){
+		oldModel->updateModel();
+	}
+	updateOld = secondsSince(t0) / nCalls;
+	sink += (unsigned __int64)oldModel->BGCenter[nPixels/2];
+	delete oldModel;
+
+	t0 = ufmfWriterStats::getTime();
+	BackgroundModel * model = new BackgroundModel(nPixels,nCalls+1);
+	constructNew = secondsSince(t0);
+	t0 = ufmfWriterStats::getTime();
+	for(f = 0; f < nCalls; f++){
+		model->addFrame(frames[f % BENCHNFRAMES],(double)f);
+	}
+	addNew = secondsSince(t0) / nCalls;
+	t0 = ufmfWriterStats::getTime();
+	for(f = 0; f < nCalls; f++){
+		model->updateModel();
+	}
+	updateNew = secondsSince(t0) / nCalls;
+	sink += (unsigned __int64)model->getBGCenter()[nPixels/2];
+	delete model;
+
+	printf("background model, %d pixels: construct %.1f ms -> %.1f ms, addFrame %.2f ms -> %.2f ms, updateModel %.2f ms -> %.2f ms\n",
+		nPixels,constructOld*1e3,constructNew*1e3,addOld*1e3,addNew*1e3,updateOld*1e3,updateNew*1e3);
+}
+
+// adding frames to the counts at 1 to 4 MP, on frames tiled from the width x height ones
+static void benchAccumulate(unsigned __int8 ** frames, int nPixels, int nCalls){
+
+	ULARGE_INTEGER t0;
+	double tOld, tNew;
+	unsigned __int8 * im;
+	int mp, n, i, f;
+
+	for(mp = 1; mp <= 4; mp++){
+
+		n = mp << 20;
+		im = new unsigned __int8[n];
+		for(i = 0; i < n; i += nPixels){
+			memcpy(im+i,frames[(i/nPixels) % BENCHNFRAMES],min(nPixels,n-i));
+		}
+
+		// one at a time, since at 4 MP each layout is a GB of counts
+		oldBackgroundModel * oldModel = new oldBackgroundModel(n);
+		t0 = ufmfWriterStats::getTime();
+		for(f = 0; f < nCalls; f++){
+			oldModel->addFrame(im);
+		}
+		tOld = secondsSince(t0) / nCalls;
+		sink += oldModel->BGCounts[n/2][im[n/2]];
+		delete oldModel;
+
+		BackgroundModel * model = new BackgroundModel(n,nCalls+1);
+		t0 = ufmfWriterStats::getTime();
+		for(f = 0; f < nCalls; f++){
+			model->addFrame(im,(double)f);
+		}
+		tNew = secondsSince(t0) / nCalls;
+		delete model;
+
+		printf("accumulate, %d MP: %.2f ms -> %.2f ms per frame, %.0f -> %.0f Mpixels/s\n",
+			mp,tOld*1e3,tNew*1e3,n/tOld/1e6,n/tNew/1e6);
+		delete [] im;
+	}
+}
+
+// the foreground mask of each frame against bounds around the first one
+static void benchThreshold(unsigned __int8 ** frames, int width, int height, int nCalls){
+
+	int nPixels = width*height;
+	int foreStride = (width + 63) / 64;
+	unsigned __int8 * lower = new unsigned __int8[nPixels];
+	unsigned __int8 * upper = new unsigned __int8[nPixels];
+	bool * isFore = new bool[nPixels];
+	unsigned __int64 * mask = new unsigned __int64[height*foreStride];
+	ULARGE_INTEGER t0;
+	double tOld, tNew;
+	int i, f, r, numFore;
+
+	for(i = 0; i < nPixels; i++){
+		lower[i] = (unsigned __int8)max(0,(int)frames[0][i] - BENCHBACKSUBTHRESH);
+		upper[i] = (unsigned __int8)min(255,(int)frames[0][i] + BENCHBACKSUBTHRESH);
+	}
+
+	t0 = ufmfWriterStats::getTime();
+	for(f = 0; f < nCalls; f++){
+		sink += oldThreshold(frames[f % BENCHNFRAMES],lower,upper,isFore,nPixels);
+	}
+	tOld = secondsSince(t0) / nCalls;
+
+	t0 = ufmfWriterStats::getTime();
+	for(f = 0; f < nCalls; f++){
+		for(r = 0, numFore = 0; r < height; r++){
+			numFore += ufmfThresholdRow(frames[f % BENCHNFRAMES]+r*width,lower+r*width,upper+r*width,mask+r*foreStride,width);
+		}
+		sink += numFore;
+	}
+	tNew = secondsSince(t0) / nCalls;
+
+	printf("threshold, %d x %d: %.2f ms -> %.2f ms per frame, %.0f -> %.0f fps per compression thread\n",
+		width,height,tOld*1e3,tNew*1e3,1.0/tOld,1.0/tNew);
+
+	delete [] lower;
+	delete [] upper;
+	delete [] isFore;
+	delete [] mask;
+}
+
+// write the movie with nThreads compression threads. returns false if the writer failed
+static bool benchWriter(const char * fileName, const char * paramsFile, unsigned __int8 ** frames,
+						int width, int height, int nFrames, int nThreads){
+
+	char benchParamsFile[1000];
+	char logFileName[1000];
+	char line[1000];
+	FILE * fp;
+	FILE * src;
+	FILE * logFID;
+	ufmfWriter * writer;
+	ULARGE_INTEGER t0, t1;
+	double addTime, maxAddTime = 0, sumAddTime = 0, totalTime;
+	unsigned __int64 nWritten;
+	int f;
+
+	// the params file with UFMFNThreads set, which readParamsFile takes the last value of
+	if(snprintf(benchParamsFile,sizeof(benchParamsFile),"%s.params.txt",fileName) >= (int)sizeof(benchParamsFile) ||
+		snprintf(logFileName,sizeof(logFileName),"%s.log",fileName) >= (int)sizeof(logFileName)){
+		fprintf(stderr,"Movie name %s is too long\n",fileName);
+		return false;
+	}
+	fp = fopen(benchParamsFile,"w");
+	if(fp == NULL){
+		fprintf(stderr,"Could not open %s for writing\n",benchParamsFile);
+		return false;
+	}
+	if(paramsFile != NULL){
+		src = fopen(paramsFile,"r");
+		if(src == NULL){
+			fprintf(stderr,"Could not open %s\n",paramsFile);
+			fclose(fp);
+			return false;
+		}
+		while(fgets(line,sizeof(line),src) != NULL){
+			fputs(line,fp);
+		}
+		fclose(src);
+		fprintf(fp,"\n");
+	}
+	else{
+		fprintf(fp,"UFMFPrintStats = 0\n");
+	}
+	fprintf(fp,"UFMFNThreads = %d\n",nThreads);
+	fclose(fp);
+
+	logFID = fopen(logFileName,"w");
+	if(logFID == NULL){
+		fprintf(stderr,"Could not open %s for writing\n",logFileName);
+		return false;
+	}
+
+	writer = new ufmfWriter(fileName,width,height,logFID,benchParamsFile);
+	t0 = ufmfWriterStats::getTime();
+	if(!writer->startWrite()){
+		fprintf(stderr,"Could not start writing %s, see %s\n",fileName,logFileName);
+		delete writer;
+		fclose(logFID);
+		return false;
+	}
+	for(f = 0; f < nFrames; f++){
+		t1 = ufmfWriterStats::getTime();
+		if(!writer->addFrame(frames[f % BENCHNFRAMES],f/BENCHFPS)){
+			fprintf(stderr,"Could not add frame %d, see %s\n",f,logFileName);
+			break;
+		}
+		addTime = secondsSince(t1);
+		sumAddTime += addTime;
+		if(addTime > maxAddTime) maxAddTime = addTime;
+	}
+	nWritten = writer->stopWrite();
+	totalTime = secondsSince(t0);
+
+	printf("writer, %2d threads: %6.1f fps, %llu of %d frames written, addFrame %.3f ms mean %.3f ms max\n",
+		nThreads,nWritten/totalTime,nWritten,nFrames,sumAddTime/max(f,1)*1e3,maxAddTime*1e3);
+
+	delete writer;
+	fclose(logFID);
+	return f == nFrames && nWritten == (unsigned __int64)nFrames;
+}
+
+int main(int argc, char * argv[]){
+
+	const char * fileName;
+	const char * paramsFile = NULL;
+	int width = 1024, height = 1024, nFrames = 1000;
+	int nPixels, f, nThreads;
+	unsigned __int8 * frames[BENCHNFRAMES];
+	bool res = true;
+
+	if(argc != 2 && argc != 5 && argc != 6){
+		fprintf(stderr,"usage: ufmfBench movie.ufmf [width height nFrames [paramsFile]]\n");
+		return 1;
+	}
+	fileName = argv[1];
+	if(argc >= 5){
+		width = atoi(argv[2]);
+		height = atoi(argv[3]);
+		nFrames = atoi(argv[4]);
+	}
+	if(argc == 6){
+		paramsFile = argv[5];
+	}
+	if(width <= 0 || height <= 0 || width > 65535 || height > 65535 || nFrames <= 0){
+		fprintf(stderr,"width and height must be 1 to 65535, and nFrames positive\n");
+		return 1;
+	}
+
+	nPixels = width*height;
+	for(f = 0; f < BENCHNFRAMES; f++){
+		frames[f] = new unsigned __int8[nPixels];
+		makeFrame(frames[f],width,height,f);
+	}
+
+	benchBackgroundModel(frames,nPixels,20);
+	benchAccumulate(frames,nPixels,10);
+	benchThreshold(frames,width,height,100);
+
+	for(nThreads = 1; nThreads <= BENCHMAXTHREADS && res; nThreads *= 2){
+		res = benchWriter(fileName,paramsFile,frames,width,height,nFrames,nThreads);
+	}
+
+	for(f = 0; f < BENCHNFRAMES; f++){
+		delete [] frames[f];
+	}
+	return res ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+#include "ufmfPlatform.h"
+#include <stdio.h>
+#include "ufmfIndex.h"
+
+// one record of the spill file
+typedef struct {
+	__int64 loc;
+	double timestamp;
+} ufmfIndexRecord;
+
+ufmfIndex::ufmfIndex(ufmfLogger * logger, const char * spillFileName, unsigned __int32 maxInMemory){
+
+	this->logger = logger;
+	strncpy(this->spillFileName,spillFileName,sizeof(this->spillFileName)-1);
+	this->spillFileName[sizeof(this->spillFileName)-1] = '\0';
+	this->maxInMemory = maxInMemory;
+	spillFile = NULL;
+	nSpilled = 0;
+	spillFailed = false;
+
+	if(maxInMemory > 0){
+		locs.reserve(2*maxInMemory);
+		timestamps.reserve(2*maxInMemory);
+	}
+
+}
+
+// keeps the spill file: if we get here without the index having been written, it is all that is left of it
+ufmfIndex::~ufmfIndex(){
+	close(false);
+}
+
+bool ufmfIndex::push_back(__int64 loc, double timestamp){
+
+	locs.push_back(loc);
+	timestamps.push_back(timestamp);
+
+	if(maxInMemory > 0 && !spillFailed && locs.size() >= 2*(size_t)maxInMemory){
+		return spill();
+	}
+	return true;
+
+}
+
+unsigned __int64 ufmfIndex::size(){
+	return nSpilled + locs.size();
+}
+
+unsigned __int64 ufmfIndex::base(){
+	return nSpilled;
+}
+
+bool ufmfIndex::spill(){
+
+	unsigned __int32 i;
+
+	if(spillFile == NULL){
+		spillFile = fopen(spillFileName,"w+b");
+		if(spillFile == NULL){
+			logger->log(UFMF_ERROR,"Error creating index spill file %s, keeping the whole index in memory\n",spillFileName);
+			spillFailed = true;
+			return false;
+		}
+		logger->log(UFMF_DEBUG_3,"Spilling index to %s\n",spillFileName);
+	}
+
+	ufmfIndexRecord * records = new ufmfIndexRecord[maxInMemory];
+	for(i = 0; i < maxInMemory; i++){
+		records[i].loc = locs[i];
+		records[i].timestamp = timestamps[i];
+	}
+	bool res = fwrite(records,sizeof(ufmfIndexRecord),maxInMemory,spillFile) == maxInMemory && fflush(spillFile) == 0;
+	delete [] records;
+
+	if(!res){
+		logger->log(UFMF_ERROR,"Error writing to index spill file %s, keeping the rest of the index in memory\n",spillFileName);
+		spillFailed = true;
+		return false;
+	}
+
+	locs.erase(locs.begin(),locs.begin()+maxInMemory);
+	timestamps.erase(timestamps.begin(),timestamps.begin()+maxInMemory);
+	nSpilled += maxInMemory;
+	logger->log(UFMF_DEBUG_7,"Spilled index entries up to %llu\n",nSpilled);
+
+	return true;
+
+}
+
+bool ufmfIndex::writeLocs(ufmfOutput * output, unsigned __int64 first){
+	return writeField(output,false,first);
+}
+
+bool ufmfIndex::writeTimestamps(ufmfOutput * output, unsigned __int64 first){
+	return writeField(output,true,first);
+}
+
+bool ufmfIndex::writeField(ufmfOutput * output, bool writeTimestamps, unsigned __int64 first){
+
+	bool res = true;
+	unsigned __int64 nRead;
+	size_t i, n;
+
+	// spilled entries, read back in order
+	if(first < nSpilled){
+		ufmfIndexRecord * records = new ufmfIndexRecord[UFMFINDEXREADRECORDS];
+		__int64 * field = new __int64[UFMFINDEXREADRECORDS];
+		if(_fseeki64(spillFile,(__int64)(first*sizeof(ufmfIndexRecord)),SEEK_SET) != 0){
+			logger->log(UFMF_ERROR,"Error seeking in index spill file %s\n",spillFileName);
+			res = false;
+		}
+		for(nRead = first; res && nRead < nSpilled; nRead += n){
+			n = (size_t)min((unsigned __int64)UFMFINDEXREADRECORDS,nSpilled - nRead);
+			if(fread(records,sizeof(ufmfIndexRecord),n,spillFile) != n){
+				logger->log(UFMF_ERROR,"Error reading index spill file %s\n",spillFileName);
+				res = false;
+				break;
+			}
+			for(i = 0; i < n; i++){
+				if(writeTimestamps) memcpy(&field[i],&records[i].timestamp,8);
+				else field[i] = records[i].loc;
+			}
+			res = output->write(field,8*n);
+		}
+		delete [] field;
+		delete [] records;
+		// seek back to the end so that we can keep spilling
+		_fseeki64(spillFile,0,SEEK_END);
+	}
+
+	// entries in memory
+	size_t firstInMemory = (size_t)(first > nSpilled ? first - nSpilled : 0);
+	if(res && locs.size() > firstInMemory){
+		if(writeTimestamps) res = output->write(&timestamps[firstInMemory],8*(timestamps.size()-firstInMemory));
+		else res = output->write(&locs[firstInMemory],8*(locs.size()-firstInMemory));
+	}
+
+	return res;
+
+}
+
+void ufmfIndex::close(bool deleteSpillFile){
+
+	if(spillFile != NULL){
+		fclose(spillFile);
+		spillFile = NULL;
+		if(deleteSpillFile && !DeleteFileA(spillFileName)){
+			logger->log(UFMF_WARNING,"Could not delete index spill file %s\n",spillFileName);
+		}
+	}
+
+}
@@ -0,0 +1,63 @@
+#ifndef __UFMF_INDEX_H
+#define __UFMF_INDEX_H
+
+#include "ufmfPlatform.h"
+#include <stdio.h>
+#include <vector>
+#include "ufmfLogger.h"
+#include "ufmfOutput.h"
+
+#define UFMFINDEXREADRECORDS 8192 // records read back from the spill file at a time
+
+// location and timestamp of each frame or keyframe written, in the order they were written.
+// only the most recent entries are kept in memory: once there are 2*maxInMemory, the oldest
+// maxInMemory are appended to a spill file next to the movie, as (loc, timestamp) pairs of an
+// __int64 and a double. the spill file is flushed as it is written, so the index of everything
+// spilled survives a crash. at close, the index arrays are written from the spill file followed
+// by the entries in memory, and the spill file is deleted.
+// with maxInMemory = 0 nothing is spilled
+class ufmfIndex {
+
+public:
+
+	ufmfIndex(ufmfLogger * logger, const char * spillFileName, unsigned __int32 maxInMemory = 65536);
+	~ufmfIndex();
+
+	// add an entry, spilling old entries if there are too many in memory
+	bool push_back(__int64 loc, double timestamp);
+
+	// total number of entries, spilled or not
+	unsigned __int64 size();
+
+	// number of entries spilled. entry i is at locs[i-base()] if i >= base()
+	unsigned __int64 base();
+
+	// append the locations or the timestamps of entries first on to output, in order
+	bool writeLocs(ufmfOutput * output, unsigned __int64 first = 0);
+	bool writeTimestamps(ufmfOutput * output, unsigned __int64 first = 0);
+
+	// close the spill file, and delete it once the index has been written to the movie
+	void close(bool deleteSpillFile = true);
+
+	// entries that have not been spilled, the most recent ones
+	std::vector<__int64> locs;
+	std::vector<double> timestamps;
+
+private:
+
+	// append the oldest maxInMemory entries to the spill file
+	bool spill();
+
+	// append either field of entries first on to output
+	bool writeField(ufmfOutput * output, bool writeTimestamps, unsigned __int64 first);
+
+	ufmfLogger * logger;
+	char spillFileName[1000];
+	unsigned __int32 maxInMemory;
+	FILE * spillFile; // created at the first spill
+	unsigned __int64 nSpilled;
+	bool spillFailed;
+
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef __UFMF_KERNELS_H
+#define __UFMF_KERNELS_H
+
+// per-pixel inner loops used by the background model and frame compression
+
+#include <string.h>
+#include <emmintrin.h>
+#include "ufmfPlatform.h"
+
+// add one frame to the per-pixel histograms.
+// counts for pixel i start at counts[i*stride], and the bin for value v is v/binSize.
+// 8-bit input can never fall outside the BGNBins = ceil(256/binSize) bins, so there is no bounds check.
+// there is no scatter-increment in SSE2/AVX2 (every pixel hits a different count row), so instead of
+// vector instructions the common binSize == 1 case is unrolled 16 pixels per iteration: the increments
+// are independent, so they can all be in flight at once. since no two pixels share a row, splitting
+// into sub-histograms buys nothing. AVX-512 can do it as a dword gather, a per-byte add and a scatter,
+// which was only 12-20% faster at 1 and 4 MP, and needs a newer compiler than VS2010 plus a CPU check.
+static inline void ufmfAccumulateCounts(const unsigned __int8 * im, unsigned __int8 * counts, int nPixels, int stride, int binSize){
+
+	int i = 0;
+
+	if(binSize == 1){
+#define UFMF_ACCUMULATE1(k) counts[(k)*stride + im[k]]++
+		for(; i + 16 <= nPixels; i += 16, im += 16, counts += 16*stride){
+			UFMF_ACCUMULATE1(0);  UFMF_ACCUMULATE1(1);  UFMF_ACCUMULATE1(2);  UFMF_ACCUMULATE1(3);
+			UFMF_ACCUMULATE1(4);  UFMF_ACCUMULATE1(5);  UFMF_ACCUMULATE1(6);  UFMF_ACCUMULATE1(7);
+			UFMF_ACCUMULATE1(8);  UFMF_ACCUMULATE1(9);  UFMF_ACCUMULATE1(10); UFMF_ACCUMULATE1(11);
+			UFMF_ACCUMULATE1(12); UFMF_ACCUMULATE1(13); UFMF_ACCUMULATE1(14); UFMF_ACCUMULATE1(15);
+		}
+#undef UFMF_ACCUMULATE1
+		for(; i < nPixels; i++, im++, counts += stride){
+			counts[im[0]]++;
+		}
+	}
+	else{
+		for(; i < nPixels; i++, im++, counts += stride){
+			counts[im[0]/binSize]++;
+		}
+	}
+}
+
+// same as ufmfAccumulateCounts, but also keeps each pixel's running median cursor current:
+// below[i] is the sum of pixel i's counts in the bins under median[i]. counts are 8-bit, so when
+// a count under the cursor wraps to 0 the sum drops by 255 instead of growing by 1, which keeps
+// below[i] equal to what a scan of the stored counts would give.
+static inline void ufmfAccumulateCountsMedian(const unsigned __int8 * im, unsigned __int8 * counts, const unsigned __int8 * median,
+											  unsigned __int16 * below, int nPixels, int stride, int binSize){
+
+	unsigned __int8 bin, c;
+
+	for(int i = 0; i < nPixels; i++, counts += stride){
+		bin = (binSize == 1) ? im[i] : (unsigned __int8)(im[i]/binSize);
+		c = ++counts[bin];
+		if(bin < median[i]){
+			if(c == 0) below[i] -= 255;
+			else below[i]++;
+		}
+	}
+}
+
+// number of bits set in x
+static inline int ufmfPopCount64(unsigned __int64 x){
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+}
+
+// threshold a row of width pixels: pixel c is foreground if im[c] < lower[c] or im[c] > upper[c].
+// sets bit c%64 of mask[c/64] for each foreground pixel, clears the bits past width in the last word,
+// and returns the number of foreground pixels.
+// 16 pixels are compared at a time with SSE2, which every x64 processor has: subs_epu8(lower,im) is
+// nonzero exactly when im < lower, and subs_epu8(im,upper) exactly when im > upper.
+static inline int ufmfThresholdRow(const unsigned __int8 * im, const unsigned __int8 * lower, const unsigned __int8 * upper,
+								   unsigned __int64 * mask, int width){
+
+	int c, k, n = 0;
+	unsigned __int64 word;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i x, fg;
+
+	for(c = 0; c + 64 <= width; c += 64, mask++){
+		word = 0;
+		for(k = 0; k < 64; k += 16){
+			x = _mm_loadu_si128((const __m128i*)(im + c + k));
+			fg = _mm_or_si128(_mm_subs_epu8(_mm_loadu_si128((const __m128i*)(lower + c + k)),x),
+				_mm_subs_epu8(x,_mm_loadu_si128((const __m128i*)(upper + c + k))));
+			word |= (unsigned __int64)(~_mm_movemask_epi8(_mm_cmpeq_epi8(fg,zero)) & 0xFFFF) << k;
+		}
+		*mask = word;
+		n += ufmfPopCount64(word);
+	}
+
+	// last partial word
+	if(c < width){
+		word = 0;
+		for(k = 0; c + k < width; k++){
+			if(im[c+k] < lower[c+k] || im[c+k] > upper[c+k]) word |= (unsigned __int64)1 << k;
+		}
+		*mask = word;
+		n += ufmfPopCount64(word);
+	}
+
+	return n;
+}
+
+// index of the lowest set bit of x, which must be nonzero
+static inline int ufmfFirstBit64(unsigned __int64 x){
+	unsigned long b;
+	_BitScanForward64(&b,x);
+	return (int)b;
+}
+
+// mask of bits c0%64 through c1%64 of the word holding both, c0 <= c1 < c0/64*64 + 64
+static inline unsigned __int64 ufmfBitRange64(int c0, int c1){
+	return (~(unsigned __int64)0 >> (63 - (c1 & 63))) & (~(unsigned __int64)0 << (c0 & 63));
+}
+
+// first set bit in [c0,c1) of a row of a bitmask, or c1 if there is none
+static inline int ufmfFindBit(const unsigned __int64 * row, int c0, int c1){
+	int w, w1;
+	unsigned __int64 word;
+	if(c0 >= c1) return c1;
+	w = c0 >> 6;
+	w1 = (c1 - 1) >> 6;
+	word = row[w] & (~(unsigned __int64)0 << (c0 & 63));
+	while(word == 0){
+		if(++w > w1) return c1;
+		word = row[w];
+	}
+	c0 = (w << 6) + ufmfFirstBit64(word);
+	return c0 < c1 ? c0 : c1;
+}
+
+// first clear bit in [c0,c1) of a row of a bitmask, or c1 if there is none
+static inline int ufmfFindClearBit(const unsigned __int64 * row, int c0, int c1){
+	int w, w1;
+	unsigned __int64 word;
+	if(c0 >= c1) return c1;
+	w = c0 >> 6;
+	w1 = (c1 - 1) >> 6;
+	word = ~row[w] & (~(unsigned __int64)0 << (c0 & 63));
+	while(word == 0){
+		if(++w > w1) return c1;
+		word = ~row[w];
+	}
+	c0 = (w << 6) + ufmfFirstBit64(word);
+	return c0 < c1 ? c0 : c1;
+}
+
+// set (value = true) or clear bits [c0,c1) of a row of a bitmask
+static inline void ufmfSetBits(unsigned __int64 * row, int c0, int c1, bool value){
+	int w, w1;
+	unsigned __int64 m;
+	if(c0 >= c1) return;
+	w = c0 >> 6;
+	w1 = (c1 - 1) >> 6;
+	for(; w <= w1; w++, c0 = w << 6){
+		m = ufmfBitRange64(c0,w < w1 ? c0 | 63 : c1 - 1);
+		if(value) row[w] |= m;
+		else row[w] &= ~m;
+	}
+}
+
+#endif
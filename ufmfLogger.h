@@ -2,7 +2,7 @@
 #define __UFMF_LOGGER
 
 #include <stdio.h>
-#include "windows.h"
+#include "ufmfPlatform.h"
 
 typedef enum {
 	UFMF_CRITICAL_ERROR=0,
@@ -0,0 +1,979 @@
+#include "ufmfPlatform.h"
+#include <stdio.h>
+#include <malloc.h>
+#include "ufmfOutput.h"
+
+ufmfOutput::ufmfOutput(ufmfLogger * logger, ufmfWriterStats * stats, unsigned __int32 blockSize, int nBlocks, bool unbuffered,
+					   ufmfOutputBackend backend, unsigned __int64 preallocateBytes){
+
+	int i;
+
+	this->logger = logger;
+	this->stats = stats;
+
+	// blocks are a whole number of alignment units, and we need at least two to overlap filling with writing
+	this->blockSize = max((unsigned __int32)UFMFOUTPUTALIGNMENT,(blockSize + UFMFOUTPUTALIGNMENT - 1) & ~(UFMFOUTPUTALIGNMENT - 1));
+	this->nBlocks = max(2,nBlocks);
+	this->unbuffered = unbuffered;
+	if(backend < 0 || backend >= UFMF_OUTPUT_NUM_BACKENDS){
+		logger->log(UFMF_WARNING,"Unknown output backend %d, using %s\n",(int)backend,backendName(UFMF_OUTPUT_THREADED));
+		backend = UFMF_OUTPUT_THREADED;
+	}
+	this->backend = backend;
+	this->preallocateBytes = preallocateBytes;
+
+	strcpy(fileName,"");
+	nTargets = 1;
+	for(i = 0; i < UFMFOUTPUTMAXTARGETS; i++){
+		strcpy(targetDirs[i],"");
+		strcpy(targetFileNames[i],"");
+		files[i] = INVALID_HANDLE_VALUE;
+		targetBytes[i] = 0;
+		targetWaitSeconds[i] = 0;
+	}
+	fp = NULL;
+	offset = 0;
+	isFinished = false;
+	ioFailed = false;
+
+	blocks = NULL;
+	blockLengths = NULL;
+	blockOffsets = NULL;
+	fillBlock = 0;
+	fillLength = 0;
+	fillOffset = 0;
+	ioBlock = 0;
+	nBlocksQueued = 0;
+	overlaps = NULL;
+	blockInFlight = NULL;
+	mapping = NULL;
+	mappedSize = 0;
+
+	maxQueueDepth = 0;
+	nBlocksWritten = 0;
+	ioWaitSeconds = 0;
+
+	_ioThread = NULL;
+	lock = NULL;
+	blockFreeSignal = NULL;
+	blockQueuedSignal = NULL;
+
+}
+
+ufmfOutput::~ufmfOutput(){
+
+	int i;
+
+	close();
+
+	if(blocks != NULL){
+		for(i = 0; i < nBlocks; i++){
+			if(blocks[i] != NULL) _aligned_free(blocks[i]);
+		}
+		delete [] blocks; blocks = NULL;
+	}
+	if(blockLengths != NULL){
+		delete [] blockLengths; blockLengths = NULL;
+	}
+	if(blockOffsets != NULL){
+		delete [] blockOffsets; blockOffsets = NULL;
+	}
+	if(overlaps != NULL){
+		for(i = 0; i < nBlocks; i++){
+			if(overlaps[i].hEvent != NULL) CloseHandle(overlaps[i].hEvent);
+		}
+		delete [] overlaps; overlaps = NULL;
+	}
+	if(blockInFlight != NULL){
+		delete [] blockInFlight; blockInFlight = NULL;
+	}
+	if(lock != NULL){
+		CloseHandle(lock); lock = NULL;
+	}
+	if(blockFreeSignal != NULL){
+		CloseHandle(blockFreeSignal); blockFreeSignal = NULL;
+	}
+	if(blockQueuedSignal != NULL){
+		CloseHandle(blockQueuedSignal); blockQueuedSignal = NULL;
+	}
+
+}
+
+const char * ufmfOutput::backendName(ufmfOutputBackend backend){
+	switch(backend){
+	case UFMF_OUTPUT_STDIO: return "stdio";
+	case UFMF_OUTPUT_THREADED: return "threaded";
+#ifdef _WIN32
+	case UFMF_OUTPUT_OVERLAPPED: return "overlapped";
+#else
+	case UFMF_OUTPUT_OVERLAPPED: return "io_uring"; // what the shim's overlapped writes are
+#endif
+	case UFMF_OUTPUT_MAPPED: return "mapped";
+	default: return "unknown";
+	}
+}
+
+ufmfOutputBackend ufmfOutput::getBackend(){
+	return backend;
+}
+
+int ufmfOutput::parseTargets(const char * targetList, char dirs[UFMFOUTPUTMAXTARGETS][1000]){
+
+	char list[UFMFOUTPUTMAXTARGETS*1000];
+	char * s;
+	size_t n;
+	int nDirs = 0;
+
+	strncpy(list,targetList,sizeof(list)-1);
+	list[sizeof(list)-1] = '\0';
+	for(s = strtok(list,","); s != NULL && nDirs < UFMFOUTPUTMAXTARGETS; s = strtok(NULL,",")){
+		while(*s == ' ' || *s == '\t') s++;
+		n = strlen(s);
+		while(n > 0 && (s[n-1] == ' ' || s[n-1] == '\t' || s[n-1] == '\r' || s[n-1] == '\n')) s[--n] = '\0';
+		if(n == 0 || n >= 1000) continue;
+		strcpy(dirs[nDirs++],s);
+	}
+
+	return nDirs;
+}
+
+// dir\name for a single target, dir\name.t for each of several
+bool ufmfOutput::targetFileName(const char * fileName, const char * dir, int t, int nTargets, char * targetFileName, size_t size){
+
+	const char * base = max(strrchr(fileName,'\\'),strrchr(fileName,'/'));
+	const char * sep;
+	size_t n = strlen(dir);
+	int len;
+
+	base = (base == NULL) ? fileName : base + 1;
+	sep = (n == 0 || dir[n-1] == '\\' || dir[n-1] == '/') ? "" : UFMFPATHSEP;
+	if(nTargets > 1){
+		len = snprintf(targetFileName,size,"%s%s%s.%d",dir,sep,base,t);
+	}
+	else{
+		len = snprintf(targetFileName,size,"%s%s%s",dir,sep,base);
+	}
+	return len >= 0 && (size_t)len < size;
+}
+
+bool ufmfOutput::setTargets(const char * targetList){
+
+	nTargets = parseTargets(targetList,targetDirs);
+	if(nTargets == 0){
+		logger->log(UFMF_WARNING,"No output directories in %s, writing to the movie's directory\n",targetList);
+		nTargets = 1;
+		return false;
+	}
+	return true;
+}
+
+bool ufmfOutput::open(const char * fileName){
+
+	int i;
+
+	strcpy(this->fileName,fileName);
+
+	// name the file of each target
+	for(i = 0; i < nTargets; i++){
+		if(strlen(targetDirs[i]) == 0){
+			strcpy(targetFileNames[i],fileName);
+		}
+		else if(!targetFileName(fileName,targetDirs[i],i,nTargets,targetFileNames[i],sizeof(targetFileNames[i]))){
+			logger->log(UFMF_ERROR,"Name of the file for %s in %s is too long\n",fileName,targetDirs[i]);
+			return false;
+		}
+		targetBytes[i] = 0;
+		targetWaitSeconds[i] = 0;
+	}
+	if(nTargets > 1 && (backend == UFMF_OUTPUT_STDIO || backend == UFMF_OUTPUT_MAPPED)){
+		logger->log(UFMF_WARNING,"The %s output backend can't stripe output, using the %s output backend\n",
+			backendName(backend),backendName(UFMF_OUTPUT_THREADED));
+		backend = UFMF_OUTPUT_THREADED;
+	}
+	openTime = ufmfWriterStats::getTime();
+
+	offset = 0;
+	isFinished = false;
+	ioFailed = false;
+	fillBlock = 0;
+	fillLength = 0;
+	fillOffset = 0;
+	ioBlock = 0;
+	nBlocksQueued = 0;
+	maxQueueDepth = 0;
+	nBlocksWritten = 0;
+	ioWaitSeconds = 0;
+
+	lock = CreateSemaphore(NULL,1,1,NULL);
+	if(lock == NULL){
+		logger->log(UFMF_ERROR,"Error creating output lock\n");
+		return false;
+	}
+
+	// stdio: no blocks, stdio does the buffering
+	if(backend == UFMF_OUTPUT_STDIO){
+		fp = fopen(targetFileNames[0],"wb");
+		if(fp == NULL){
+			logger->log(UFMF_ERROR,"Error opening file %s for writing\n",targetFileNames[0]);
+			return false;
+		}
+		setvbuf(fp,NULL,_IOFBF,blockSize);
+		if(unbuffered || preallocateBytes > 0){
+			logger->log(UFMF_WARNING,"Unbuffered output and preallocation are ignored by the stdio output backend\n");
+		}
+		logger->log(UFMF_DEBUG_3,"Writing %s with the %s output backend\n",fileName,backendName(backend));
+		return true;
+	}
+
+	// mapped: no blocks, writers copy into the mapped file
+	if(backend == UFMF_OUTPUT_MAPPED){
+		if(unbuffered){
+			logger->log(UFMF_WARNING,"Unbuffered output is ignored by the mapped output backend\n");
+			unbuffered = false;
+		}
+		if(openHandle(false)){
+			Lock();
+			if(growMapping(max(preallocateBytes,(unsigned __int64)UFMFOUTPUTMAPGROWTH))){
+				Unlock();
+				logger->log(UFMF_DEBUG_3,"Writing %s with the %s output backend\n",fileName,backendName(backend));
+				return true;
+			}
+			Unlock();
+			closeHandles();
+		}
+		logger->log(UFMF_WARNING,"Could not map %s, falling back to the %s output backend\n",fileName,backendName(UFMF_OUTPUT_THREADED));
+		backend = UFMF_OUTPUT_THREADED;
+	}
+
+	// allocate blocks
+	blocks = new unsigned __int8*[nBlocks];
+	blockLengths = new unsigned __int32[nBlocks];
+	blockOffsets = new unsigned __int64[nBlocks];
+	for(i = 0; i < nBlocks; i++){
+		blocks[i] = (unsigned __int8*)_aligned_malloc(blockSize,UFMFOUTPUTALIGNMENT);
+		if(blocks[i] == NULL){
+			logger->log(UFMF_ERROR,"Error allocating %u byte output block\n",blockSize);
+			return false;
+		}
+		blockLengths[i] = 0;
+		blockOffsets[i] = 0;
+	}
+
+	// overlapped: one outstanding request per block
+	if(backend == UFMF_OUTPUT_OVERLAPPED){
+		overlaps = new OVERLAPPED[nBlocks];
+		blockInFlight = new bool[nBlocks];
+		memset(overlaps,0,nBlocks*sizeof(OVERLAPPED));
+		for(i = 0; i < nBlocks; i++){
+			blockInFlight[i] = false;
+			overlaps[i].hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+			if(overlaps[i].hEvent == NULL){
+				logger->log(UFMF_WARNING,"Error creating output event, falling back to the %s output backend\n",backendName(UFMF_OUTPUT_THREADED));
+				backend = UFMF_OUTPUT_THREADED;
+				break;
+			}
+		}
+	}
+	if(backend == UFMF_OUTPUT_OVERLAPPED && !openHandle(true)){
+		logger->log(UFMF_WARNING,"Could not open %s for overlapped writes, falling back to the %s output backend\n",
+			fileName,backendName(UFMF_OUTPUT_THREADED));
+		backend = UFMF_OUTPUT_THREADED;
+	}
+	if(backend == UFMF_OUTPUT_OVERLAPPED){
+		// blocks are written from over and over, so have the kernel map them just once
+		for(i = 0; i < nTargets; i++){
+			if(!ufmfRegisterBuffers(files[i],(void * const *)blocks,nBlocks,blockSize)){
+				logger->log(UFMF_DEBUG_3,"Could not register the output blocks for %s: %u\n",targetFileNames[i],GetLastError());
+			}
+		}
+		logger->log(UFMF_DEBUG_3,"Writing %s with the %s output backend\n",fileName,backendName(backend));
+		return nTargets == 1 || writeManifest();
+	}
+
+	// threaded
+	if(!openHandle(false)){
+		logger->log(UFMF_ERROR,"Error opening file %s for writing\n",fileName);
+		return false;
+	}
+
+	blockFreeSignal = CreateSemaphore(NULL,nBlocks,nBlocks,NULL);
+	blockQueuedSignal = CreateSemaphore(NULL,0,nBlocks+1,NULL);
+	if(blockFreeSignal == NULL || blockQueuedSignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating output semaphores\n");
+		return false;
+	}
+
+	// take the first block to fill
+	WaitForSingleObject(blockFreeSignal,INFINITE);
+
+	// start I/O thread
+	_ioThread = CreateThread(NULL,0,ioThread,this,0,NULL);
+	if(_ioThread == NULL){
+		logger->log(UFMF_ERROR,"Error creating output thread\n");
+		return false;
+	}
+
+	logger->log(UFMF_DEBUG_3,"Writing %s with the %s output backend\n",fileName,backendName(backend));
+
+	// with the manifest written now, the stripes can be found even if we never get to finish
+	return nTargets == 1 || writeManifest();
+
+}
+
+bool ufmfOutput::openHandle(bool overlapped){
+
+	LARGE_INTEGER pos;
+	DWORD flags = unbuffered ? (FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH) : FILE_ATTRIBUTE_NORMAL;
+	int t;
+
+	if(overlapped) flags |= FILE_FLAG_OVERLAPPED;
+
+	for(t = 0; t < nTargets; t++){
+
+		// read-write views need read access too
+		files[t] = CreateFile(targetFileNames[t],backend == UFMF_OUTPUT_MAPPED ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_WRITE,
+			FILE_SHARE_READ,NULL,CREATE_ALWAYS,flags,NULL);
+		if(files[t] == INVALID_HANDLE_VALUE){
+			closeHandles();
+			return false;
+		}
+
+		// reserve space up front. finish cuts the file back to what was written
+		if(preallocateBytes > 0){
+			pos.QuadPart = (__int64)targetLength(t,preallocateBytes);
+			if(!SetFilePointerEx(files[t],pos,NULL,FILE_BEGIN) || !SetEndOfFile(files[t])){
+				logger->log(UFMF_WARNING,"Could not preallocate %llu bytes for %s\n",(unsigned __int64)pos.QuadPart,targetFileNames[t]);
+			}
+		}
+	}
+
+	return true;
+
+}
+
+void ufmfOutput::closeHandles(){
+
+	int t;
+
+	for(t = 0; t < UFMFOUTPUTMAXTARGETS; t++){
+		if(files[t] != INVALID_HANDLE_VALUE){
+			CloseHandle(files[t]);
+			files[t] = INVALID_HANDLE_VALUE;
+		}
+	}
+}
+
+// stripes are blockSize bytes: stripe i is the (i / nTargets)th stripe of target i % nTargets
+int ufmfOutput::blockTarget(unsigned __int64 offset, unsigned __int64 &targetOffset){
+
+	unsigned __int64 stripe = offset / blockSize;
+
+	targetOffset = (stripe / nTargets) * blockSize + offset % blockSize;
+	return (int)(stripe % nTargets);
+}
+
+unsigned __int64 ufmfOutput::targetLength(int t, unsigned __int64 length){
+
+	unsigned __int64 nStripes = length / blockSize;
+	unsigned __int64 n = (nStripes / nTargets) * blockSize;
+
+	if((unsigned __int64)t < nStripes % nTargets){
+		n += blockSize;
+	}
+	else if((unsigned __int64)t == nStripes % nTargets){
+		n += length % blockSize;
+	}
+	return n;
+}
+
+// same name = value format as the parameter files
+bool ufmfOutput::writeManifest(){
+
+	char manifestName[1024];
+	FILE * manifest;
+	int t, len;
+
+	len = snprintf(manifestName,sizeof(manifestName),"%s.stripes",fileName);
+	if(len < 0 || len >= (int)sizeof(manifestName)){
+		logger->log(UFMF_ERROR,"Name of the stripe manifest of %s is too long\n",fileName);
+		return false;
+	}
+	manifest = fopen(manifestName,"w");
+	if(manifest == NULL){
+		logger->log(UFMF_ERROR,"Error creating stripe manifest %s\n",manifestName);
+		return false;
+	}
+	fprintf(manifest,"# %s is striped across %d files in blocks of stripeBytes.\n",fileName,nTargets);
+	fprintf(manifest,"# byte i of the stream is byte (i / stripeBytes / nTargets) * stripeBytes + i %% stripeBytes\n");
+	fprintf(manifest,"# of the file for target (i / stripeBytes) %% nTargets. length is 0 until the stream is finished\n");
+	fprintf(manifest,"length = %llu\n",isFinished ? offset : 0);
+	fprintf(manifest,"stripeBytes = %u\n",blockSize);
+	fprintf(manifest,"nTargets = %d\n",nTargets);
+	for(t = 0; t < nTargets; t++){
+		fprintf(manifest,"target%d = %s\n",t,targetFileNames[t]);
+	}
+	if(fclose(manifest) != 0){
+		logger->log(UFMF_ERROR,"Error writing stripe manifest %s\n",manifestName);
+		return false;
+	}
+
+	return true;
+
+}
+
+bool ufmfOutput::write(const void * data, unsigned __int64 nBytes){
+
+	const unsigned __int8 * p = (const unsigned __int8 *)data;
+	unsigned __int32 n;
+
+	if((files[0] == INVALID_HANDLE_VALUE && fp == NULL) || isFinished){
+		logger->log(UFMF_ERROR,"Output file is not open for writing\n");
+		return false;
+	}
+
+	if(backend == UFMF_OUTPUT_MAPPED){
+		return writeReserved(reserve(nBytes),data,nBytes);
+	}
+
+	if(backend == UFMF_OUTPUT_STDIO){
+		if(fwrite(data,1,(size_t)nBytes,fp) != (size_t)nBytes){
+			logger->log(UFMF_ERROR,"Error writing %llu bytes at %llu of %s\n",nBytes,offset,fileName);
+			ioFailed = true;
+			return false;
+		}
+		offset += nBytes;
+		return true;
+	}
+
+	while(nBytes > 0){
+		n = (unsigned __int32)min((unsigned __int64)(blockSize - fillLength),nBytes);
+		memcpy(blocks[fillBlock] + fillLength,p,n);
+		fillLength += n;
+		offset += n;
+		p += n;
+		nBytes -= n;
+		if(fillLength == blockSize){
+			if(!queueBlock(true)) return false;
+		}
+	}
+
+	return !ioFailed;
+
+}
+
+bool ufmfOutput::write(const void * const * data, const unsigned __int64 * nBytes, int n){
+
+	unsigned __int64 total = 0;
+	unsigned __int64 reserved;
+	int i;
+
+	if(backend == UFMF_OUTPUT_MAPPED){
+		if(files[0] == INVALID_HANDLE_VALUE || isFinished){
+			logger->log(UFMF_ERROR,"Output file is not open for writing\n");
+			return false;
+		}
+		for(i = 0; i < n; i++){
+			total += nBytes[i];
+		}
+		reserved = reserve(total);
+		for(i = 0; i < n; i++){
+			if(!writeReserved(reserved,data[i],nBytes[i])) return false;
+			reserved += nBytes[i];
+		}
+		return true;
+	}
+
+	for(i = 0; i < n; i++){
+		if(!write(data[i],nBytes[i])) return false;
+	}
+	return true;
+
+}
+
+unsigned __int64 ufmfOutput::tell(){
+	unsigned __int64 n;
+	if(backend != UFMF_OUTPUT_MAPPED) return offset;
+	Lock();
+	n = offset;
+	Unlock();
+	return n;
+}
+
+bool ufmfOutput::isMapped(){
+	return backend == UFMF_OUTPUT_MAPPED;
+}
+
+unsigned __int64 ufmfOutput::reserve(unsigned __int64 nBytes){
+
+	unsigned __int64 reserved;
+
+	Lock();
+	reserved = offset;
+	if(offset + nBytes > mappedSize){
+		growMapping(max(offset + nBytes,mappedSize + UFMFOUTPUTMAPGROWTH));
+	}
+	offset += nBytes;
+	Unlock();
+
+	return reserved;
+
+}
+
+// copy window by window. different threads can copy into the same window at once
+bool ufmfOutput::writeReserved(unsigned __int64 offset, const void * data, unsigned __int64 nBytes){
+
+	const unsigned __int8 * p = (const unsigned __int8 *)data;
+	unsigned __int64 window, windowOffset, n;
+	unsigned __int8 * view;
+
+	while(nBytes > 0){
+		window = offset / UFMFOUTPUTVIEWSIZE;
+		windowOffset = offset % UFMFOUTPUTVIEWSIZE;
+		n = min(nBytes,(unsigned __int64)UFMFOUTPUTVIEWSIZE - windowOffset);
+		view = getView(window);
+		if(view == NULL){
+			logger->log(UFMF_ERROR,"Error mapping %llu bytes at %llu of %s\n",n,offset,fileName);
+			ioFailed = true;
+			return false;
+		}
+		memcpy(view + windowOffset,p,(size_t)n);
+		releaseView(window);
+		offset += n;
+		p += n;
+		nBytes -= n;
+	}
+
+	return true;
+
+}
+
+// views that are already mapped stay valid after the mapping handle is replaced
+bool ufmfOutput::growMapping(unsigned __int64 size){
+
+	HANDLE newMapping;
+
+	size = (size + UFMFOUTPUTVIEWSIZE - 1) / UFMFOUTPUTVIEWSIZE * UFMFOUTPUTVIEWSIZE;
+
+	// mapping more than the file holds extends it
+	newMapping = CreateFileMapping(files[0],NULL,PAGE_READWRITE,(DWORD)(size >> 32),(DWORD)(size & 0xFFFFFFFF),NULL);
+	if(newMapping == NULL){
+		logger->log(UFMF_ERROR,"Error mapping %llu bytes of %s\n",size,fileName);
+		ioFailed = true;
+		return false;
+	}
+	if(mapping != NULL){
+		CloseHandle(mapping);
+	}
+	mapping = newMapping;
+	mappedSize = size;
+	views.resize((size_t)(size / UFMFOUTPUTVIEWSIZE),NULL);
+	viewRefCounts.resize((size_t)(size / UFMFOUTPUTVIEWSIZE),0);
+
+	return true;
+
+}
+
+unsigned __int8 * ufmfOutput::getView(unsigned __int64 window){
+
+	unsigned __int8 * view = NULL;
+	unsigned __int64 windowStart = window * UFMFOUTPUTVIEWSIZE;
+
+	Lock();
+	if(window < views.size()){
+		if(views[(size_t)window] == NULL){
+			views[(size_t)window] = (unsigned __int8*)MapViewOfFile(mapping,FILE_MAP_WRITE,
+				(DWORD)(windowStart >> 32),(DWORD)(windowStart & 0xFFFFFFFF),UFMFOUTPUTVIEWSIZE);
+		}
+		view = views[(size_t)window];
+		if(view != NULL) viewRefCounts[(size_t)window]++;
+	}
+	Unlock();
+
+	return view;
+
+}
+
+// unmap a window once nothing is copying into it and all of it has been reserved
+void ufmfOutput::releaseView(unsigned __int64 window){
+
+	Lock();
+	viewRefCounts[(size_t)window]--;
+	if(viewRefCounts[(size_t)window] == 0 && (window + 1) * UFMFOUTPUTVIEWSIZE <= offset){
+		UnmapViewOfFile(views[(size_t)window]);
+		views[(size_t)window] = NULL;
+	}
+	Unlock();
+
+}
+
+bool ufmfOutput::queueBlock(bool getNext){
+
+	unsigned __int64 targetOffset;
+
+	blockLengths[fillBlock] = fillLength;
+	blockOffsets[fillBlock] = fillOffset;
+	targetBytes[blockTarget(fillOffset,targetOffset)] += fillLength;
+
+	Lock();
+	nBlocksQueued++;
+	if(nBlocksQueued > maxQueueDepth) maxQueueDepth = nBlocksQueued;
+	Unlock();
+
+	if(backend == UFMF_OUTPUT_OVERLAPPED){
+		submitBlock(fillBlock);
+	}
+	else{
+		ReleaseSemaphore(blockQueuedSignal,1,NULL);
+	}
+
+	fillOffset += fillLength;
+	fillBlock = (fillBlock + 1) % nBlocks;
+	fillLength = 0;
+
+	if(getNext){
+		waitForFreeBlock();
+	}
+
+	return !ioFailed;
+
+}
+
+void ufmfOutput::waitForFreeBlock(){
+
+	ULARGE_INTEGER t0;
+	double waitSeconds;
+	unsigned __int64 targetOffset;
+
+	// wait for the disk only if every block is queued
+	if(backend == UFMF_OUTPUT_OVERLAPPED){
+		if(!blockInFlight[fillBlock]) return;
+		if(HasOverlappedIoCompleted(&overlaps[fillBlock])){
+			completeBlock(fillBlock);
+			return;
+		}
+		t0 = ufmfWriterStats::getTime();
+		completeBlock(fillBlock);
+	}
+	else{
+		if(WaitForSingleObject(blockFreeSignal,0) == WAIT_OBJECT_0) return;
+		t0 = ufmfWriterStats::getTime();
+		WaitForSingleObject(blockFreeSignal,INFINITE);
+	}
+
+	if(stats){
+		waitSeconds = (double)(stats->updateTimings(UTT_WAIT_FOR_IO,t0).QuadPart - t0.QuadPart) / 10000000.0;
+	}
+	else{
+		waitSeconds = (double)(ufmfWriterStats::getTime().QuadPart - t0.QuadPart) / 10000000.0;
+	}
+	ioWaitSeconds += waitSeconds;
+
+	// we were waiting for the oldest block, which was in this slot
+	targetWaitSeconds[blockTarget(blockOffsets[fillBlock],targetOffset)] += waitSeconds;
+
+}
+
+// unbuffered writes must be whole sectors. only the last block can be partial, and it has been padded
+bool ufmfOutput::writeBlock(int block){
+
+	LARGE_INTEGER pos;
+	DWORD nWritten;
+	DWORD length = blockLengths[block];
+	unsigned __int64 targetOffset;
+	int t = blockTarget(blockOffsets[block],targetOffset);
+
+	if(unbuffered){
+		length = (length + UFMFOUTPUTALIGNMENT - 1) & ~(UFMFOUTPUTALIGNMENT - 1);
+	}
+
+	pos.QuadPart = (__int64)targetOffset;
+	if(!SetFilePointerEx(files[t],pos,NULL,FILE_BEGIN) || !WriteFile(files[t],blocks[block],length,&nWritten,NULL) || nWritten != length){
+		logger->log(UFMF_ERROR,"Error writing %u bytes at %llu of %s\n",length,targetOffset,targetFileNames[t]);
+		ioFailed = true;
+		return false;
+	}
+
+	return true;
+
+}
+
+bool ufmfOutput::submitBlock(int block){
+
+	DWORD length = blockLengths[block];
+	unsigned __int64 targetOffset;
+	int t = blockTarget(blockOffsets[block],targetOffset);
+
+	if(unbuffered){
+		length = (length + UFMFOUTPUTALIGNMENT - 1) & ~(UFMFOUTPUTALIGNMENT - 1);
+	}
+
+	overlaps[block].Offset = (DWORD)(targetOffset & 0xFFFFFFFF);
+	overlaps[block].OffsetHigh = (DWORD)(targetOffset >> 32);
+	ResetEvent(overlaps[block].hEvent);
+	blockInFlight[block] = true;
+	if(!WriteFile(files[t],blocks[block],length,NULL,&overlaps[block]) && GetLastError() != ERROR_IO_PENDING){
+		logger->log(UFMF_ERROR,"Error submitting %u bytes at %llu of %s\n",length,targetOffset,targetFileNames[t]);
+		ioFailed = true;
+		return false;
+	}
+
+	return true;
+
+}
+
+bool ufmfOutput::completeBlock(int block){
+
+	DWORD nWritten;
+	DWORD length = blockLengths[block];
+	unsigned __int64 targetOffset;
+	int t = blockTarget(blockOffsets[block],targetOffset);
+
+	if(unbuffered){
+		length = (length + UFMFOUTPUTALIGNMENT - 1) & ~(UFMFOUTPUTALIGNMENT - 1);
+	}
+
+	if(!GetOverlappedResult(files[t],&overlaps[block],&nWritten,TRUE) || nWritten != length){
+		logger->log(UFMF_ERROR,"Error writing %u bytes at %llu of %s\n",length,targetOffset,targetFileNames[t]);
+		ioFailed = true;
+	}
+	blockInFlight[block] = false;
+
+	Lock();
+	nBlocksQueued--;
+	nBlocksWritten++;
+	Unlock();
+
+	return !ioFailed;
+
+}
+
+bool ufmfOutput::finish(){
+
+	int i;
+	LARGE_INTEGER pos;
+	double seconds;
+
+	if(files[0] == INVALID_HANDLE_VALUE && fp == NULL) return false;
+	if(isFinished) return !ioFailed;
+
+	isFinished = true;
+
+	// unmap everything and cut off the space that wasn't used
+	if(backend == UFMF_OUTPUT_MAPPED){
+		for(i = 0; i < (int)views.size(); i++){
+			if(views[i] != NULL){
+				UnmapViewOfFile(views[i]);
+				views[i] = NULL;
+			}
+		}
+		if(mapping != NULL){
+			CloseHandle(mapping);
+			mapping = NULL;
+		}
+		pos.QuadPart = (__int64)offset;
+		if(!SetFilePointerEx(files[0],pos,NULL,FILE_BEGIN) || !SetEndOfFile(files[0])){
+			logger->log(UFMF_ERROR,"Error setting length of %s to %llu\n",fileName,offset);
+			ioFailed = true;
+		}
+		logger->log(UFMF_DEBUG_3,"Wrote %llu bytes of %llu mapped with the %s output backend\n",offset,mappedSize,backendName(backend));
+		return !ioFailed;
+	}
+
+	if(backend == UFMF_OUTPUT_STDIO){
+		if(fflush(fp) != 0){
+			logger->log(UFMF_ERROR,"Error flushing %s\n",fileName);
+			ioFailed = true;
+		}
+		logger->log(UFMF_DEBUG_3,"Wrote %llu bytes with the %s output backend\n",offset,backendName(backend));
+		return !ioFailed;
+	}
+
+	// pad the last block to whole sectors for unbuffered writes
+	if(fillLength > 0){
+		if(unbuffered){
+			i = (int)(((fillLength + UFMFOUTPUTALIGNMENT - 1) & ~(UFMFOUTPUTALIGNMENT - 1)) - fillLength);
+			memset(blocks[fillBlock] + fillLength,0,i);
+		}
+		queueBlock(false);
+	}
+	else if(backend == UFMF_OUTPUT_THREADED){
+		// we hold the empty block we were going to fill next
+		ReleaseSemaphore(blockFreeSignal,1,NULL);
+	}
+
+	// wait until every block has been written
+	if(backend == UFMF_OUTPUT_OVERLAPPED){
+		for(i = 0; i < nBlocks; i++){
+			if(blockInFlight[(fillBlock + i) % nBlocks]) completeBlock((fillBlock + i) % nBlocks);
+		}
+	}
+	else{
+		for(i = 0; i < nBlocks; i++){
+			WaitForSingleObject(blockFreeSignal,INFINITE);
+		}
+		ReleaseSemaphore(blockFreeSignal,nBlocks,NULL);
+	}
+
+	// reopen through the cache so that the length and any patches need not be whole sectors,
+	// and cut off padding and preallocated space
+	if(unbuffered || preallocateBytes > 0 || backend == UFMF_OUTPUT_OVERLAPPED){
+		closeHandles();
+		for(i = 0; i < nTargets; i++){
+			files[i] = CreateFile(targetFileNames[i],GENERIC_WRITE,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+			if(files[i] == INVALID_HANDLE_VALUE){
+				logger->log(UFMF_ERROR,"Error reopening %s to set its length\n",targetFileNames[i]);
+				return false;
+			}
+			pos.QuadPart = (__int64)targetLength(i,offset);
+			if(!SetFilePointerEx(files[i],pos,NULL,FILE_BEGIN) || !SetEndOfFile(files[i])){
+				logger->log(UFMF_ERROR,"Error setting length of %s to %llu\n",targetFileNames[i],(unsigned __int64)pos.QuadPart);
+				ioFailed = true;
+			}
+		}
+	}
+
+	logger->log(UFMF_DEBUG_3,"Wrote %llu bytes in %llu blocks of %u bytes with the %s output backend, at most %d of %d blocks queued, %f s waiting for I/O\n",
+		offset,nBlocksWritten,blockSize,backendName(backend),maxQueueDepth,nBlocks,ioWaitSeconds);
+
+	// throughput of each target, to find the one holding the others back
+	if(nTargets > 1){
+		seconds = (double)(ufmfWriterStats::getTime().QuadPart - openTime.QuadPart) / 10000000.0;
+		for(i = 0; i < nTargets; i++){
+			logger->log(UFMF_DEBUG_3,"Target %d, %s: %llu bytes, %f MB/s, %f s waiting for it\n",i,targetFileNames[i],
+				targetBytes[i],seconds > 0 ? (double)targetBytes[i] / (double)(1 << 20) / seconds : 0,targetWaitSeconds[i]);
+		}
+		if(!writeManifest()){
+			ioFailed = true;
+		}
+	}
+
+	return !ioFailed;
+
+}
+
+bool ufmfOutput::writeAt(unsigned __int64 offset, const void * data, unsigned __int32 nBytes){
+
+	LARGE_INTEGER pos;
+	DWORD nWritten;
+	const unsigned __int8 * p = (const unsigned __int8 *)data;
+	unsigned __int64 targetOffset;
+	unsigned __int32 n;
+	int t;
+
+	if(!isFinished || offset + nBytes > this->offset){
+		logger->log(UFMF_ERROR,"Cannot overwrite %u bytes at %llu of %s\n",nBytes,offset,fileName);
+		return false;
+	}
+
+	if(backend == UFMF_OUTPUT_STDIO){
+		if(fp == NULL || _fseeki64(fp,(__int64)offset,SEEK_SET) != 0 || fwrite(data,1,nBytes,fp) != nBytes){
+			logger->log(UFMF_ERROR,"Error overwriting %u bytes at %llu of %s\n",nBytes,offset,fileName);
+			return false;
+		}
+		return true;
+	}
+
+	// the bytes may span stripes
+	while(nBytes > 0){
+		t = blockTarget(offset,targetOffset);
+		n = (unsigned __int32)min((unsigned __int64)nBytes,blockSize - offset % blockSize);
+		pos.QuadPart = (__int64)targetOffset;
+		if(files[t] == INVALID_HANDLE_VALUE || !SetFilePointerEx(files[t],pos,NULL,FILE_BEGIN) ||
+			!WriteFile(files[t],p,n,&nWritten,NULL) || nWritten != n){
+			logger->log(UFMF_ERROR,"Error overwriting %u bytes at %llu of %s\n",n,targetOffset,targetFileNames[t]);
+			return false;
+		}
+		offset += n;
+		p += n;
+		nBytes -= n;
+	}
+
+	return true;
+
+}
+
+bool ufmfOutput::close(){
+
+	bool res = true;
+
+	if(files[0] == INVALID_HANDLE_VALUE && fp == NULL) return true;
+
+	if(!isFinished){
+		res = finish();
+	}
+
+	// stop the I/O thread: it exits when signalled with nothing queued
+	if(_ioThread != NULL){
+		ReleaseSemaphore(blockQueuedSignal,1,NULL);
+		if(WaitForSingleObject(_ioThread,UFMFOUTPUTSTOPWAITMS) != WAIT_OBJECT_0){
+			logger->log(UFMF_ERROR,"Error shutting down output thread\n");
+			res = false;
+		}
+		CloseHandle(_ioThread);
+		_ioThread = NULL;
+	}
+
+	closeHandles();
+	if(fp != NULL){
+		if(fclose(fp) != 0) ioFailed = true;
+		fp = NULL;
+	}
+
+	return res && !ioFailed;
+
+}
+
+int ufmfOutput::getQueueDepth(){
+	int n;
+	Lock();
+	n = nBlocksQueued;
+	Unlock();
+	return n;
+}
+
+DWORD WINAPI ufmfOutput::ioThread(void* param){
+	ufmfOutput* output = reinterpret_cast<ufmfOutput*>(param);
+	ufmfSetThreadName("ufmf io");
+	SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_ABOVE_NORMAL);
+	while(output->ProcessNextBlock());
+	return 0;
+}
+
+// write the next queued block
+bool ufmfOutput::ProcessNextBlock(){
+
+	WaitForSingleObject(blockQueuedSignal,INFINITE);
+
+	// signalled with nothing queued means stop
+	Lock();
+	if(nBlocksQueued == 0){
+		Unlock();
+		return false;
+	}
+	Unlock();
+
+	writeBlock(ioBlock);
+
+	Lock();
+	nBlocksQueued--;
+	nBlocksWritten++;
+	Unlock();
+
+	ioBlock = (ioBlock + 1) % nBlocks;
+	ReleaseSemaphore(blockFreeSignal,1,NULL);
+
+	return true;
+
+}
+
+bool ufmfOutput::Lock(){
+	if(WaitForSingleObject(lock,UFMFOUTPUTSTOPWAITMS) != WAIT_OBJECT_0){
+		logger->log(UFMF_ERROR,"Waited Too Long For Output Lock\n");
+		return false;
+	}
+	return true;
+}
+bool ufmfOutput::Unlock(){
+	ReleaseSemaphore(lock,1,NULL);
+	return true;
+}
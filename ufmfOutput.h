@@ -0,0 +1,186 @@
+#ifndef __UFMF_OUTPUT_H
+#define __UFMF_OUTPUT_H
+
+#include "ufmfPlatform.h"
+#include "ufmfLogger.h"
+#include "ufmfWriterStats.h"
+#include <vector>
+
+#define UFMFOUTPUTALIGNMENT 4096 // block alignment and size granularity, a multiple of the sector size as unbuffered writes need
+#define UFMFOUTPUTSTOPWAITMS 10000 // how long to wait for the I/O thread to finish when closing
+#define UFMFOUTPUTVIEWSIZE (64 << 20) // mapped backend: size of the windows the file is mapped in, a multiple of the allocation granularity
+#define UFMFOUTPUTMAPGROWTH (256 << 20) // mapped backend: minimum amount the file grows by when it fills up
+#define UFMFOUTPUTMAXTARGETS 16 // most directories output can be striped across
+
+// how output gets to the disk
+typedef enum {
+	UFMF_OUTPUT_STDIO = 0, // buffered fwrite on the calling thread, blockSize bytes of stdio buffer
+	UFMF_OUTPUT_THREADED, // blocks written by a dedicated I/O thread
+	UFMF_OUTPUT_OVERLAPPED, // blocks submitted as overlapped writes from the calling thread, up to nBlocks in flight. io_uring on Linux
+	UFMF_OUTPUT_MAPPED, // file preallocated and mapped; writers copy into space they reserve
+	UFMF_OUTPUT_NUM_BACKENDS
+} ufmfOutputBackend;
+
+// output file shared by the ufmf and fmf writers.
+// for the block backends, write() copies into the block being filled. full blocks are queued and
+// written in order while the caller keeps going, so the caller only waits on the disk when all nBlocks
+// blocks are queued. blocks are allocated once, aligned, and reused.
+// in unbuffered mode the file is opened with FILE_FLAG_NO_BUFFERING and blocks bypass the system cache.
+// preallocating the file keeps overlapped writes asynchronous: writes that extend a file are done synchronously.
+// output can be striped block by block across several directories, usually on different disks: block i
+// goes to the file for target i % nTargets. a manifest, fileName.stripes, lists the stripe files so that
+// readers can put the stream back together. the overlapped backend writes to all targets at once
+class ufmfOutput {
+
+public:
+
+	ufmfOutput(ufmfLogger * logger, ufmfWriterStats * stats = NULL, unsigned __int32 blockSize = 4 << 20, int nBlocks = 4, bool unbuffered = false,
+		ufmfOutputBackend backend = UFMF_OUTPUT_THREADED, unsigned __int64 preallocateBytes = 0);
+	~ufmfOutput();
+
+	// name of a backend, for logging
+	static const char * backendName(ufmfOutputBackend backend);
+
+	// stripe the file across the directories in targetList, separated by commas. call before open.
+	// the stdio and mapped backends fall back to the threaded backend when striping
+	bool setTargets(const char * targetList);
+
+	// split a comma-separated list of directories into dirs. returns how many there are
+	static int parseTargets(const char * targetList, char dirs[UFMFOUTPUTMAXTARGETS][1000]);
+
+	// name of the file for target t of a stream called fileName, in a buffer of size bytes.
+	// returns false if the name doesn't fit
+	static bool targetFileName(const char * fileName, const char * dir, int t, int nTargets, char * targetFileName, size_t size);
+
+	// create the file and start the I/O thread. falls back to the threaded backend if the file
+	// can't be opened for overlapped writes
+	bool open(const char * fileName);
+
+	ufmfOutputBackend getBackend();
+
+	// append nBytes to the file
+	bool write(const void * data, unsigned __int64 nBytes);
+
+	// append n buffers, one after the other, in a single call. with the mapped backend they share
+	// one reservation
+	bool write(const void * const * data, const unsigned __int64 * nBytes, int n);
+
+	// number of bytes appended so far, which is where the next write goes
+	unsigned __int64 tell();
+
+	// mapped backend only: reserve nBytes at the end of the file and return their offset, then copy
+	// into the reserved space with writeReserved. reservations are cheap, so a caller can take them
+	// in whatever order the data must be laid out and copy later, from any thread
+	bool isMapped();
+	unsigned __int64 reserve(unsigned __int64 nBytes);
+	bool writeReserved(unsigned __int64 offset, const void * data, unsigned __int64 nBytes);
+
+	// queue the last partial block and wait until everything is on disk. after this, the file can
+	// only be patched with writeAt
+	bool finish();
+
+	// overwrite bytes at offset, which must already have been written. only after finish
+	bool writeAt(unsigned __int64 offset, const void * data, unsigned __int32 nBytes);
+
+	// finish if needed, stop the I/O thread and close the file
+	bool close();
+
+	// I/O statistics
+	int getQueueDepth(); // blocks waiting to be written
+	int maxQueueDepth; // most blocks waiting to be written at once
+	unsigned __int64 nBlocksWritten;
+	double ioWaitSeconds; // time write() spent waiting for a free block
+	int nTargets; // number of files the output is striped across, 1 if not striped
+	unsigned __int64 targetBytes[UFMFOUTPUTMAXTARGETS]; // bytes written to each target
+	double targetWaitSeconds[UFMFOUTPUTMAXTARGETS]; // time write() spent waiting for each target
+
+private:
+
+	// open the file, or each stripe file, as a handle, and preallocate it
+	bool openHandle(bool overlapped);
+	void closeHandles();
+
+	// the target holding the byte at offset of the stream, and where it is in the target's file
+	int blockTarget(unsigned __int64 offset, unsigned __int64 &targetOffset);
+
+	// length of the stripe file of target t when the stream is length bytes long
+	unsigned __int64 targetLength(int t, unsigned __int64 length);
+
+	// list the stripe files in fileName.stripes
+	bool writeManifest();
+
+	// queue the block being filled. if getNext, wait for a free block to fill next
+	bool queueBlock(bool getNext);
+
+	// write a block, on the I/O thread or as an overlapped write
+	bool writeBlock(int block);
+	bool submitBlock(int block);
+
+	// wait for the overlapped write of block to complete
+	bool completeBlock(int block);
+
+	// wait for the next free block, timing how long we are blocked
+	void waitForFreeBlock();
+
+	// mapped backend: make the file at least size bytes and map it, with the lock held
+	bool growMapping(unsigned __int64 size);
+
+	// mapped backend: pin the view of window, mapping it if needed, and release it
+	unsigned __int8 * getView(unsigned __int64 window);
+	void releaseView(unsigned __int64 window);
+
+	// I/O thread
+	static DWORD WINAPI ioThread(void* param);
+	bool ProcessNextBlock();
+
+	bool Lock();
+	bool Unlock();
+
+	ufmfLogger * logger;
+	ufmfWriterStats * stats;
+
+	// parameters
+	unsigned __int32 blockSize;
+	int nBlocks;
+	bool unbuffered;
+	ufmfOutputBackend backend;
+	unsigned __int64 preallocateBytes;
+
+	// file
+	char fileName[1000];
+	char targetDirs[UFMFOUTPUTMAXTARGETS][1000]; // directory of each target, if striped
+	char targetFileNames[UFMFOUTPUTMAXTARGETS][1000]; // file of each target, fileName if not striped
+	HANDLE files[UFMFOUTPUTMAXTARGETS]; // handle of each target
+	ULARGE_INTEGER openTime; // for throughput
+	FILE * fp; // stdio backend
+	unsigned __int64 offset; // bytes appended
+	bool isFinished;
+	bool ioFailed;
+
+	// blocks. blocks are filled and written in ring order
+	unsigned __int8 ** blocks;
+	unsigned __int32 * blockLengths; // bytes used in each queued block
+	unsigned __int64 * blockOffsets; // file offset of each queued block
+	int fillBlock; // block being filled
+	unsigned __int32 fillLength; // bytes used in the block being filled
+	unsigned __int64 fillOffset; // file offset of the block being filled
+	int ioBlock; // next block to be written by the I/O thread
+	int nBlocksQueued;
+	OVERLAPPED * overlaps; // overlapped backend: request for each block
+	bool * blockInFlight; // overlapped backend: whether each block has a write outstanding
+
+	// mapped backend
+	HANDLE mapping; // mapping of the whole file as it is now
+	unsigned __int64 mappedSize; // size of the file and the mapping
+	std::vector<unsigned __int8 *> views; // view of each window, or NULL if not mapped
+	std::vector<int> viewRefCounts; // number of copies into each window in progress
+
+	// threading
+	HANDLE _ioThread;
+	HANDLE lock;
+	HANDLE blockFreeSignal; // counts blocks that can be filled
+	HANDLE blockQueuedSignal; // counts blocks waiting to be written, plus one to stop the I/O thread
+
+};
+
+#endif
@@ -0,0 +1,926 @@
+#include "ufmfPlatform.h"
+
+#ifdef _WIN32
+
+// a debugger attached to the process names the thread when it sees this exception
+#define UFMFTHREADNAMEEXCEPTION 0x406D1388
+
+#pragma pack(push,8)
+typedef struct {
+	DWORD dwType; // must be 0x1000
+	LPCSTR szName;
+	DWORD dwThreadID; // -1 for the calling thread
+	DWORD dwFlags;
+} UFMFTHREADNAMEINFO;
+#pragma pack(pop)
+
+void ufmfSetThreadName(const char * name){
+
+	UFMFTHREADNAMEINFO info;
+	info.dwType = 0x1000;
+	info.szName = name;
+	info.dwThreadID = (DWORD)-1;
+	info.dwFlags = 0;
+
+	__try{
+		RaiseException(UFMFTHREADNAMEEXCEPTION,0,sizeof(info)/sizeof(ULONG_PTR),(ULONG_PTR*)&info);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER){
+	}
+}
+
+BOOL ufmfRegisterBuffers(HANDLE file, void * const * buffers, int nBuffers, size_t bufferSize){
+	return TRUE;
+}
+
+#else
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <map>
+
+// io_uring, for overlapped writes, with just the kernel headers
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define UFMFHAVEURING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#define UFMFRINGENTRIES 64 // most overlapped writes in flight on one file
+#define UFMFRINGMAXBUFFERS 64 // most buffers that can be registered with one file
+
+// an io_uring for the overlapped writes to one file. writes are submitted one at a time, and a
+// completion carries the OVERLAPPED of its write
+struct ufmfRing {
+	int fd;
+	pthread_mutex_t lock;
+	void * sqMap;
+	size_t sqMapSize;
+	void * cqMap;
+	size_t cqMapSize;
+	void * sqes;
+	size_t sqesSize;
+	unsigned * sqHead;
+	unsigned * sqTail;
+	unsigned * sqMask;
+	unsigned * sqEntries;
+	unsigned * sqArray;
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned * cqMask;
+	void * cqes;
+	int nBuffers; // buffers registered
+	const char * buffers[UFMFRINGMAXBUFFERS];
+	size_t bufferSize;
+};
+static void destroyRing(ufmfRing * ring);
+
+typedef enum {
+	UFMF_HANDLE_SEMAPHORE = 0,
+	UFMF_HANDLE_THREAD,
+	UFMF_HANDLE_FILE,
+	UFMF_HANDLE_MAPPING
+} ufmfHandleType;
+
+// what a HANDLE points to
+struct ufmfHandle {
+	ufmfHandleType type;
+	int nRefs; // a running thread holds a reference to its own handle, so it can be closed early
+	LONG count; // semaphores: available count. threads: 1 once exited, never taken
+	LONG maxCount;
+	pthread_cond_t changed; // broadcast whenever count goes up
+	LPTHREAD_START_ROUTINE start;
+	void * param;
+	int fd; // files, and the file of a mapping, which it doesn't own
+	ufmfRing * ring; // files opened for overlapped writes
+};
+
+// all semaphore and thread state is under one lock, so that waits on several handles see them
+// consistently. waits on a single handle sleep on its own condition, waits on several on a
+// shared one, which is only woken while someone is waiting on it
+static pthread_mutex_t handleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t multipleChanged;
+static int nMultipleWaiters = 0;
+static pthread_condattr_t monotonicCondAttr;
+static pthread_once_t platformInitOnce = PTHREAD_ONCE_INIT;
+
+// sizes of mapped views, for munmap
+static std::map<const void*,size_t> viewSizes;
+
+static __thread DWORD lastError = 0;
+
+static void platformInit(){
+	pthread_condattr_init(&monotonicCondAttr);
+	pthread_condattr_setclock(&monotonicCondAttr,CLOCK_MONOTONIC);
+	pthread_cond_init(&multipleChanged,&monotonicCondAttr);
+}
+
+static ufmfHandle * newHandle(ufmfHandleType type){
+
+	ufmfHandle * h;
+
+	pthread_once(&platformInitOnce,platformInit);
+
+	h = new ufmfHandle;
+	h->type = type;
+	h->nRefs = 1;
+	h->count = 0;
+	h->maxCount = 0;
+	pthread_cond_init(&h->changed,&monotonicCondAttr);
+	h->start = NULL;
+	h->param = NULL;
+	h->fd = -1;
+	h->ring = NULL;
+	return h;
+}
+
+// with handleLock held
+static void releaseHandle(ufmfHandle * h){
+	if(--h->nRefs == 0){
+		pthread_cond_destroy(&h->changed);
+		delete h;
+	}
+}
+
+// wake everything waiting on h, with handleLock held
+static void signalHandle(ufmfHandle * h){
+	pthread_cond_broadcast(&h->changed);
+	if(nMultipleWaiters > 0){
+		pthread_cond_broadcast(&multipleChanged);
+	}
+}
+
+// *** threads and synchronization ***
+
+static void * threadMain(void * param){
+
+	ufmfHandle * h = (ufmfHandle*)param;
+
+	h->start(h->param);
+
+	pthread_mutex_lock(&handleLock);
+	h->count = 1;
+	signalHandle(h);
+	releaseHandle(h);
+	pthread_mutex_unlock(&handleLock);
+
+	return NULL;
+}
+
+HANDLE CreateThread(void * attributes, size_t stackSize, LPTHREAD_START_ROUTINE start, void * param, DWORD flags, DWORD * threadId){
+
+	static volatile LONG nThreadsCreated = 0;
+	pthread_t thread;
+	pthread_attr_t attr;
+	ufmfHandle * h = newHandle(UFMF_HANDLE_THREAD);
+	int err;
+
+	h->start = start;
+	h->param = param;
+	h->nRefs = 2;
+
+	// waiting on the handle stands in for joining
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+	if(stackSize > 0){
+		pthread_attr_setstacksize(&attr,stackSize);
+	}
+	err = pthread_create(&thread,&attr,threadMain,h);
+	pthread_attr_destroy(&attr);
+	if(err != 0){
+		lastError = (DWORD)err;
+		pthread_mutex_lock(&handleLock);
+		h->nRefs = 1;
+		releaseHandle(h);
+		pthread_mutex_unlock(&handleLock);
+		return NULL;
+	}
+
+	if(threadId != NULL){
+		*threadId = (DWORD)InterlockedIncrement(&nThreadsCreated);
+	}
+	return h;
+}
+
+HANDLE GetCurrentThread(){
+	return (HANDLE)(ptrdiff_t)-2;
+}
+
+// real-time priorities need privileges the recorder shouldn't run with
+BOOL SetThreadPriority(HANDLE thread, int priority){
+	return TRUE;
+}
+
+void Sleep(DWORD milliseconds){
+	struct timespec t;
+	t.tv_sec = milliseconds / 1000;
+	t.tv_nsec = (long)(milliseconds % 1000) * 1000000L;
+	while(nanosleep(&t,&t) != 0 && errno == EINTR);
+}
+
+HANDLE CreateSemaphore(void * attributes, LONG initialCount, LONG maximumCount, const char * name){
+
+	ufmfHandle * h;
+
+	if(initialCount < 0 || maximumCount <= 0 || initialCount > maximumCount){
+		lastError = EINVAL;
+		return NULL;
+	}
+	h = newHandle(UFMF_HANDLE_SEMAPHORE);
+	h->count = initialCount;
+	h->maxCount = maximumCount;
+	return h;
+}
+
+BOOL ReleaseSemaphore(HANDLE semaphore, LONG releaseCount, LONG * previousCount){
+
+	ufmfHandle * h = (ufmfHandle*)semaphore;
+	BOOL res = TRUE;
+
+	if(h == NULL || h->type != UFMF_HANDLE_SEMAPHORE || releaseCount <= 0){
+		lastError = EINVAL;
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&handleLock);
+	if(previousCount != NULL){
+		*previousCount = h->count;
+	}
+	// as on Windows, going over the maximum fails and leaves the count alone
+	if(h->count + releaseCount > h->maxCount){
+		lastError = EOVERFLOW;
+		res = FALSE;
+	}
+	else{
+		h->count += releaseCount;
+		signalHandle(h);
+	}
+	pthread_mutex_unlock(&handleLock);
+
+	return res;
+}
+
+DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE * handles, BOOL waitAll, DWORD milliseconds){
+
+	struct timespec deadline;
+	pthread_cond_t * cond;
+	ufmfHandle * h;
+	DWORD i;
+	DWORD res = WAIT_TIMEOUT;
+	bool timedOut = false;
+
+	if(nCount == 0 || handles == NULL){
+		lastError = EINVAL;
+		return WAIT_FAILED;
+	}
+	for(i = 0; i < nCount; i++){
+		h = (ufmfHandle*)handles[i];
+		if(h == NULL || (h->type != UFMF_HANDLE_SEMAPHORE && h->type != UFMF_HANDLE_THREAD)){
+			lastError = EINVAL;
+			return WAIT_FAILED;
+		}
+	}
+
+	if(milliseconds != INFINITE){
+		clock_gettime(CLOCK_MONOTONIC,&deadline);
+		deadline.tv_sec += milliseconds / 1000;
+		deadline.tv_nsec += (long)(milliseconds % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&handleLock);
+	if(nCount == 1){
+		cond = &((ufmfHandle*)handles[0])->changed;
+	}
+	else{
+		cond = &multipleChanged;
+		nMultipleWaiters++;
+	}
+
+	while(true){
+
+		if(waitAll){
+			for(i = 0; i < nCount && ((ufmfHandle*)handles[i])->count > 0; i++);
+			if(i == nCount){
+				for(i = 0; i < nCount; i++){
+					h = (ufmfHandle*)handles[i];
+					if(h->type == UFMF_HANDLE_SEMAPHORE) h->count--;
+				}
+				res = WAIT_OBJECT_0;
+				break;
+			}
+		}
+		else{
+			// the first signalled handle wins, as on Windows
+			for(i = 0; i < nCount && ((ufmfHandle*)handles[i])->count == 0; i++);
+			if(i < nCount){
+				h = (ufmfHandle*)handles[i];
+				if(h->type == UFMF_HANDLE_SEMAPHORE) h->count--;
+				res = WAIT_OBJECT_0 + i;
+				break;
+			}
+		}
+
+		if(timedOut || milliseconds == 0){
+			break;
+		}
+		if(milliseconds == INFINITE){
+			pthread_cond_wait(cond,&handleLock);
+		}
+		else if(pthread_cond_timedwait(cond,&handleLock,&deadline) == ETIMEDOUT){
+			// look once more before giving up
+			timedOut = true;
+		}
+	}
+
+	if(nCount > 1){
+		nMultipleWaiters--;
+	}
+	pthread_mutex_unlock(&handleLock);
+
+	return res;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds){
+	return WaitForMultipleObjects(1,&handle,FALSE,milliseconds);
+}
+
+BOOL CloseHandle(HANDLE handle){
+
+	ufmfHandle * h = (ufmfHandle*)handle;
+	BOOL res = TRUE;
+
+	if(h == NULL || h == INVALID_HANDLE_VALUE){
+		lastError = EBADF;
+		return FALSE;
+	}
+	if(h->type == UFMF_HANDLE_FILE && h->ring != NULL){
+		destroyRing(h->ring);
+		h->ring = NULL;
+	}
+	if(h->type == UFMF_HANDLE_FILE && close(h->fd) != 0){
+		lastError = (DWORD)errno;
+		res = FALSE;
+	}
+
+	pthread_mutex_lock(&handleLock);
+	releaseHandle(h);
+	pthread_mutex_unlock(&handleLock);
+
+	return res;
+}
+
+// *** timing ***
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER * counter){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	counter->QuadPart = (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER * frequency){
+	frequency->QuadPart = 1000000000LL;
+	return TRUE;
+}
+
+// *** files ***
+
+#ifdef UFMFHAVEURING
+
+static int uringSetup(unsigned entries, struct io_uring_params * params){
+	return (int)syscall(__NR_io_uring_setup,entries,params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags){
+	return (int)syscall(__NR_io_uring_enter,fd,toSubmit,minComplete,flags,NULL,0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void * arg, unsigned nArgs){
+	return (int)syscall(__NR_io_uring_register,fd,opcode,arg,nArgs);
+}
+
+static void destroyRing(ufmfRing * ring){
+	if(ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes,ring->sqesSize);
+	if(ring->cqMap != NULL && ring->cqMap != MAP_FAILED && ring->cqMap != ring->sqMap) munmap(ring->cqMap,ring->cqMapSize);
+	if(ring->sqMap != NULL && ring->sqMap != MAP_FAILED) munmap(ring->sqMap,ring->sqMapSize);
+	if(ring->fd >= 0) close(ring->fd);
+	pthread_mutex_destroy(&ring->lock);
+	delete ring;
+}
+
+// NULL if the kernel doesn't do io_uring, or won't let us use it. IORING_OP_WRITE came with
+// IORING_FEAT_RW_CUR_POS, so without that feature the ring is no use to us either
+static ufmfRing * createRing(){
+
+	struct io_uring_params params;
+	ufmfRing * ring = new ufmfRing;
+	char * sq;
+	char * cq;
+
+	memset(ring,0,sizeof(ufmfRing));
+	pthread_mutex_init(&ring->lock,NULL);
+	memset(&params,0,sizeof(params));
+	ring->fd = uringSetup(UFMFRINGENTRIES,&params);
+	if(ring->fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS)){
+		lastError = ring->fd < 0 ? (DWORD)errno : ERROR_NOT_SUPPORTED;
+		destroyRing(ring);
+		return NULL;
+	}
+
+	ring->sqMapSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	ring->cqMapSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP){
+		ring->sqMapSize = ring->cqMapSize = max(ring->sqMapSize,ring->cqMapSize);
+	}
+	ring->sqMap = mmap(NULL,ring->sqMapSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ring->fd,IORING_OFF_SQ_RING);
+	if(ring->sqMap == MAP_FAILED){
+		lastError = (DWORD)errno;
+		destroyRing(ring);
+		return NULL;
+	}
+	if(params.features & IORING_FEAT_SINGLE_MMAP){
+		ring->cqMap = ring->sqMap;
+	}
+	else{
+		ring->cqMap = mmap(NULL,ring->cqMapSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ring->fd,IORING_OFF_CQ_RING);
+	}
+	ring->sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL,ring->sqesSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ring->fd,IORING_OFF_SQES);
+	if(ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED){
+		lastError = (DWORD)errno;
+		destroyRing(ring);
+		return NULL;
+	}
+
+	sq = (char*)ring->sqMap;
+	ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sqEntries = (unsigned*)(sq + params.sq_off.ring_entries);
+	ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+	cq = (char*)ring->cqMap;
+	ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = cq + params.cq_off.cqes;
+
+	return ring;
+}
+
+// submit what is left of the write of overlapped, with ring->lock held
+static BOOL submitToRing(ufmfRing * ring, int fd, OVERLAPPED * overlapped){
+
+	unsigned tail = *ring->sqTail;
+	unsigned head = __atomic_load_n(ring->sqHead,__ATOMIC_ACQUIRE);
+	unsigned index;
+	struct io_uring_sqe * sqe;
+	const char * p = (const char*)overlapped->buffer + overlapped->InternalHigh;
+	int b, res;
+
+	if(tail - head >= *ring->sqEntries){
+		lastError = EBUSY;
+		return FALSE;
+	}
+	index = tail & *ring->sqMask;
+	sqe = (struct io_uring_sqe *)ring->sqes + index;
+	memset(sqe,0,sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->off = (((unsigned long long)overlapped->OffsetHigh << 32) | overlapped->Offset) + overlapped->InternalHigh;
+	sqe->addr = (unsigned long long)(size_t)p;
+	sqe->len = overlapped->nBytes - (DWORD)overlapped->InternalHigh;
+	sqe->user_data = (unsigned long long)(size_t)overlapped;
+	// writes from a registered buffer don't have to map it
+	for(b = 0; b < ring->nBuffers; b++){
+		if(p >= ring->buffers[b] && p + sqe->len <= ring->buffers[b] + ring->bufferSize){
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = (unsigned short)b;
+			break;
+		}
+	}
+	ring->sqArray[index] = index;
+	__atomic_store_n(ring->sqTail,tail + 1,__ATOMIC_RELEASE);
+
+	do{
+		res = uringEnter(ring->fd,1,0,0);
+	} while(res < 0 && errno == EINTR);
+	if(res != 1){
+		lastError = res < 0 ? (DWORD)errno : EAGAIN;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// take the completions that have come in. with wait, wait for one if none have. a short write is
+// resubmitted, and only counts as complete once all of it is written
+static BOOL reapRing(ufmfRing * ring, int fd, bool wait){
+
+	unsigned head, tail;
+	struct io_uring_cqe * cqe;
+	OVERLAPPED * overlapped;
+	int res;
+
+	pthread_mutex_lock(&ring->lock);
+	head = *ring->cqHead;
+	tail = __atomic_load_n(ring->cqTail,__ATOMIC_ACQUIRE);
+	if(head == tail && wait){
+		pthread_mutex_unlock(&ring->lock);
+		do{
+			res = uringEnter(ring->fd,0,1,IORING_ENTER_GETEVENTS);
+		} while(res < 0 && errno == EINTR);
+		if(res < 0){
+			lastError = (DWORD)errno;
+			return FALSE;
+		}
+		pthread_mutex_lock(&ring->lock);
+		head = *ring->cqHead;
+		tail = __atomic_load_n(ring->cqTail,__ATOMIC_ACQUIRE);
+	}
+
+	for(; head != tail; head++){
+		cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cqMask);
+		overlapped = (OVERLAPPED*)(size_t)cqe->user_data;
+		if(cqe->res < 0){
+			overlapped->error = (DWORD)-cqe->res;
+		}
+		else if(cqe->res == 0){
+			overlapped->error = EIO;
+		}
+		else{
+			overlapped->InternalHigh += (size_t)cqe->res;
+			if(overlapped->InternalHigh < overlapped->nBytes && submitToRing(ring,fd,overlapped)){
+				continue;
+			}
+			if(overlapped->InternalHigh < overlapped->nBytes){
+				overlapped->error = lastError;
+			}
+		}
+		__atomic_store_n(&overlapped->Internal,(size_t)0,__ATOMIC_RELEASE);
+		if(overlapped->hEvent != NULL){
+			ReleaseSemaphore(overlapped->hEvent,1,NULL);
+		}
+	}
+	__atomic_store_n(ring->cqHead,head,__ATOMIC_RELEASE);
+	pthread_mutex_unlock(&ring->lock);
+
+	return TRUE;
+}
+
+#else
+
+static void destroyRing(ufmfRing * ring){
+}
+
+#endif
+
+HANDLE CreateFileA(const char * fileName, DWORD access, DWORD shareMode, void * security, DWORD disposition, DWORD flags, HANDLE templateFile){
+
+	ufmfHandle * h;
+	int oflags;
+	int fd;
+
+	ufmfRing * ring = NULL;
+
+	// overlapped writes need a ring. without one, refusing overlapped handles makes callers use
+	// their synchronous path
+	if(flags & FILE_FLAG_OVERLAPPED){
+#ifdef UFMFHAVEURING
+		ring = createRing();
+#endif
+		if(ring == NULL){
+			lastError = ERROR_NOT_SUPPORTED;
+			return INVALID_HANDLE_VALUE;
+		}
+	}
+
+	if(access & GENERIC_READ){
+		oflags = (access & GENERIC_WRITE) ? O_RDWR : O_RDONLY;
+	}
+	else{
+		oflags = O_WRONLY;
+	}
+	if(disposition == CREATE_ALWAYS){
+		oflags |= O_CREAT | O_TRUNC;
+	}
+	else if(disposition == OPEN_ALWAYS){
+		oflags |= O_CREAT;
+	}
+	if(flags & FILE_FLAG_WRITE_THROUGH){
+		oflags |= O_DSYNC;
+	}
+
+#ifdef O_DIRECT
+	if(flags & FILE_FLAG_NO_BUFFERING){
+		fd = open(fileName,oflags | O_DIRECT,0644);
+		// some file systems, like tmpfs, don't do direct I/O
+		if(fd < 0 && errno == EINVAL){
+			fd = open(fileName,oflags,0644);
+		}
+	}
+	else
+#endif
+	{
+		fd = open(fileName,oflags,0644);
+	}
+	if(fd < 0){
+		lastError = (DWORD)errno;
+		if(ring != NULL) destroyRing(ring);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	h = newHandle(UFMF_HANDLE_FILE);
+	h->fd = fd;
+	h->ring = ring;
+	return h;
+}
+
+BOOL WriteFile(HANDLE file, const void * buffer, DWORD nBytes, DWORD * nWritten, OVERLAPPED * overlapped){
+
+	ufmfHandle * h = (ufmfHandle*)file;
+	const char * p = (const char*)buffer;
+	off_t offset = 0;
+	DWORD n = 0;
+	ssize_t res;
+
+	if(h == NULL || h == INVALID_HANDLE_VALUE || h->type != UFMF_HANDLE_FILE){
+		lastError = EBADF;
+		return FALSE;
+	}
+	if(overlapped != NULL){
+		offset = (off_t)(((unsigned long long)overlapped->OffsetHigh << 32) | overlapped->Offset);
+	}
+
+#ifdef UFMFHAVEURING
+	if(h->ring != NULL && overlapped != NULL){
+		overlapped->file = file;
+		overlapped->buffer = buffer;
+		overlapped->nBytes = nBytes;
+		overlapped->error = 0;
+		overlapped->InternalHigh = 0;
+		overlapped->Internal = ERROR_IO_PENDING;
+		pthread_mutex_lock(&h->ring->lock);
+		if(!submitToRing(h->ring,h->fd,overlapped)){
+			pthread_mutex_unlock(&h->ring->lock);
+			overlapped->Internal = 0;
+			return FALSE;
+		}
+		pthread_mutex_unlock(&h->ring->lock);
+		lastError = ERROR_IO_PENDING;
+		return FALSE;
+	}
+#endif
+
+	while(n < nBytes){
+		if(overlapped != NULL){
+			res = pwrite(h->fd,p + n,nBytes - n,offset + n);
+		}
+		else{
+			res = write(h->fd,p + n,nBytes - n);
+		}
+		if(res < 0){
+			if(errno == EINTR) continue;
+			lastError = (DWORD)errno;
+			break;
+		}
+		n += (DWORD)res;
+	}
+
+	if(nWritten != NULL){
+		*nWritten = n;
+	}
+	if(overlapped != NULL){
+		overlapped->Internal = 0;
+		overlapped->InternalHigh = n;
+	}
+	return n == nBytes;
+}
+
+BOOL SetFilePointerEx(HANDLE file, LARGE_INTEGER distance, LARGE_INTEGER * newPosition, DWORD moveMethod){
+
+	ufmfHandle * h = (ufmfHandle*)file;
+	off_t res;
+
+	if(h == NULL || h == INVALID_HANDLE_VALUE || h->type != UFMF_HANDLE_FILE){
+		lastError = EBADF;
+		return FALSE;
+	}
+	res = lseek(h->fd,(off_t)distance.QuadPart,moveMethod == FILE_END ? SEEK_END : moveMethod == FILE_CURRENT ? SEEK_CUR : SEEK_SET);
+	if(res < 0){
+		lastError = (DWORD)errno;
+		return FALSE;
+	}
+	if(newPosition != NULL){
+		newPosition->QuadPart = (long long)res;
+	}
+	return TRUE;
+}
+
+BOOL SetEndOfFile(HANDLE file){
+
+	ufmfHandle * h = (ufmfHandle*)file;
+	off_t pos;
+	struct stat st;
+
+	if(h == NULL || h == INVALID_HANDLE_VALUE || h->type != UFMF_HANDLE_FILE){
+		lastError = EBADF;
+		return FALSE;
+	}
+	pos = lseek(h->fd,0,SEEK_CUR);
+#ifdef __linux__
+	// ftruncate alone would leave a sparse file. file systems without fallocate get one anyway
+	if(pos >= 0 && fstat(h->fd,&st) == 0 && pos > st.st_size){
+		fallocate(h->fd,0,st.st_size,pos - st.st_size);
+	}
+#endif
+	if(pos < 0 || ftruncate(h->fd,pos) != 0){
+		lastError = (DWORD)errno;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL DeleteFileA(const char * fileName){
+	if(unlink(fileName) != 0){
+		lastError = (DWORD)errno;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+DWORD GetLastError(){
+	return lastError;
+}
+
+// events are only there to be waited on. completions are found by GetOverlappedResult
+HANDLE CreateEvent(void * attributes, BOOL manualReset, BOOL initialState, const char * name){
+	return CreateSemaphore(NULL,initialState ? 1 : 0,1,NULL);
+}
+
+BOOL ResetEvent(HANDLE event){
+	WaitForSingleObject(event,0);
+	return TRUE;
+}
+
+BOOL HasOverlappedIoCompleted(OVERLAPPED * overlapped){
+#ifdef UFMFHAVEURING
+	ufmfHandle * h = (ufmfHandle*)overlapped->file;
+	if(__atomic_load_n(&overlapped->Internal,__ATOMIC_ACQUIRE) != 0 && h != NULL && h->ring != NULL){
+		reapRing(h->ring,h->fd,false);
+	}
+#endif
+	return __atomic_load_n(&overlapped->Internal,__ATOMIC_ACQUIRE) == 0;
+}
+
+BOOL GetOverlappedResult(HANDLE file, OVERLAPPED * overlapped, DWORD * nWritten, BOOL wait){
+#ifdef UFMFHAVEURING
+	ufmfHandle * h = (ufmfHandle*)file;
+	if(h != NULL && h != INVALID_HANDLE_VALUE && h->type == UFMF_HANDLE_FILE && h->ring != NULL){
+		while(__atomic_load_n(&overlapped->Internal,__ATOMIC_ACQUIRE) != 0){
+			if(!reapRing(h->ring,h->fd,wait != 0)){
+				return FALSE;
+			}
+			if(!wait) break;
+		}
+		if(__atomic_load_n(&overlapped->Internal,__ATOMIC_ACQUIRE) != 0){
+			lastError = ERROR_IO_INCOMPLETE;
+			return FALSE;
+		}
+	}
+#endif
+	*nWritten = (DWORD)overlapped->InternalHigh;
+	if(overlapped->error != 0){
+		lastError = overlapped->error;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL ufmfRegisterBuffers(HANDLE file, void * const * buffers, int nBuffers, size_t bufferSize){
+#ifdef UFMFHAVEURING
+	ufmfHandle * h = (ufmfHandle*)file;
+	struct iovec iovecs[UFMFRINGMAXBUFFERS];
+	int b;
+
+	if(h == NULL || h == INVALID_HANDLE_VALUE || h->type != UFMF_HANDLE_FILE || h->ring == NULL){
+		return TRUE;
+	}
+	if(nBuffers > UFMFRINGMAXBUFFERS || h->ring->nBuffers > 0){
+		lastError = ERROR_NOT_SUPPORTED;
+		return FALSE;
+	}
+	for(b = 0; b < nBuffers; b++){
+		iovecs[b].iov_base = buffers[b];
+		iovecs[b].iov_len = bufferSize;
+	}
+	// registered buffers are locked in memory, which RLIMIT_MEMLOCK can forbid
+	if(uringRegister(h->ring->fd,IORING_REGISTER_BUFFERS,iovecs,(unsigned)nBuffers) != 0){
+		lastError = (DWORD)errno;
+		return FALSE;
+	}
+	pthread_mutex_lock(&h->ring->lock);
+	for(b = 0; b < nBuffers; b++){
+		h->ring->buffers[b] = (const char*)buffers[b];
+	}
+	h->ring->bufferSize = bufferSize;
+	h->ring->nBuffers = nBuffers;
+	pthread_mutex_unlock(&h->ring->lock);
+#endif
+	return TRUE;
+}
+
+HANDLE CreateFileMapping(HANDLE file, void * attributes, DWORD protect, DWORD maximumSizeHigh, DWORD maximumSizeLow, const char * name){
+
+	ufmfHandle * f = (ufmfHandle*)file;
+	ufmfHandle * h;
+	off_t size = (off_t)(((unsigned long long)maximumSizeHigh << 32) | maximumSizeLow);
+	struct stat st;
+
+	if(f == NULL || f == INVALID_HANDLE_VALUE || f->type != UFMF_HANDLE_FILE){
+		lastError = EBADF;
+		return NULL;
+	}
+	if(fstat(f->fd,&st) != 0 || (st.st_size < size && ftruncate(f->fd,size) != 0)){
+		lastError = (DWORD)errno;
+		return NULL;
+	}
+
+	h = newHandle(UFMF_HANDLE_MAPPING);
+	h->fd = f->fd;
+	return h;
+}
+
+void * MapViewOfFile(HANDLE mapping, DWORD access, DWORD offsetHigh, DWORD offsetLow, size_t nBytes){
+
+	ufmfHandle * h = (ufmfHandle*)mapping;
+	void * view;
+
+	if(h == NULL || h->type != UFMF_HANDLE_MAPPING){
+		lastError = EBADF;
+		return NULL;
+	}
+	view = mmap(NULL,nBytes,PROT_READ | PROT_WRITE,MAP_SHARED,h->fd,(off_t)(((unsigned long long)offsetHigh << 32) | offsetLow));
+	if(view == MAP_FAILED){
+		lastError = (DWORD)errno;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&handleLock);
+	viewSizes[view] = nBytes;
+	pthread_mutex_unlock(&handleLock);
+
+	return view;
+}
+
+BOOL UnmapViewOfFile(const void * view){
+
+	std::map<const void*,size_t>::iterator it;
+	size_t nBytes;
+
+	pthread_mutex_lock(&handleLock);
+	it = viewSizes.find(view);
+	if(it == viewSizes.end()){
+		pthread_mutex_unlock(&handleLock);
+		lastError = EINVAL;
+		return FALSE;
+	}
+	nBytes = it->second;
+	viewSizes.erase(it);
+	pthread_mutex_unlock(&handleLock);
+
+	return munmap((void*)view,nBytes) == 0;
+}
+
+// *** C runtime ***
+
+void * _aligned_malloc(size_t size, size_t alignment){
+	void * p = NULL;
+	if(posix_memalign(&p,alignment,size > 0 ? size : alignment) != 0){
+		return NULL;
+	}
+	return p;
+}
+
+void _aligned_free(void * p){
+	free(p);
+}
+
+void ufmfSetThreadName(const char * name){
+	char shortName[16];
+	strncpy(shortName,name,sizeof(shortName)-1);
+	shortName[sizeof(shortName)-1] = '\0';
+	pthread_setname_np(pthread_self(),shortName);
+}
+
+#endif
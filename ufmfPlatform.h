@@ -0,0 +1,204 @@
+#ifndef __UFMF_PLATFORM_H
+#define __UFMF_PLATFORM_H
+
+// the writers are written against the Win32 API. on Windows this just pulls in windows.h.
+// elsewhere it supplies the part of that API the ufmf and fmf writers and the preview thread use,
+// on top of pthreads and POSIX files, so that they build and run unchanged on Linux, e.g.
+//   g++ -O2 -pthread -c ufmfPlatform.cpp ufmfWriter.cpp ufmfOutput.cpp ufmfIndex.cpp fmfWriter.cpp
+// semaphores and thread handles can be waited on together as with WaitForMultipleObjects,
+// timeouts and QueryPerformanceCounter use the monotonic clock. overlapped writes go through an
+// io_uring per file on Linux; where the kernel or the headers don't have it, overlapped file handles
+// are refused, so the overlapped output backend falls back to the threaded one. the mapped backend
+// uses mmap. thread priorities are left to the scheduler
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <intrin.h>
+
+#define UFMFPATHSEP "\\"
+
+// older MSVC only has _snprintf, which returns -1 rather than the length it needed when the
+// output doesn't fit. either way a result outside [0,size) means truncated
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf
+#endif
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <unistd.h>
+#ifdef __cplusplus
+// the library's own uses of std::min and std::max have to be seen before the macros below
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <map>
+#endif
+
+#define UFMFPATHSEP "/"
+
+// MSVC sized integer types
+#define __int8 char
+#define __int16 short
+#define __int32 int
+#define __int64 long long
+#define _int64 long long
+
+typedef int BOOL;
+typedef unsigned int DWORD;
+typedef int LONG;
+typedef unsigned int ULONG;
+typedef void * HANDLE;
+typedef union {
+	struct { DWORD LowPart; LONG HighPart; };
+	long long QuadPart;
+} LARGE_INTEGER;
+typedef union {
+	struct { DWORD LowPart; DWORD HighPart; };
+	unsigned long long QuadPart;
+} ULARGE_INTEGER;
+
+#define WINAPI
+#define TRUE 1
+#define FALSE 0
+#ifndef min
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
+// *** threads and synchronization ***
+
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+#define THREAD_PRIORITY_BELOW_NORMAL -1
+#define THREAD_PRIORITY_NORMAL 0
+#define THREAD_PRIORITY_ABOVE_NORMAL 1
+#define THREAD_PRIORITY_HIGHEST 2
+#define THREAD_PRIORITY_TIME_CRITICAL 15
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(void * param);
+
+HANDLE CreateThread(void * attributes, size_t stackSize, LPTHREAD_START_ROUTINE start, void * param, DWORD flags, DWORD * threadId);
+HANDLE GetCurrentThread();
+BOOL SetThreadPriority(HANDLE thread, int priority);
+void Sleep(DWORD milliseconds);
+
+HANDLE CreateSemaphore(void * attributes, LONG initialCount, LONG maximumCount, const char * name);
+BOOL ReleaseSemaphore(HANDLE semaphore, LONG releaseCount, LONG * previousCount);
+
+// a thread handle is signalled once the thread has exited
+DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE * handles, BOOL waitAll, DWORD milliseconds);
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds);
+
+BOOL CloseHandle(HANDLE handle);
+
+static inline LONG InterlockedIncrement(volatile LONG * p){ return __sync_add_and_fetch(p,1); }
+static inline LONG InterlockedDecrement(volatile LONG * p){ return __sync_sub_and_fetch(p,1); }
+static inline LONG InterlockedExchangeAdd(volatile LONG * p, LONG v){ return __sync_fetch_and_add(p,v); }
+static inline LONG InterlockedCompareExchange(volatile LONG * p, LONG exchange, LONG comparand){ return __sync_val_compare_and_swap(p,comparand,exchange); }
+static inline LONG InterlockedExchange(volatile LONG * p, LONG v){ __sync_synchronize(); return __sync_lock_test_and_set(p,v); }
+
+// *** timing ***
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER * counter);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER * frequency);
+
+// *** files ***
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x00000001
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define FILE_FLAG_WRITE_THROUGH 0x80000000
+#define FILE_FLAG_OVERLAPPED 0x40000000
+#define FILE_FLAG_NO_BUFFERING 0x20000000
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+#define INVALID_HANDLE_VALUE ((HANDLE)(ptrdiff_t)-1)
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_IO_INCOMPLETE 996
+#define ERROR_IO_PENDING 997
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_WRITE 0x0002
+
+typedef struct {
+	size_t Internal; // 0 once the write has completed
+	size_t InternalHigh; // bytes written
+	DWORD Offset;
+	DWORD OffsetHigh;
+	HANDLE hEvent;
+	// the write in flight, so that a short one can be resubmitted
+	HANDLE file;
+	const void * buffer;
+	DWORD nBytes;
+	DWORD error;
+} OVERLAPPED;
+// picks up completions that have come in without waiting
+BOOL HasOverlappedIoCompleted(OVERLAPPED * overlapped);
+
+// only the access, disposition and FILE_FLAG_ bits are used. no buffering opens the file O_DIRECT
+// where the file system allows it, and write through opens it O_DSYNC. overlapped sets up an
+// io_uring for the file, and fails with ERROR_NOT_SUPPORTED if that can't be done
+HANDLE CreateFileA(const char * fileName, DWORD access, DWORD shareMode, void * security, DWORD disposition, DWORD flags, HANDLE templateFile);
+#define CreateFile CreateFileA
+// with overlapped set, writes at its offset. on a file opened for overlapped writes the write is
+// submitted to the file's ring and this fails with ERROR_IO_PENDING; otherwise it completes before returning
+BOOL WriteFile(HANDLE file, const void * buffer, DWORD nBytes, DWORD * nWritten, OVERLAPPED * overlapped);
+BOOL SetFilePointerEx(HANDLE file, LARGE_INTEGER distance, LARGE_INTEGER * newPosition, DWORD moveMethod);
+// growing a file allocates the space where the file system can, as on Windows
+BOOL SetEndOfFile(HANDLE file);
+BOOL DeleteFileA(const char * fileName);
+#define DeleteFile DeleteFileA
+DWORD GetLastError();
+
+HANDLE CreateEvent(void * attributes, BOOL manualReset, BOOL initialState, const char * name);
+BOOL ResetEvent(HANDLE event);
+BOOL GetOverlappedResult(HANDLE file, OVERLAPPED * overlapped, DWORD * nWritten, BOOL wait);
+
+// mapping more than the file holds extends it, as on Windows
+HANDLE CreateFileMapping(HANDLE file, void * attributes, DWORD protect, DWORD maximumSizeHigh, DWORD maximumSizeLow, const char * name);
+void * MapViewOfFile(HANDLE mapping, DWORD access, DWORD offsetHigh, DWORD offsetLow, size_t nBytes);
+BOOL UnmapViewOfFile(const void * view);
+
+// *** C runtime ***
+
+void * _aligned_malloc(size_t size, size_t alignment);
+void _aligned_free(void * p);
+#define _fseeki64 fseeko
+#define _ftelli64 ftello
+#define _fileno fileno
+#define _chsize_s ftruncate // both return 0 on success
+
+static inline unsigned char _BitScanForward64(unsigned long * index, unsigned long long mask){
+	if(mask == 0) return 0;
+	*index = (unsigned long)__builtin_ctzll(mask);
+	return 1;
+}
+
+#endif
+
+// name the calling thread, so that it can be told apart in a debugger, perf or top.
+// Linux keeps the first 15 characters
+void ufmfSetThreadName(const char * name);
+
+// register the nBuffers buffers of bufferSize bytes that overlapped writes to file will come from,
+// so that the kernel maps them once rather than on every write. returns FALSE if they couldn't be,
+// and writes from them still work. does nothing on Windows or for files not opened for overlapped writes
+BOOL ufmfRegisterBuffers(HANDLE file, void * const * buffers, int nBuffers, size_t bufferSize);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef __UFMF_QUEUE_H
+#define __UFMF_QUEUE_H
+
+#include "ufmfPlatform.h"
+
+#define UFMFCACHELINE 64 // bytes, so that the ends of a queue don't share a cache line
+
+// bounded lock-free queue of ints, used to hand frame slots between threads without the writer lock.
+// any number of threads can push and pop. each cell carries a sequence number saying whether it is
+// ready to be filled or emptied on the current pass around the ring, so a thread claims a cell with a
+// single compare-and-swap on the head or tail and never waits on another thread.
+// push and pop never block: callers that need to wait pair the queue with a semaphore counting the
+// items in it, as the compression threads do
+class ufmfQueue {
+
+public:
+
+	// capacity is rounded up to a power of 2
+	ufmfQueue(int capacity){
+		int i;
+		for(nCells = 1; nCells < capacity; nCells <<= 1);
+		cells = new Cell[nCells];
+		for(i = 0; i < nCells; i++){
+			cells[i].sequence = i;
+			cells[i].value = 0;
+		}
+		head = 0;
+		tail = 0;
+	}
+
+	~ufmfQueue(){
+		delete [] cells;
+	}
+
+	// add value at the tail. false if the queue is full
+	bool push(int value){
+		Cell * cell;
+		LONG pos = tail;
+		LONG diff;
+		while(true){
+			cell = &cells[pos & (nCells-1)];
+			diff = (LONG)((ULONG)cell->sequence - (ULONG)pos);
+			if(diff == 0){
+				// the cell is empty on this pass: claim it
+				if(InterlockedCompareExchange(&tail,pos+1,pos) == pos) break;
+				pos = tail;
+			}
+			else if(diff < 0){
+				// the cell still holds the item from the previous pass
+				return false;
+			}
+			else{
+				// another thread claimed it first
+				pos = tail;
+			}
+		}
+		cell->value = value;
+		// publish the value to the thread that pops it
+		InterlockedExchange(&cell->sequence,pos+1);
+		return true;
+	}
+
+	// take the value at the head. false if the queue is empty
+	bool pop(int &value){
+		Cell * cell;
+		LONG pos = head;
+		LONG diff;
+		while(true){
+			cell = &cells[pos & (nCells-1)];
+			diff = (LONG)((ULONG)cell->sequence - (ULONG)(pos+1));
+			if(diff == 0){
+				// the cell was filled on this pass: claim it
+				if(InterlockedCompareExchange(&head,pos+1,pos) == pos) break;
+				pos = head;
+			}
+			else if(diff < 0){
+				// nothing pushed here yet
+				return false;
+			}
+			else{
+				pos = head;
+			}
+		}
+		value = cell->value;
+		// free the cell for the next pass
+		InterlockedExchange(&cell->sequence,pos+nCells);
+		return true;
+	}
+
+	// number of items queued. only exact when no other thread is pushing or popping
+	int size(){
+		return (int)(LONG)((ULONG)tail - (ULONG)head);
+	}
+
+private:
+
+	struct Cell {
+		volatile LONG sequence;
+		int value;
+	};
+
+	Cell * cells;
+	LONG nCells;
+	char pad0[UFMFCACHELINE];
+	volatile LONG head; // next position to pop
+	char pad1[UFMFCACHELINE];
+	volatile LONG tail; // next position to push
+	char pad2[UFMFCACHELINE];
+
+};
+
+#endif
@@ -0,0 +1,393 @@
+// ufmfRecover: rebuild the index of a ufmf whose writer died before writing it.
+//
+// usage: ufmfRecover movie.ufmf
+//
+// the index pointer in the header of such a movie is still 0. if the movie was written with
+// UFMFCheckpointFrames, we search back from the end of the file for the last checkpoint chunk and
+// follow the checkpoints back to the first, which gives the index up to the last checkpoint. only
+// the chunks after it are scanned. without checkpoints, every chunk is scanned.
+// the index is written after the last complete chunk, the incomplete one, if any, is cut off, and
+// the index pointer in the header is set.
+
+#include "ufmfPlatform.h"
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+#include <vector>
+
+// chunk identifiers and checkpoint layout, as written by ufmfWriter
+#define KEYFRAMECHUNK 0
+#define FRAMECHUNK 1
+#define INDEX_DICT_CHUNK 2
+#define CHECKPOINT_CHUNK 3
+#define UFMFCHECKPOINTMAGIC "ufmfckpt"
+#define CHECKPOINTHEADERLENGTH (1 + 8 + 8) // chunk type, magic, payload length
+#define CHECKPOINTFOOTERLENGTH (8 + 8) // payload length, magic
+#define CHECKPOINTFIXEDPAYLOADLENGTH (8 + 8 + 8 + 4 + 4)
+
+#define SEARCHBLOCKSIZE (1 << 20) // bytes read at a time when searching back for a checkpoint
+
+// index entries of one kind of chunk
+typedef struct {
+	std::vector<__int64> locs;
+	std::vector<double> timestamps;
+} ufmfRecoverIndex;
+
+static FILE * fp = NULL;
+static unsigned __int64 fileSize = 0;
+
+// header fields we need
+static unsigned __int64 indexPtrLocation = 8;
+static unsigned __int16 maxWidth = 0;
+static unsigned __int16 maxHeight = 0;
+static unsigned __int64 headerEnd = 0;
+
+static bool readAt(unsigned __int64 loc, void * data, size_t nBytes){
+	if(loc + nBytes > fileSize) return false;
+	if(_fseeki64(fp,(__int64)loc,SEEK_SET) != 0) return false;
+	return fread(data,1,nBytes,fp) == nBytes;
+}
+
+static bool readHeader(unsigned __int64 &indexLocation){
+
+	char ufmfString[4];
+	unsigned __int32 version;
+	unsigned __int8 isFixedSize, colorCodingLength;
+	char colorCoding[256];
+
+	if(!readAt(0,ufmfString,4) || strncmp(ufmfString,"ufmf",4) != 0){
+		fprintf(stderr,"Not a ufmf file\n");
+		return false;
+	}
+	if(!readAt(4,&version,4) || !readAt(indexPtrLocation,&indexLocation,8) ||
+		!readAt(16,&maxWidth,2) || !readAt(18,&maxHeight,2) || !readAt(20,&isFixedSize,1) ||
+		!readAt(21,&colorCodingLength,1) || !readAt(22,colorCoding,colorCodingLength)){
+		fprintf(stderr,"Could not read the header\n");
+		return false;
+	}
+	colorCoding[colorCodingLength] = '\0';
+	if(version != 4 || strcmp(colorCoding,"MONO8") != 0){
+		fprintf(stderr,"Only version 4 MONO8 ufmfs are supported, this is version %u %s\n",version,colorCoding);
+		return false;
+	}
+	headerEnd = 22 + colorCodingLength;
+
+	return true;
+}
+
+// read the checkpoint chunk at loc, appending its entries. fails if it is not a whole checkpoint
+static bool readCheckpoint(unsigned __int64 loc, unsigned __int64 &prevLocation, unsigned __int64 &firstFrame,
+						   unsigned __int64 &firstKeyFrame, unsigned __int64 &end, ufmfRecoverIndex &frames, ufmfRecoverIndex &keyFrames){
+
+	unsigned __int8 chunkType;
+	char magic[8];
+	unsigned __int64 payloadLength, footerLength;
+	unsigned __int32 nFrames, nKeyFrames;
+	size_t nOld;
+
+	if(!readAt(loc,&chunkType,1) || chunkType != CHECKPOINT_CHUNK) return false;
+	if(!readAt(loc+1,magic,8) || memcmp(magic,UFMFCHECKPOINTMAGIC,8) != 0) return false;
+	if(!readAt(loc+9,&payloadLength,8) || payloadLength < CHECKPOINTFIXEDPAYLOADLENGTH) return false;
+	end = loc + CHECKPOINTHEADERLENGTH + payloadLength + CHECKPOINTFOOTERLENGTH;
+	if(end > fileSize || end < loc) return false;
+	if(!readAt(end-16,&footerLength,8) || footerLength != payloadLength) return false;
+	if(!readAt(end-8,magic,8) || memcmp(magic,UFMFCHECKPOINTMAGIC,8) != 0) return false;
+
+	loc += CHECKPOINTHEADERLENGTH;
+	if(!readAt(loc,&prevLocation,8) || !readAt(loc+8,&firstFrame,8) || !readAt(loc+16,&firstKeyFrame,8) ||
+		!readAt(loc+24,&nFrames,4) || !readAt(loc+28,&nKeyFrames,4)) return false;
+	if(payloadLength != CHECKPOINTFIXEDPAYLOADLENGTH + 16*(unsigned __int64)nFrames + 16*(unsigned __int64)nKeyFrames) return false;
+	loc += CHECKPOINTFIXEDPAYLOADLENGTH;
+
+	nOld = frames.locs.size();
+	frames.locs.resize(nOld+nFrames);
+	frames.timestamps.resize(nOld+nFrames);
+	if(nFrames > 0){
+		if(!readAt(loc,&frames.locs[nOld],8*(size_t)nFrames)) return false;
+		loc += 8*(unsigned __int64)nFrames;
+		if(!readAt(loc,&frames.timestamps[nOld],8*(size_t)nFrames)) return false;
+		loc += 8*(unsigned __int64)nFrames;
+	}
+	nOld = keyFrames.locs.size();
+	keyFrames.locs.resize(nOld+nKeyFrames);
+	keyFrames.timestamps.resize(nOld+nKeyFrames);
+	if(nKeyFrames > 0){
+		if(!readAt(loc,&keyFrames.locs[nOld],8*(size_t)nKeyFrames)) return false;
+		loc += 8*(unsigned __int64)nKeyFrames;
+		if(!readAt(loc,&keyFrames.timestamps[nOld],8*(size_t)nKeyFrames)) return false;
+	}
+
+	return true;
+}
+
+// search back from the end of the file for the last whole checkpoint. returns its location, 0 if none
+static unsigned __int64 findLastCheckpoint(){
+
+	char * buf = new char[SEARCHBLOCKSIZE];
+	unsigned __int64 blockEnd = fileSize, blockStart, payloadLength, prev, first, firstKey, end;
+	size_t n;
+	__int64 i;
+	ufmfRecoverIndex frames, keyFrames;
+
+	while(blockEnd > headerEnd){
+		// blocks overlap by 7 bytes so that we don't miss magics across block boundaries
+		blockStart = blockEnd > headerEnd + SEARCHBLOCKSIZE ? blockEnd - SEARCHBLOCKSIZE : headerEnd;
+		n = (size_t)(blockEnd - blockStart);
+		if(!readAt(blockStart,buf,n)) break;
+		for(i = (__int64)n - 8; i >= 0; i--){
+			if(memcmp(buf+i,UFMFCHECKPOINTMAGIC,8) != 0) continue;
+			// candidate footer magic. the payload length is just before it
+			unsigned __int64 magicLoc = blockStart + i;
+			if(magicLoc < headerEnd + CHECKPOINTHEADERLENGTH + CHECKPOINTFIXEDPAYLOADLENGTH + 8) continue;
+			if(!readAt(magicLoc-8,&payloadLength,8)) continue;
+			if(payloadLength > magicLoc) continue;
+			unsigned __int64 loc = magicLoc - 8 - payloadLength - CHECKPOINTHEADERLENGTH;
+			if(loc >= magicLoc) continue;
+			frames.locs.clear(); frames.timestamps.clear();
+			keyFrames.locs.clear(); keyFrames.timestamps.clear();
+			if(readCheckpoint(loc,prev,first,firstKey,end,frames,keyFrames) && end == magicLoc + 8){
+				delete [] buf;
+				return loc;
+			}
+		}
+		if(blockStart == headerEnd) break;
+		blockEnd = blockStart + 7;
+	}
+
+	delete [] buf;
+	return 0;
+}
+
+// read the index from the chain of checkpoints ending at lastCheckpoint. on success, scanFrom is
+// the end of the last checkpoint
+static bool readCheckpoints(unsigned __int64 lastCheckpoint, ufmfRecoverIndex &frames, ufmfRecoverIndex &keyFrames, unsigned __int64 &scanFrom){
+
+	// checkpoints from last to first, each holding the entries since the one before it
+	std::vector<ufmfRecoverIndex> chainFrames, chainKeyFrames;
+	std::vector<unsigned __int64> firstFrames, firstKeyFrames;
+	unsigned __int64 loc = lastCheckpoint, prev, first, firstKey, end;
+	size_t j;
+	int i;
+
+	while(loc != 0){
+		chainFrames.push_back(ufmfRecoverIndex());
+		chainKeyFrames.push_back(ufmfRecoverIndex());
+		if(!readCheckpoint(loc,prev,first,firstKey,end,chainFrames.back(),chainKeyFrames.back())){
+			fprintf(stderr,"Checkpoint at %llu is damaged\n",loc);
+			return false;
+		}
+		if(loc == lastCheckpoint) scanFrom = end;
+		if(prev >= loc){
+			fprintf(stderr,"Checkpoint at %llu points forward to %llu\n",loc,prev);
+			return false;
+		}
+		firstFrames.push_back(first);
+		firstKeyFrames.push_back(firstKey);
+		loc = prev;
+	}
+
+	// put them together in order
+	for(i = (int)chainFrames.size()-1; i >= 0; i--){
+		if(firstFrames[i] != frames.locs.size() || firstKeyFrames[i] != keyFrames.locs.size()){
+			fprintf(stderr,"Checkpoints are not contiguous\n");
+			return false;
+		}
+		for(j = 0; j < chainFrames[i].locs.size(); j++){
+			frames.locs.push_back(chainFrames[i].locs[j]);
+			frames.timestamps.push_back(chainFrames[i].timestamps[j]);
+		}
+		for(j = 0; j < chainKeyFrames[i].locs.size(); j++){
+			keyFrames.locs.push_back(chainKeyFrames[i].locs[j]);
+			keyFrames.timestamps.push_back(chainKeyFrames[i].timestamps[j]);
+		}
+	}
+
+	return true;
+}
+
+// scan chunks from loc, adding frames and keyframes to the index, until the end of the file or
+// a chunk that is incomplete or not a chunk. returns the end of the last whole chunk
+static unsigned __int64 scanChunks(unsigned __int64 loc, ufmfRecoverIndex &frames, ufmfRecoverIndex &keyFrames){
+
+	unsigned __int8 chunkType, typeLength;
+	char keyFrameType[256], dataType;
+	unsigned __int16 width, height, box[4];
+	unsigned __int32 ncc, cc;
+	double timestamp;
+	unsigned __int64 end, prev, first, firstKey;
+	ufmfRecoverIndex ignoreFrames, ignoreKeyFrames;
+	int bytesPerPixel;
+
+	while(loc < fileSize){
+
+		if(!readAt(loc,&chunkType,1)) break;
+
+		if(chunkType == KEYFRAMECHUNK){
+			if(!readAt(loc+1,&typeLength,1) || !readAt(loc+2,keyFrameType,typeLength) ||
+				!readAt(loc+2+typeLength,&dataType,1) || !readAt(loc+3+typeLength,&width,2) ||
+				!readAt(loc+5+typeLength,&height,2) || !readAt(loc+7+typeLength,&timestamp,8)) break;
+			switch(dataType){
+				case 'B': case 'b': case 'c': bytesPerPixel = 1; break;
+				case 'H': case 'h': bytesPerPixel = 2; break;
+				case 'f': case 'I': case 'i': bytesPerPixel = 4; break;
+				case 'd': bytesPerPixel = 8; break;
+				default: bytesPerPixel = 0;
+			}
+			if(bytesPerPixel == 0) break;
+			end = loc + 15 + typeLength + (unsigned __int64)width*(unsigned __int64)height*bytesPerPixel;
+			if(end > fileSize) break;
+			keyFrames.locs.push_back((__int64)loc);
+			keyFrames.timestamps.push_back(timestamp);
+		}
+		else if(chunkType == FRAMECHUNK){
+			if(!readAt(loc+1,&timestamp,8) || !readAt(loc+9,&ncc,4)) break;
+			end = loc + 13;
+			// boxes are read sequentially, skipping their pixels
+			for(cc = 0; cc < ncc; cc++){
+				if(end + 8 > fileSize || fread(box,2,4,fp) != 4) break;
+				if((unsigned __int32)box[0] + box[2] > maxWidth || (unsigned __int32)box[1] + box[3] > maxHeight) break;
+				end += 8 + (unsigned __int64)box[2]*(unsigned __int64)box[3];
+				if(end > fileSize || _fseeki64(fp,(__int64)end,SEEK_SET) != 0) break;
+			}
+			if(cc < ncc) break;
+			frames.locs.push_back((__int64)loc);
+			frames.timestamps.push_back(timestamp);
+		}
+		else if(chunkType == CHECKPOINT_CHUNK){
+			// everything in it is before it
+			if(!readCheckpoint(loc,prev,first,firstKey,end,ignoreFrames,ignoreKeyFrames)) break;
+			ignoreFrames.locs.clear(); ignoreFrames.timestamps.clear();
+			ignoreKeyFrames.locs.clear(); ignoreKeyFrames.timestamps.clear();
+		}
+		else{
+			break;
+		}
+
+		loc = end;
+	}
+
+	return loc;
+}
+
+static bool writeString(const char * s){
+	unsigned __int16 length = (unsigned __int16)strlen(s);
+	return fwrite(&length,2,1,fp) == 1 && fwrite(s,1,length,fp) == length;
+}
+
+static bool writeDictStart(unsigned __int8 nKeys){
+	char d = 'd';
+	return fwrite(&d,1,1,fp) == 1 && fwrite(&nKeys,1,1,fp) == 1;
+}
+
+static bool writeArray(const char * key, char dataType, const void * data, size_t n){
+	char a = 'a';
+	unsigned __int32 nBytes = (unsigned __int32)(8*n);
+	return writeString(key) && fwrite(&a,1,1,fp) == 1 && fwrite(&dataType,1,1,fp) == 1 &&
+		fwrite(&nBytes,4,1,fp) == 1 && (n == 0 || fwrite(data,8,n,fp) == n);
+}
+
+// write the index dictionary as ufmfWriter does at loc, and return its location in indexLocation
+static bool writeIndex(unsigned __int64 loc, ufmfRecoverIndex &frames, ufmfRecoverIndex &keyFrames, unsigned __int64 &indexLocation){
+
+	unsigned __int8 chunkType = INDEX_DICT_CHUNK;
+	const void * p;
+	bool res;
+
+	if(_fseeki64(fp,(__int64)loc,SEEK_SET) != 0) return false;
+	res = fwrite(&chunkType,1,1,fp) == 1;
+	indexLocation = loc + 1;
+
+	res = res && writeDictStart(2);
+	res = res && writeString("frame") && writeDictStart(2);
+	p = frames.locs.size() ? (const void*)&frames.locs[0] : NULL;
+	res = res && writeArray("loc",'q',p,frames.locs.size());
+	p = frames.timestamps.size() ? (const void*)&frames.timestamps[0] : NULL;
+	res = res && writeArray("timestamp",'d',p,frames.timestamps.size());
+	res = res && writeString("keyframe") && writeDictStart(1);
+	res = res && writeString("mean") && writeDictStart(2);
+	p = keyFrames.locs.size() ? (const void*)&keyFrames.locs[0] : NULL;
+	res = res && writeArray("loc",'q',p,keyFrames.locs.size());
+	p = keyFrames.timestamps.size() ? (const void*)&keyFrames.timestamps[0] : NULL;
+	res = res && writeArray("timestamp",'d',p,keyFrames.timestamps.size());
+
+	return res;
+}
+
+int main(int argc, char * argv[]){
+
+	unsigned __int64 indexLocation, lastCheckpoint, scanFrom, validEnd, end;
+	ufmfRecoverIndex frames, keyFrames;
+	size_t nFramesCheckpointed = 0;
+
+	if(argc != 2){
+		fprintf(stderr,"usage: ufmfRecover movie.ufmf\n");
+		return 1;
+	}
+
+	fp = fopen(argv[1],"r+b");
+	if(fp == NULL){
+		fprintf(stderr,"Could not open %s\n",argv[1]);
+		return 1;
+	}
+	_fseeki64(fp,0,SEEK_END);
+	fileSize = (unsigned __int64)_ftelli64(fp);
+
+	if(!readHeader(indexLocation)){
+		fclose(fp);
+		return 1;
+	}
+	if(indexLocation != 0){
+		printf("%s already has an index at %llu\n",argv[1],indexLocation);
+		fclose(fp);
+		return 0;
+	}
+
+	// index up to the last checkpoint
+	scanFrom = headerEnd;
+	lastCheckpoint = findLastCheckpoint();
+	if(lastCheckpoint != 0){
+		if(readCheckpoints(lastCheckpoint,frames,keyFrames,scanFrom)){
+			nFramesCheckpointed = frames.locs.size();
+			printf("Last checkpoint at %llu indexes %u frames and %u keyframes\n",lastCheckpoint,
+				(unsigned int)frames.locs.size(),(unsigned int)keyFrames.locs.size());
+		}
+		else{
+			fprintf(stderr,"Scanning the whole file instead\n");
+			frames.locs.clear(); frames.timestamps.clear();
+			keyFrames.locs.clear(); keyFrames.timestamps.clear();
+			scanFrom = headerEnd;
+		}
+	}
+	else{
+		printf("No checkpoints found, scanning the whole file\n");
+	}
+
+	// the rest
+	validEnd = scanChunks(scanFrom,frames,keyFrames);
+	printf("Scanned %llu bytes, found %u more frames. %llu bytes after the last whole chunk are dropped\n",
+		validEnd-scanFrom,(unsigned int)(frames.locs.size()-nFramesCheckpointed),fileSize-validEnd);
+
+	// write the index over the incomplete chunk, cut the file after it, and point the header at it
+	if(!writeIndex(validEnd,frames,keyFrames,indexLocation)){
+		fprintf(stderr,"Error writing the index\n");
+		fclose(fp);
+		return 1;
+	}
+	fflush(fp);
+	end = (unsigned __int64)_ftelli64(fp);
+	if(end < fileSize && _chsize_s(_fileno(fp),(__int64)end) != 0){
+		fprintf(stderr,"Could not truncate the file to %llu bytes\n",end);
+	}
+	if(_fseeki64(fp,(__int64)indexPtrLocation,SEEK_SET) != 0 || fwrite(&indexLocation,8,1,fp) != 1){
+		fprintf(stderr,"Error writing the index location\n");
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	printf("Recovered %u frames and %u keyframes\n",(unsigned int)frames.locs.size(),(unsigned int)keyFrames.locs.size());
+
+	return 0;
+}
@@ -1,6 +1,14 @@
-#include <windows.h>
+#include "ufmfPlatform.h"
 #include <stdio.h>
+#include <malloc.h>
 #include "ufmfWriter.h"
+#include "ufmfKernels.h"
+
+// alignment of the background count block
+#define BGCOUNTSALIGNMENT 64
+
+// longest run of background pixels bridged when merging boxes: a box header is 8 bytes
+#define MERGEDBOXGAP 8
 
 // ************************* BackgroundModel **************************
 
@@ -15,6 +23,10 @@ void BackgroundModel::init(){
 	BGBinSize = 1;
 	BGNBins = (int)ceil(256.0 / (float)BGBinSize);
 	BGHalfBin = ((float)BGBinSize - 1.0) / 2.0;
+	BGCountsStride = (BGNBins + BGCOUNTSALIGNMENT - 1) & ~(BGCOUNTSALIGNMENT - 1);
+	// with an even number of cache lines between pixels (256 bytes for 256 bins), consecutive pixels'
+	// counts map to a fraction of the cache sets and evict each other. an odd number spreads them out
+	if((BGCountsStride / BGCOUNTSALIGNMENT) % 2 == 0) BGCountsStride += BGCOUNTSALIGNMENT;
 
 	// initialize counts to 0
 	nFramesAdded = 0;
@@ -24,6 +36,9 @@ void BackgroundModel::init(){
 	nPixels = 0;
 	BGCounts = NULL;
 	BGCenter = NULL;
+	BGMedianBin = NULL;
+	BGBelow = NULL;
+	incrementalMedian = false;
 	
 }
 
@@ -31,23 +46,33 @@ BackgroundModel::BackgroundModel(){
 	init();
 }
 
-BackgroundModel::BackgroundModel(unsigned __int32 nPixels, int minNFramesReset){
-
-	int i;
+BackgroundModel::BackgroundModel(unsigned __int32 nPixels, int minNFramesReset, bool incrementalMedian){
 
 	init();
 
 	this->nPixels = nPixels;
 	this->minNFramesReset = minNFramesReset;
+	this->incrementalMedian = incrementalMedian;
 
-	// allocate
-	BGCounts = new unsigned __int8*[nPixels];
-	for(i = 0; i < nPixels; i++) {
-		BGCounts[i] = new unsigned __int8[BGNBins];
-		memset(BGCounts[i],0,BGNBins*sizeof(unsigned __int8));
+	// allocate all the counts as one block so that addFrame and updateModel stream through memory.
+	// pixel i's counts are at BGCounts[i*BGCountsStride]
+	BGCounts = (unsigned __int8*)_aligned_malloc((size_t)nPixels*(size_t)BGCountsStride,BGCOUNTSALIGNMENT);
+	if(BGCounts == NULL){
+		fprintf(stderr,"Error allocating background model counts for %u pixels\n",nPixels);
+		this->nPixels = 0;
+	}
+	else{
+		memset(BGCounts,0,(size_t)nPixels*(size_t)BGCountsStride);
 	}
 	BGCenter = new float[nPixels];
 	memset(BGCenter,0,nPixels*sizeof(float));
+	if(incrementalMedian){
+		// all cursors start at bin 0, with nothing below them
+		BGMedianBin = new unsigned __int8[nPixels];
+		memset(BGMedianBin,0,nPixels*sizeof(unsigned __int8));
+		BGBelow = new unsigned __int16[nPixels];
+		memset(BGBelow,0,nPixels*sizeof(unsigned __int16));
+	}
 }
 
 BackgroundModel::~BackgroundModel(){
@@ -56,13 +81,13 @@ BackgroundModel::~BackgroundModel(){
 		delete [] BGCenter; BGCenter = NULL;
 	}
 	if(BGCounts != NULL){
-		//for(int i = 0; i < nPixels; i++){
-		//	if(BGCounts[i] != NULL){
-		//		if((i%1000)==0) fprintf(stderr,"Deleting BGCounts[%d]\n",i);
-		//		delete [] BGCounts[i]; BGCounts[i] = NULL;
-		//	}
-		//}
-		delete [] BGCounts; BGCounts = NULL;
+		_aligned_free(BGCounts); BGCounts = NULL;
+	}
+	if(BGMedianBin != NULL){
+		delete [] BGMedianBin; BGMedianBin = NULL;
+	}
+	if(BGBelow != NULL){
+		delete [] BGBelow; BGBelow = NULL;
 	}
 	fprintf(stderr,"Deallocated bgcounts\n");
 	nPixels = 0;
@@ -73,15 +98,10 @@ BackgroundModel::~BackgroundModel(){
 
 bool BackgroundModel::addFrame(unsigned char * im, double timestamp){
 
-	for(int i = 0; i < nPixels; i++){
-		if(im[i] < 0 || im[i] >= BGNBins){
-			// im out of bounds
-			return false;
-		}
-		else{
-			BGCounts[i][im[i]/BGBinSize]++;
-		}
-	}
+	if(incrementalMedian)
+		ufmfAccumulateCountsMedian(im,BGCounts,BGMedianBin,BGBelow,nPixels,BGCountsStride,BGBinSize);
+	else
+		ufmfAccumulateCounts(im,BGCounts,nPixels,BGCountsStride,BGBinSize);
 	BGZ++;
 	nFramesAdded++;
 	return true;
@@ -91,27 +111,46 @@ bool BackgroundModel::updateModel(){
 
 	int i, j;
 	unsigned __int32 countscurr;
+	unsigned __int8 * counts;
 
-	// compute the median
+	// compute the median: the first bin at which the cumulative count exceeds off
 	unsigned __int8 off = (unsigned __int8)(BGZ/2);
-	for(i = 0; i < nPixels; i++){
-		for(j = 0, countscurr = 0; j < BGNBins, countscurr <= off; j++){
-			 countscurr+=(unsigned __int32)BGCounts[i][j];
+	if(incrementalMedian){
+		// move each cursor from last update's median. counts only grow between resets,
+		// so for a slowly changing background this is a step or two rather than a full scan
+		for(i = 0, counts = BGCounts; i < nPixels; i++, counts += BGCountsStride){
+			j = BGMedianBin[i];
+			countscurr = BGBelow[i];
+			while(j > 0 && countscurr > off){
+				j--;
+				countscurr -= (unsigned __int32)counts[j];
+			}
+			while(j < BGNBins-1 && countscurr + (unsigned __int32)counts[j] <= off){
+				countscurr += (unsigned __int32)counts[j];
+				j++;
+			}
+			BGMedianBin[i] = (unsigned __int8)j;
+			BGBelow[i] = (unsigned __int16)countscurr;
+			BGCenter[i] = (float)(j*BGBinSize) + BGHalfBin;
+		}
+	}
+	else{
+		for(i = 0, counts = BGCounts; i < nPixels; i++, counts += BGCountsStride){
+			for(j = 0, countscurr = 0; j < BGNBins && countscurr <= off; j++){
+				 countscurr+=(unsigned __int32)counts[j];
+			}
+			BGCenter[i] = (float)((j-1)*BGBinSize) + BGHalfBin;
 		}
-		BGCenter[i] = (float)((j-1)*BGBinSize) + BGHalfBin;
 	}
 
 	// lower the weight of the old counts
 	//if(BGZ > MaxBGZ){
 	if(nFramesAdded >= minNFramesReset){
 		//float w = MaxBGZ / BGZ;
-		for(i = 0; i < nPixels; i++){
-			memset(BGCounts[i],0,BGNBins);
-			//for(j = 0; j < BGNBins; j++){
-				//BGCounts[i][j] = (unsigned __int8)(w*BGCounts[i][j]);
-				//BGCounts[i][j] = BGCounts[i][j] >> 1; // divide by 2
-			//}
-		}
+		memset(BGCounts,0,(size_t)nPixels*(size_t)BGCountsStride);
+		// keep the median cursors where they are, there is just nothing below them now
+		if(incrementalMedian)
+			memset(BGBelow,0,nPixels*sizeof(unsigned __int16));
 		//BGZ = MaxBGZ;
 		BGZ = 0;
 	}
@@ -119,6 +158,10 @@ bool BackgroundModel::updateModel(){
 	return true;
 }
 
+const float * BackgroundModel::getBGCenter(){
+	return BGCenter;
+}
+
 // ******************************** CompressedFrame **************************************
 
 void CompressedFrame::init(){
@@ -126,12 +169,17 @@ void CompressedFrame::init(){
 	wHeight = 0;
 	nPixels = 0;
 	isFore = NULL;
+	foreStride = 0;
 	writeRowBuffer = NULL;
 	writeColBuffer = NULL;
 	writeWidthBuffer = NULL;
 	writeHeightBuffer = NULL;
 	writeDataBuffer = NULL;
-	nWrites = NULL;
+	isWritten = NULL;
+	chunkBuffer = NULL;
+	chunkLength = 0;
+	chunkBufferSize = 0;
+	fileOffset = 0;
 	timestamp = -1;
 	ncc = 0;
 	numFore = 0;
@@ -143,6 +191,28 @@ void CompressedFrame::init(){
 	boxArea = ((int)boxLength) * ((int)boxLength); // boxLength^2
 	maxFracFgCompress = .25; // maximum fraction of pixels that can be foreground in order for us to compress
 	maxNFgCompress = 0; // nPixels == 0 currently
+	countAllFore = true; // stop counting foreground pixels early only if told we can
+	mergeBoxes = false; // store boxes of at most boxLength
+	nBands = 1; // compress the whole frame on one thread
+
+	bandRowStarts = NULL;
+	bandNumFore = NULL;
+	bandNcc = NULL;
+	bandNumPxWritten = NULL;
+	bandIm = NULL;
+	bandLowerBound = NULL;
+	bandUpperBound = NULL;
+	bandThreads = NULL;
+	bandStartSignals = NULL;
+	bandDoneSignals = NULL;
+	bandThreadCount = 0;
+	bandThreadsStopping = false;
+	isForeOrig = NULL;
+	seamRowBuffer = NULL;
+	seamColBuffer = NULL;
+	seamWidthBuffer = NULL;
+	seamHeightBuffer = NULL;
+	seamBufferSize = 0;
 
 }
 
@@ -150,7 +220,7 @@ CompressedFrame::CompressedFrame(){
 	init();
 }
 
-CompressedFrame::CompressedFrame(unsigned short wWidth, unsigned short wHeight, unsigned __int32 boxLength, double maxFracFgCompress){
+CompressedFrame::CompressedFrame(unsigned short wWidth, unsigned short wHeight, unsigned __int32 boxLength, double maxFracFgCompress, int nBands){
 
 	init();
 
@@ -166,8 +236,9 @@ CompressedFrame::CompressedFrame(unsigned short wWidth, unsigned short wHeight,
 	maxNFgCompress = (int)((double)nPixels * maxFracFgCompress);
 
 	// initialize backsub buffers
-    isFore = new bool[nPixels]; // whether each pixel is foreground or not
-	memset(isFore,0,nPixels*sizeof(bool));
+	foreStride = ((int)wWidth + 63) / 64;
+	isFore = new unsigned __int64[(int)wHeight*foreStride]; // whether each pixel is foreground or not
+	memset(isFore,0,(int)wHeight*foreStride*sizeof(unsigned __int64));
 
 	writeRowBuffer = new unsigned __int16[nPixels]; // ymins
 	memset(writeRowBuffer,0,nPixels*sizeof(unsigned __int16));
@@ -179,8 +250,101 @@ CompressedFrame::CompressedFrame(unsigned short wWidth, unsigned short wHeight,
 	memset(writeHeightBuffer,0,nPixels*sizeof(unsigned __int16));
 	writeDataBuffer = new unsigned __int8[nPixels]; // image data
 	memset(writeDataBuffer,0,nPixels*sizeof(unsigned __int8));
-	nWrites = new unsigned __int16[nPixels]; // number of times we've written each pixel
-	memset(nWrites,0,nPixels*sizeof(unsigned __int16));
+	// big enough for an uncompressed frame. frames with many small boxes can need more, and it is
+	// grown when they come
+	chunkBufferSize = 1 + 8 + 4 + 8 + (unsigned __int64)nPixels;
+	chunkBuffer = new unsigned __int8[chunkBufferSize];
+	isWritten = new unsigned __int64[(int)wHeight*foreStride]; // whether we've written each pixel
+	memset(isWritten,0,(int)wHeight*foreStride*sizeof(unsigned __int64));
+
+	// bands
+	this->nBands = max(1,min(nBands,(int)wHeight));
+	bandRowStarts = new int[this->nBands+1];
+	bandNumFore = new int[this->nBands];
+	memset(bandNumFore,0,this->nBands*sizeof(int));
+	bandNcc = new unsigned __int32[this->nBands];
+	memset(bandNcc,0,this->nBands*sizeof(unsigned __int32));
+	bandNumPxWritten = new int[this->nBands];
+	memset(bandNumPxWritten,0,this->nBands*sizeof(int));
+	bandThreads = new HANDLE[this->nBands];
+	bandStartSignals = new HANDLE[this->nBands];
+	bandDoneSignals = new HANDLE[this->nBands];
+	for(int b = 0; b < this->nBands; b++){
+		bandThreads[b] = NULL;
+		bandStartSignals[b] = CreateSemaphore(NULL,0,1,NULL);
+		bandDoneSignals[b] = CreateSemaphore(NULL,0,1,NULL);
+	}
+
+	// start band threads one at a time so that each takes the next band index
+	for(int b = 1; b < this->nBands; b++){
+		if(bandStartSignals[b] == NULL || bandDoneSignals[b] == NULL){
+			fprintf(stderr,"Error creating semaphores for band %d, using %d bands\n",b,b);
+			this->nBands = b;
+			break;
+		}
+		bandThreads[b] = CreateThread(NULL,0,bandThread,this,0,NULL);
+		if(bandThreads[b] == NULL || WaitForSingleObject(bandDoneSignals[b],MAXWAITTIMEMS) != WAIT_OBJECT_0){
+			fprintf(stderr,"Error starting thread for band %d, using %d bands\n",b,b);
+			this->nBands = b;
+			break;
+		}
+	}
+	// release the signals of bands we couldn't start
+	for(int b = this->nBands; b < nBands && b < (int)wHeight; b++){
+		if(bandStartSignals[b] != NULL){ CloseHandle(bandStartSignals[b]); bandStartSignals[b] = NULL; }
+		if(bandDoneSignals[b] != NULL){ CloseHandle(bandDoneSignals[b]); bandDoneSignals[b] = NULL; }
+	}
+	setBandRows();
+	if(this->nBands > 1){
+		isForeOrig = new unsigned __int64[(int)wHeight*foreStride];
+		memset(isForeOrig,0,(int)wHeight*foreStride*sizeof(unsigned __int64));
+	}
+
+}
+
+// split the rows as evenly as possible
+void CompressedFrame::setBandRows(){
+	for(int b = 0; b <= nBands; b++){
+		bandRowStarts[b] = (int)(((__int64)b * (__int64)wHeight) / nBands);
+	}
+}
+
+DWORD WINAPI CompressedFrame::bandThread(void* param){
+	CompressedFrame* frame = reinterpret_cast<CompressedFrame*>(param);
+
+	// get index for this thread. band 0 is done by the compression thread
+	int band = ++frame->bandThreadCount;
+
+	ufmfSetThreadName("ufmf band");
+	SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_TIME_CRITICAL);
+
+	// Signal that we are ready to compress
+	ReleaseSemaphore(frame->bandDoneSignals[band],1,NULL);
+
+	while(true){
+		WaitForSingleObject(frame->bandStartSignals[band],INFINITE);
+		if(frame->bandThreadsStopping) break;
+		frame->compressBand(band);
+		ReleaseSemaphore(frame->bandDoneSignals[band],1,NULL);
+	}
+
+	return 0;
+}
+
+void CompressedFrame::stopBandThreads(){
+
+	int b;
+	bandThreadsStopping = true;
+	for(b = 1; b < bandThreadCount+1; b++){
+		if(bandThreads[b] == NULL) continue;
+		ReleaseSemaphore(bandStartSignals[b],1,NULL);
+		if(WaitForSingleObject(bandThreads[b],MAXWAITTIMEMS) != WAIT_OBJECT_0){
+			fprintf(stderr,"Error shutting down thread for band %d\n",b);
+		}
+		CloseHandle(bandThreads[b]);
+		bandThreads[b] = NULL;
+	}
+	bandThreadCount = 0;
 
 }
 
@@ -204,9 +368,46 @@ CompressedFrame::~CompressedFrame(){
 	if(writeDataBuffer != NULL){
 		delete[] writeDataBuffer; writeDataBuffer = NULL;
 	}
-	if(nWrites != NULL){
-		delete [] nWrites; nWrites = NULL;
+	if(chunkBuffer != NULL){
+		delete[] chunkBuffer; chunkBuffer = NULL;
+	}
+	chunkBufferSize = 0;
+	chunkLength = 0;
+	if(isWritten != NULL){
+		delete [] isWritten; isWritten = NULL;
+	}
+	if(bandThreads != NULL){
+		stopBandThreads();
+		for(int b = 0; b < nBands; b++){
+			if(bandStartSignals[b] != NULL) CloseHandle(bandStartSignals[b]);
+			if(bandDoneSignals[b] != NULL) CloseHandle(bandDoneSignals[b]);
+		}
+		delete [] bandThreads; bandThreads = NULL;
+		delete [] bandStartSignals; bandStartSignals = NULL;
+		delete [] bandDoneSignals; bandDoneSignals = NULL;
+	}
+	if(bandRowStarts != NULL){
+		delete [] bandRowStarts; bandRowStarts = NULL;
+	}
+	if(bandNumFore != NULL){
+		delete [] bandNumFore; bandNumFore = NULL;
 	}
+	if(bandNcc != NULL){
+		delete [] bandNcc; bandNcc = NULL;
+	}
+	if(bandNumPxWritten != NULL){
+		delete [] bandNumPxWritten; bandNumPxWritten = NULL;
+	}
+	if(isForeOrig != NULL){
+		delete [] isForeOrig; isForeOrig = NULL;
+	}
+	if(seamRowBuffer != NULL){
+		delete [] seamRowBuffer; seamRowBuffer = NULL;
+		delete [] seamColBuffer; seamColBuffer = NULL;
+		delete [] seamWidthBuffer; seamWidthBuffer = NULL;
+		delete [] seamHeightBuffer; seamHeightBuffer = NULL;
+	}
+	seamBufferSize = 0;
 	nPixels = 0;
 	ncc = 0;
 	timestamp = -1;
@@ -218,30 +419,36 @@ bool CompressedFrame::setData(unsigned __int8 * im, double timestamp, unsigned _
 	unsigned __int8 * BGLowerBound, unsigned __int8 * BGUpperBound){
 
 	// grab foreground boxes
-	unsigned __int16 r, c, r1, c1;
-	int i;
+	int b;
 	int j;
-	int i1;
 	numFore = 0;
 	numPxWritten = -1;
 
-	_int64 filePosStart;
-	_int64 filePosEnd;
-	//_int64 frameSizeBytes;
-	//bool isCompressed;
-
 	this->timestamp = timestamp;
 	this->frameNumber = frameNumber;
 
-	// background subtraction
-	for(i = 0; i < nPixels; i++){
-		isFore[i] = (im[i] < BGLowerBound[i]) || (im[i] > BGUpperBound[i]);
-		if(isFore[i]) {
-			numFore++;
+	// background subtraction. before the first background model there is nothing to subtract
+	if(BGLowerBound == NULL || BGUpperBound == NULL){
+		numFore = nPixels;
+	}
+	else{
+		// band 0 is compressed on this thread, the others on the band threads
+		bandIm = im;
+		bandLowerBound = BGLowerBound;
+		bandUpperBound = BGUpperBound;
+		for(b = 1; b < nBands; b++){
+			ReleaseSemaphore(bandStartSignals[b],1,NULL);
+		}
+		compressBand(0);
+		for(b = 1; b < nBands; b++){
+			WaitForSingleObject(bandDoneSignals[b],INFINITE);
+		}
+		for(b = 0; b < nBands; b++){
+			numFore += bandNumFore[b];
 		}
 	}
 
-	if(numFore > maxNFgCompress){
+	if(BGLowerBound == NULL || BGUpperBound == NULL || numFore > maxNFgCompress){
 		// don't compress if too many foreground pixels
 		writeRowBuffer[0] = 0;
 		writeColBuffer[0] = 0;
@@ -252,80 +459,306 @@ bool CompressedFrame::setData(unsigned __int8 * im, double timestamp, unsigned _
 		}
 
 		// each pixel is written -- for statistics
-		for(j = 0; j < nPixels; j++){
-			nWrites[j] = 1;
-		}
+		memset(isWritten,255,(int)wHeight*foreStride*sizeof(unsigned __int64));
 		numPxWritten = nPixels;
 		ncc = 1;
 		isCompressed = false;
 	}
 	else{
 
-		//for(i = 0; i < nPixels; i++){
-		//	debugWasFore[i] = isFore[i];
-		//}
-
-		bool doStopEarly = 0;
-		for(i1 = 0; i1 < nPixels; i1++) nWrites[i1] = 0;
-
-		i = 0; j = 0; ncc = 0;
-		for(r = 0; r < wHeight; r++){
-			for(c = 0; c < wWidth; c++, i++){
-
-				// start a new box if this pixel is foreground
-				if(!isFore[i]) continue;
-
-				// store everything in box with corner at (r,c)
-				writeRowBuffer[ncc] = r;
-				writeColBuffer[ncc] = c;
-				writeWidthBuffer[ncc] = min((unsigned short)boxLength,wWidth-c);
-				writeHeightBuffer[ncc] = min((unsigned short)boxLength,wHeight-r);
-
-				// loop through pixels to store
-				for(r1 = r; r1 < r + writeHeightBuffer[ncc]; r1++){
-
-					// check if we've already written something in this column
-					doStopEarly = 0;
-					for(c1 = c, i1 = r1*wWidth+c; c1 < c + writeWidthBuffer[ncc]; c1++, i1++){
-						if(nWrites[i1] > 0){
-							doStopEarly = 1;
-							break;
-						}
-					}
-
-					if(doStopEarly){
-						if(r1 == r){
-							// if this is the first row, then shorten the width and write as usual
-							writeWidthBuffer[ncc] = c1 - c;
-						}
-						else{
-							// otherwise, shorten the height, and don't write any of this row
-							writeHeightBuffer[ncc] = r1 - r;
-							break;
-						}
-					}
-
-					for(c1 = c, i1 = r1*wWidth+c; c1 < c + writeWidthBuffer[ncc]; c1++, i1++){
-						nWrites[i1]++;
-						writeDataBuffer[j] = im[i1];
-						isFore[i1] = 0;
-						j++;
-					}
+		// merge the bands in row order, so the boxes stay in raster order. band 0's boxes are
+		// already in place, and the boxes at each seam are redone, so the frame is stored exactly
+		// as it is with one band
+		ncc = bandNcc[0];
+		numPxWritten = bandNumPxWritten[0];
+		for(b = 1; b < nBands; b++){
+			mergeSeam(b);
+		}
+		isCompressed = true;
+	}
+
+	return true;
+
+}
+
+// threshold the rows of band and store its boxes, which are clipped to the band. a band can't
+// write more boxes or pixels than it has pixels, so it can use the write buffers from its first pixel
+void CompressedFrame::compressBand(int band){
+
+	int r, i, w;
+	int r0 = bandRowStarts[band];
+	int r1 = bandRowStarts[band+1];
+	unsigned __int64 * foreRow;
+	unsigned __int32 nBoxes = (unsigned __int32)(r0*(int)wWidth);
+	int nPx = r0*(int)wWidth;
+
+	bandNumFore[band] = 0;
+	bandNcc[band] = 0;
+	bandNumPxWritten[band] = 0;
+
+	for(r = r0; r < r1; r++){
+		i = r*(int)wWidth;
+		bandNumFore[band] += ufmfThresholdRow(bandIm+i,bandLowerBound+i,bandUpperBound+i,isFore+r*foreStride,wWidth);
+		// the frame will be stored raw, so the rest of the mask is not needed
+		if(!countAllFore && bandNumFore[band] > maxNFgCompress) break;
+	}
+
+	// no need to find boxes if the frame is going to be stored raw
+	if(bandNumFore[band] > maxNFgCompress){
+		return;
+	}
+
+	memset(isWritten+r0*foreStride,0,(r1-r0)*foreStride*sizeof(unsigned __int64));
+	// keep the mask as found, to redo the boxes at the seams with
+	if(isForeOrig != NULL){
+		memcpy(isForeOrig+r0*foreStride,isFore+r0*foreStride,(r1-r0)*foreStride*sizeof(unsigned __int64));
+	}
+
+	// visit foreground pixels in raster order, 64 at a time. each box clears the foreground
+	// bits it covers, so rereading the word gives the next pixel not yet written
+	for(r = r0; r < r1; r++){
+		foreRow = isFore + r*foreStride;
+		for(w = 0; w < foreStride; w++){
+			while(foreRow[w] != 0){
+				if(mergeBoxes){
+					addMergedBox(bandIm,r,(w << 6) + ufmfFirstBit64(foreRow[w]),r1,nBoxes,nPx);
+				}
+				else{
+					addBox(bandIm,r,(w << 6) + ufmfFirstBit64(foreRow[w]),r1,nBoxes,nPx);
+				}
+			}
+		}
+	}
+
+	bandNcc[band] = nBoxes - (unsigned __int32)(r0*(int)wWidth);
+	bandNumPxWritten[band] = nPx - r0*(int)wWidth;
+
+}
+
+// the boxes above the seam are final up to the first one that stops at the seam, which a single
+// band might have grown past it. all the boxes from there on depend on the rows below the seam
+// only through the boxes reaching past each row, so once the redone boxes and the band's own reach
+// past a row alike, the band's own boxes from that row on are the ones a single band finds
+void CompressedFrame::mergeSeam(int band){
+
+	int s = bandRowStarts[band];
+	int e = bandRowStarts[band+1];
+	int first = s*(int)wWidth; // where the band's boxes and data start in the write buffers
+	unsigned __int32 i, i0, q, nSaved, nBoxes;
+	int r, r1, w, nPx;
+	unsigned __int64 * foreRow;
+	bool agrees = false;
+
+	// the first box that stops at the seam, and the data of the boxes before it
+	nPx = 0;
+	for(i0 = 0; i0 < ncc; i0++){
+		if((int)writeRowBuffer[i0] + (int)writeHeightBuffer[i0] == s) break;
+		nPx += (int)writeWidthBuffer[i0] * (int)writeHeightBuffer[i0];
+	}
+
+	// nothing above reaches the seam, so the band's boxes are already the ones a single band finds
+	if(i0 == ncc){
+		if(first != (int)ncc){
+			memmove(writeRowBuffer+ncc,writeRowBuffer+first,bandNcc[band]*sizeof(unsigned __int16));
+			memmove(writeColBuffer+ncc,writeColBuffer+first,bandNcc[band]*sizeof(unsigned __int16));
+			memmove(writeWidthBuffer+ncc,writeWidthBuffer+first,bandNcc[band]*sizeof(unsigned __int16));
+			memmove(writeHeightBuffer+ncc,writeHeightBuffer+first,bandNcc[band]*sizeof(unsigned __int16));
+		}
+		if(first != numPxWritten){
+			memmove(writeDataBuffer+numPxWritten,writeDataBuffer+first,bandNumPxWritten[band]);
+		}
+		ncc += bandNcc[band];
+		numPxWritten += bandNumPxWritten[band];
+		return;
+	}
+
+	// save the band's own boxes, as the redone ones can overwrite them
+	nSaved = bandNcc[band];
+	if(nSaved > seamBufferSize){
+		if(seamRowBuffer != NULL){
+			delete [] seamRowBuffer;
+			delete [] seamColBuffer;
+			delete [] seamWidthBuffer;
+			delete [] seamHeightBuffer;
+		}
+		seamRowBuffer = new unsigned __int16[nSaved];
+		seamColBuffer = new unsigned __int16[nSaved];
+		seamWidthBuffer = new unsigned __int16[nSaved];
+		seamHeightBuffer = new unsigned __int16[nSaved];
+		seamBufferSize = nSaved;
+	}
+	memcpy(seamRowBuffer,writeRowBuffer+first,nSaved*sizeof(unsigned __int16));
+	memcpy(seamColBuffer,writeColBuffer+first,nSaved*sizeof(unsigned __int16));
+	memcpy(seamWidthBuffer,writeWidthBuffer+first,nSaved*sizeof(unsigned __int16));
+	memcpy(seamHeightBuffer,writeHeightBuffer+first,nSaved*sizeof(unsigned __int16));
+
+	// put the masks from that box's row down back to how a single band finds them there: the
+	// foreground, less what the boxes before it cover
+	r = (int)writeRowBuffer[i0];
+	memcpy(isFore+r*foreStride,isForeOrig+r*foreStride,(e-r)*foreStride*sizeof(unsigned __int64));
+	memset(isWritten+r*foreStride,0,(e-r)*foreStride*sizeof(unsigned __int64));
+	for(i = 0; i < i0; i++){
+		if((int)writeRowBuffer[i] + (int)writeHeightBuffer[i] > r){
+			markBoxWritten(writeRowBuffer[i],writeColBuffer[i],writeWidthBuffer[i],writeHeightBuffer[i],r);
+		}
+	}
+
+	// redo the boxes in raster order from there, checking at each row of the band
+	nBoxes = i0;
+	for(; r < e; r++){
+		if(r >= s && seamAgrees(r,i0,nBoxes,nSaved)){
+			agrees = true;
+			break;
+		}
+		foreRow = isFore + r*foreStride;
+		for(w = 0; w < foreStride; w++){
+			while(foreRow[w] != 0){
+				if(mergeBoxes){
+					addMergedBox(bandIm,r,(w << 6) + ufmfFirstBit64(foreRow[w]),e,nBoxes,nPx);
 				}
+				else{
+					addBox(bandIm,r,(w << 6) + ufmfFirstBit64(foreRow[w]),e,nBoxes,nPx);
+				}
+			}
+		}
+	}
+	ncc = nBoxes;
+	numPxWritten = nPx;
+	if(!agrees){
+		return;
+	}
+
+	// append the band's own boxes from row r on. their data is copied from the frame again, as
+	// the redone boxes' data can have overwritten it
+	for(q = 0; q < nSaved && (int)seamRowBuffer[q] < r; q++);
+	for(; q < nSaved; q++){
+		writeRowBuffer[ncc] = seamRowBuffer[q];
+		writeColBuffer[ncc] = seamColBuffer[q];
+		writeWidthBuffer[ncc] = seamWidthBuffer[q];
+		writeHeightBuffer[ncc] = seamHeightBuffer[q];
+		for(r1 = seamRowBuffer[q]; r1 < (int)seamRowBuffer[q] + (int)seamHeightBuffer[q]; r1++){
+			memcpy(writeDataBuffer+numPxWritten,bandIm+r1*(int)wWidth+seamColBuffer[q],seamWidthBuffer[q]);
+			numPxWritten += seamWidthBuffer[q];
+		}
+		markBoxWritten(seamRowBuffer[q],seamColBuffer[q],seamWidthBuffer[q],seamHeightBuffer[q],seamRowBuffer[q]);
+		ncc++;
+	}
+
+}
+
+// boxes never overlap, so of the boxes reaching past row r, each has its own columns in row r
+bool CompressedFrame::seamAgrees(int r, unsigned __int32 firstRedone, unsigned __int32 endRedone, unsigned __int32 nSaved){
 
-				ncc++;
+	unsigned __int32 i, j;
+	int nRedone = 0, nOwn = 0;
+
+	for(i = firstRedone; i < endRedone; i++){
+		if((int)writeRowBuffer[i] + (int)writeHeightBuffer[i] <= r) continue;
+		nRedone++;
+		for(j = 0; j < nSaved && (int)seamRowBuffer[j] < r; j++){
+			if(seamColBuffer[j] == writeColBuffer[i] && seamWidthBuffer[j] == writeWidthBuffer[i] &&
+				(int)seamRowBuffer[j] + (int)seamHeightBuffer[j] == (int)writeRowBuffer[i] + (int)writeHeightBuffer[i]){
+				break;
 			}
 		}
-		numPxWritten = j;
-		isCompressed = true;
-		//int nForeMissed = 0;
-		//for(i1 = 0; i1 < nPixels; i1++){
-		//	if(debugWasFore[i1] && nWrites[i1] == 0) nForeMissed++;
-		//}
-		//if(logger && nForeMissed > 0) logger->log(UFMF_DEBUG_3,"nForeMissed = %d\n",nForeMissed);
+		if(j == nSaved || (int)seamRowBuffer[j] >= r) return false;
+	}
+	for(j = 0; j < nSaved && (int)seamRowBuffer[j] < r; j++){
+		if((int)seamRowBuffer[j] + (int)seamHeightBuffer[j] > r) nOwn++;
 	}
 
-	return true;
+	return nRedone == nOwn;
+}
+
+void CompressedFrame::markBoxWritten(int r, int c, int width, int height, int rowStart){
+	for(int r1 = max(r,rowStart); r1 < r + height; r1++){
+		ufmfSetBits(isWritten + r1*foreStride,c,c+width,true);
+		ufmfSetBits(isFore + r1*foreStride,c,c+width,false);
+	}
+}
+
+// store the box with corner at (r,c). boxes are stored in raster order, so a box can only
+// run into pixels written by earlier boxes to its right or below: if the first row runs into one,
+// the box is narrowed to stop there; if a later row does, the box ends above that row
+void CompressedFrame::addBox(unsigned __int8 * im, int r, int c, int rowEnd, unsigned __int32 &nBoxes, int &nPx){
+
+	int r1, c1, i1;
+	int width = min((int)boxLength,(int)wWidth-c);
+	int height = min((int)boxLength,rowEnd-r);
+
+	for(r1 = r; r1 < r + height; r1++){
+
+		// check if we've already written something in this row of the box
+		c1 = ufmfFindBit(isWritten + r1*foreStride,c,c+width);
+		if(c1 < c+width){
+			if(r1 == r){
+				// if this is the first row, then shorten the width and write as usual
+				width = c1 - c;
+			}
+			else{
+				// otherwise, shorten the height, and don't write any of this row
+				height = r1 - r;
+				break;
+			}
+		}
+
+		i1 = r1*(int)wWidth + c;
+		memcpy(writeDataBuffer+nPx,im+i1,width);
+		ufmfSetBits(isWritten + r1*foreStride,c,c+width,true);
+		ufmfSetBits(isFore + r1*foreStride,c,c+width,false);
+		nPx += width;
+	}
+
+	writeRowBuffer[nBoxes] = (unsigned __int16)r;
+	writeColBuffer[nBoxes] = (unsigned __int16)c;
+	writeWidthBuffer[nBoxes] = (unsigned __int16)width;
+	writeHeightBuffer[nBoxes] = (unsigned __int16)height;
+	nBoxes++;
+
+}
+
+// store a rectangle starting at the foreground pixel (r,c). its width is the foreground run
+// starting at c, with gaps of up to MERGEDBOXGAP background pixels bridged. it grows down while the
+// next row has foreground in its columns and none of them have been written. rows after the first
+// can hold foreground outside its columns, which is picked up by later rectangles
+void CompressedFrame::addMergedBox(unsigned __int8 * im, int r, int c, int rowEnd, unsigned __int32 &nBoxes, int &nPx){
+
+	int r1, c1, c2, i1;
+	int width, height;
+	int maxWidth = min(65535,(int)wWidth-c);
+	unsigned __int64 * foreRow = isFore + r*foreStride;
+	unsigned __int64 * writtenRow = isWritten + r*foreStride;
+
+	// width: written pixels are never foreground, so the runs don't contain any
+	c1 = ufmfFindClearBit(foreRow,c,c+maxWidth);
+	while(c1 < c+maxWidth){
+		c2 = ufmfFindBit(foreRow,c1,min(c1+MERGEDBOXGAP+1,c+maxWidth));
+		if(c2 >= min(c1+MERGEDBOXGAP+1,c+maxWidth)) break;
+		if(ufmfFindBit(writtenRow,c1,c2) < c2) break;
+		c1 = ufmfFindClearBit(foreRow,c2,c+maxWidth);
+	}
+	width = c1 - c;
+
+	// height
+	for(height = 1; r + height < rowEnd && height < 65535; height++){
+		r1 = r + height;
+		if(ufmfFindBit(isFore + r1*foreStride,c,c+width) >= c+width) break;
+		if(ufmfFindBit(isWritten + r1*foreStride,c,c+width) < c+width) break;
+	}
+
+	for(r1 = r; r1 < r + height; r1++){
+		i1 = r1*(int)wWidth + c;
+		memcpy(writeDataBuffer+nPx,im+i1,width);
+		ufmfSetBits(isWritten + r1*foreStride,c,c+width,true);
+		ufmfSetBits(isFore + r1*foreStride,c,c+width,false);
+		nPx += width;
+	}
+
+	writeRowBuffer[nBoxes] = (unsigned __int16)r;
+	writeColBuffer[nBoxes] = (unsigned __int16)c;
+	writeWidthBuffer[nBoxes] = (unsigned __int16)width;
+	writeHeightBuffer[nBoxes] = (unsigned __int16)height;
+	nBoxes++;
 
 }
 
@@ -339,8 +772,18 @@ bool CompressedFrame::setData(unsigned __int8 * im, double timestamp, unsigned _
 void ufmfWriter::init(){
 
 	// *** output ufmf state ***
-	pFile = NULL;
+	output = NULL;
 	logger = NULL;
+	index = NULL;
+	meanindex = NULL;
+	mappedOutput = false;
+	strcpy(segmentFileName,"");
+	segmentNumber = 0;
+	nFramesPrevSegments = 0;
+	segmentStartTime = -1;
+	lastCheckpointLocation = 0;
+	nFramesCheckpointed = 0;
+	nKeyFramesCheckpointed = 0;
 	indexLocation = 0;
 	indexPtrLocation = 0;
 
@@ -349,35 +792,75 @@ void ufmfWriter::init(){
 	nGrabbed = 0;
 	nWritten = 0;
 	nBGKeyFramesWritten = 0;
+	nFramesDroppedOverload = 0;
+	nFramesSkipped = 0;
+	writingRaw = 0;
 
 	// *** threading/buffering state ***
 	uncompressedFrames = NULL;
+	slotBuffers = NULL;
+	freeBuffers = NULL;
+	slotFrames = NULL;
+	slotReleaseCallbacks = NULL;
+	slotReleaseContexts = NULL;
 	compressedFrames = NULL;
-	threadTimestamps = NULL;
-	nUncompressedFramesBuffered = 0;
+	slotTimestamps = NULL;
+	compressQueue = NULL;
 	nCompressedFramesBuffered = 0;
-	readyToWrite = NULL;
+	writeBatchData = NULL;
+	writeBatchBytes = NULL;
+	nWriteBatch = 0;
+	writeBatchLength = 0;
 
 	_compressionThreads = NULL;
 	_compressionThreadIDs = NULL;
 	compressionThreadReadySignals = NULL;
-	compressionThreadStartSignals = NULL;
-	compressionThreadDoneSignals = NULL;
+	parkSignals = NULL;
+	nActiveThreads = 0;
+	compressTicksEstimate = 0;
+	frameIntervalEstimate = 0;
+	lastAddedTimestamp = -1;
+	nFramesOverProvisioned = 0;
+	slotFreeSignal = NULL;
+	bufferFreeSignal = NULL;
+	slotQueuedSignal = NULL;
+	slotDoneSignals = NULL;
+	writeThreadStopSignal = NULL;
+	reserveTurnSignals = NULL;
+	slotWaitingToReserve = NULL;
+	nextFrameToReserve = 1;
 	threadCount = 0;
-	threadFrameNumbers = NULL;
+	slotFrameNumbers = NULL;
+	slotDroppedFrames = NULL;
 
 	// *** background subtraction state ***
 	bg = NULL;
-	minFrameBGModel0 = 0;
-	minFrameBGModel1 = 0;
-	BGLowerBound0 = NULL;
-	BGUpperBound0 = NULL;
-	BGCenter0 = NULL;
-	keyframeTimestamp0 = -1;
-	BGLowerBound1 = NULL;
-	BGUpperBound1 = NULL;
-	BGCenter1 = NULL;
-	keyframeTimestamp1 = -1;
+	BGLowerBounds = NULL;
+	BGUpperBounds = NULL;
+	BGCenters = NULL;
+	BGKeyFrameTimestamps = NULL;
+	BGModelNumbers = NULL;
+	BGRefCounts = NULL;
+	BGCurrentGeneration = -1;
+	slotBGGenerations = NULL;
+	slotBGRequests = NULL;
+	nBGModelsPublished = 0;
+	lastBGModelNumberWritten = 0;
+	BGQueueFrames = NULL;
+	BGQueueTimestamps = NULL;
+	BGQueueAddFrame = NULL;
+	BGQueueUpdate = NULL;
+	BGQueueFilledSignals = NULL;
+	BGQueueHead = 0;
+	BGQueueTail = 0;
+	nBGRequestsBuffered = 0;
+	nBGKeyFramesQueued = 0;
+	nBGFramesDropped = 0;
+	_bgThread = NULL;
+	bgThreadReadySignal = NULL;
+	bgThreadStartSignal = NULL;
+	bgThreadStopSignal = NULL;
+	BGGenerationFreeSignal = NULL;
 	lastBGUpdateTime = -1;
 	lastBGKeyFrameTime = -1;
 
@@ -387,6 +870,10 @@ void ufmfWriter::init(){
 
 	// *** threading parameter defaults ***
 	nThreads = 4;
+	minThreads = 0; // every compression thread stays awake
+	nBuffers = 0; // one frame per compression thread
+	nSlots = 0;
+	overloadPolicy = UFMF_OVERLOAD_DROP_NEWEST; // frames that find no free slot are dropped
 
 	// *** video parameter defaults ****
 	strcpy(fileName,"");
@@ -413,9 +900,25 @@ void ufmfWriter::init(){
 	nBGUpdatesPerKeyFrame = (int)floor(BGKeyFramePeriod / BGUpdatePeriod);
 	float NBGUpdatesPerKeyFrame = (float)(BGKeyFramePeriod / BGUpdatePeriod);
 	MaxBGZ = max(0.0,(float)MaxBGNFrames - NBGUpdatesPerKeyFrame);
+	BGIncrementalMedian = false; // rescan the counts at each background update
+	nBGModels = 4; // background models that can be in use at once
 
 	// * ufmf parameters *
 	isFixedSize = 0; // patches are not of a fixed size
+	outputBlockMB = 4; // output is written in 4 MB blocks
+	nOutputBlocks = 4; // blocks that can be queued for writing at once
+	outputUnbuffered = false; // write through the system cache
+	outputBackend = UFMF_OUTPUT_THREADED; // blocks are written by an I/O thread
+	outputPreallocateMB = 0; // don't preallocate the file
+	strcpy(outputTargets,""); // write to the movie's directory
+	stripeSegments = false; // stripe each file across the output targets
+	indexSpillEntries = 65536; // spill the index to a file in 1 MB pieces
+	checkpointFrames = 0; // no index checkpoints
+	segmentFrames = 0; // don't split the movie into segments
+	segmentSeconds = 0;
+	segmentMB = 0;
+	mergeBoxes = false; // store boxes of at most boxLength
+	nBands = 1; // compress each frame on one thread
 	boxLength = 30; // length of foreground boxes to store
 	maxFracFgCompress = .25; // maximum fraction of pixels that can be foreground in order for us to compress
 
@@ -451,6 +954,14 @@ void ufmfWriter::init(const char * fileName, unsigned __int32 pWidth, unsigned _
 
 		// *** threading parameters ***
 		this->nThreads = nThreads;
+		if(this->nBuffers < nThreads){
+			this->nBuffers = nThreads;
+		}
+		// a frame dropped from the queue holds its slot until the write thread skips it
+		nSlots = (overloadPolicy == UFMF_OVERLOAD_DROP_OLDEST) ? 2*nBuffers : nBuffers;
+		if(this->minThreads == 0 || this->minThreads > nThreads){
+			this->minThreads = nThreads;
+		}
 
 		// *** video parameters ***
 		strcpy(this->fileName, fileName);
@@ -495,49 +1006,93 @@ void ufmfWriter::init(const char * fileName, unsigned __int32 pWidth, unsigned _
 		// ***** allocate stuff *****
 
 		// *** threading/buffering state ***
-		uncompressedFrames = new unsigned char*[nThreads];
-		for(i = 0; i < (int)nThreads; i++){
+		uncompressedFrames = new unsigned char*[nBuffers];
+		for(i = 0; i < (int)nBuffers; i++){
 			uncompressedFrames[i] = new unsigned char[nPixels];
 			memset(uncompressedFrames[i],0,nPixels*sizeof(char));
 		}
-		compressedFrames = new CompressedFrame*[nThreads];
-		for(i = 0; i < (int)nThreads; i++){
-			compressedFrames[i] = new CompressedFrame(wWidth,wHeight,boxLength,maxFracFgCompress);
+		freeBuffers = new ufmfQueue(nBuffers);
+		slotBuffers = new int[nSlots];
+		slotFrames = new unsigned char*[nSlots];
+		slotReleaseCallbacks = new ufmfFrameReleaseCallback[nSlots];
+		slotReleaseContexts = new void*[nSlots];
+		for(i = 0; i < (int)nSlots; i++){
+			slotBuffers[i] = 0;
+			slotFrames[i] = NULL;
+			slotReleaseCallbacks[i] = NULL;
+			slotReleaseContexts[i] = NULL;
 		}
-		threadTimestamps = new double[nThreads];
-		memset(threadTimestamps,0,nThreads*sizeof(double));
-		threadFrameNumbers = new unsigned __int64[nThreads];
-		memset(threadFrameNumbers,0,nThreads*sizeof(unsigned __int64));
-
-		readyToWrite = new int[nThreads];
-		memset(readyToWrite,0,nThreads*sizeof(int));
+		compressedFrames = new CompressedFrame*[nBuffers];
+		for(i = 0; i < (int)nBuffers; i++){
+			compressedFrames[i] = new CompressedFrame(wWidth,wHeight,boxLength,maxFracFgCompress,nBands);
+			// stats need the foreground count even for frames that won't be compressed
+			compressedFrames[i]->countAllFore = printStats;
+			compressedFrames[i]->mergeBoxes = mergeBoxes;
+		}
+		slotTimestamps = new double[nSlots];
+		memset(slotTimestamps,0,nSlots*sizeof(double));
+		slotFrameNumbers = new unsigned __int64[nSlots];
+		memset(slotFrameNumbers,0,nSlots*sizeof(unsigned __int64));
+		slotDroppedFrames = new unsigned __int64[nSlots];
+		memset(slotDroppedFrames,0,nSlots*sizeof(unsigned __int64));
+		compressQueue = new ufmfQueue(nSlots);
+		writeBatchData = new const void*[nSlots];
+		writeBatchBytes = new unsigned __int64[nSlots];
+		nWriteBatch = 0;
+		writeBatchLength = 0;
 
 		// allocate compression thread stuff
 		_compressionThreads = new HANDLE[nThreads];
 		_compressionThreadIDs = new DWORD[nThreads];
 		compressionThreadReadySignals = new HANDLE[nThreads];
-		compressionThreadStartSignals = new HANDLE[nThreads];
-		compressionThreadDoneSignals = new HANDLE[nThreads];
+		parkSignals = new HANDLE[nThreads];
+		slotDoneSignals = new HANDLE[nSlots];
+		reserveTurnSignals = new HANDLE[nSlots];
+		slotWaitingToReserve = new bool[nSlots];
+		memset(slotWaitingToReserve,0,nSlots*sizeof(bool));
 
 		//// *** background subtraction state ***
-		bg = new BackgroundModel(nPixels,nBGUpdatesPerKeyFrame);
-		BGLowerBound0 = new unsigned __int8[nPixels]; // per-pixel lower bound on background
-		memset(BGLowerBound0,0,nPixels*sizeof(unsigned __int8));
-		BGUpperBound0 = new unsigned __int8[nPixels]; // per-pixel upper bound on background
-		memset(BGUpperBound0,0,nPixels*sizeof(unsigned __int8));
-		if(printStats){
-			BGCenter0 = new float[nPixels]; 
-			memset(BGCenter0,0,nPixels*sizeof(float));
+		bg = new BackgroundModel(nPixels,nBGUpdatesPerKeyFrame,BGIncrementalMedian);
+		// one model is current while the next one is computed, so we need at least 2
+		if(nBGModels < 2) nBGModels = 2;
+		BGLowerBounds = new unsigned __int8*[nBGModels];
+		BGUpperBounds = new unsigned __int8*[nBGModels];
+		BGCenters = new float*[nBGModels];
+		for(i = 0; i < (int)nBGModels; i++){
+			BGLowerBounds[i] = new unsigned __int8[nPixels]; // per-pixel lower bound on background
+			memset(BGLowerBounds[i],0,nPixels*sizeof(unsigned __int8));
+			BGUpperBounds[i] = new unsigned __int8[nPixels]; // per-pixel upper bound on background
+			memset(BGUpperBounds[i],0,nPixels*sizeof(unsigned __int8));
+			BGCenters[i] = new float[nPixels]; 
+			memset(BGCenters[i],0,nPixels*sizeof(float));
+		}
+		BGKeyFrameTimestamps = new double[nBGModels];
+		memset(BGKeyFrameTimestamps,0,nBGModels*sizeof(double));
+		BGModelNumbers = new unsigned __int64[nBGModels];
+		memset(BGModelNumbers,0,nBGModels*sizeof(unsigned __int64));
+		BGRefCounts = new LONG[nBGModels];
+		memset((void*)BGRefCounts,0,nBGModels*sizeof(LONG));
+		slotBGGenerations = new int[nSlots];
+		slotBGRequests = new int[nSlots];
+		for(i = 0; i < (int)nSlots; i++){
+			slotBGGenerations[i] = -1;
+			slotBGRequests[i] = -1;
 		}
 
-		BGLowerBound1 = new unsigned __int8[nPixels]; // per-pixel lower bound on background
-		memset(BGLowerBound1,0,nPixels*sizeof(unsigned __int8));
-		BGUpperBound1 = new unsigned __int8[nPixels]; // per-pixel upper bound on background
-		memset(BGUpperBound1,0,nPixels*sizeof(unsigned __int8));
-		if(printStats){
-			BGCenter1 = new float[nPixels]; 
-			memset(BGCenter1,0,nPixels*sizeof(float));
+		// requests for the background thread
+		BGQueueFrames = new unsigned __int8*[BGQUEUELENGTH];
+		for(i = 0; i < BGQUEUELENGTH; i++){
+			BGQueueFrames[i] = new unsigned __int8[nPixels];
+			memset(BGQueueFrames[i],0,nPixels*sizeof(unsigned __int8));
 		}
+		BGQueueTimestamps = new double[BGQUEUELENGTH];
+		memset(BGQueueTimestamps,0,BGQUEUELENGTH*sizeof(double));
+		BGQueueAddFrame = new bool[BGQUEUELENGTH];
+		memset(BGQueueAddFrame,0,BGQUEUELENGTH*sizeof(bool));
+		BGQueueUpdate = new bool[BGQUEUELENGTH];
+		memset(BGQueueUpdate,0,BGQUEUELENGTH*sizeof(bool));
+		BGQueueFilledSignals = new HANDLE[BGQUEUELENGTH];
+		memset(BGQueueFilledSignals,0,BGQUEUELENGTH*sizeof(HANDLE));
 
 		// *** logging state ***
 		if(printStats) {
@@ -640,6 +1195,22 @@ ufmfWriter::ufmfWriter(const char * fileName, unsigned __int32 pWidth, unsigned
 	 nWritten = 0;
 	 isWriting = false;
 
+	 if(output != NULL){
+		output->close();
+		delete output;
+		output = NULL;
+	 }
+
+	 // keeps any spilled index around, as the movie has no index
+	 if(index != NULL){
+		delete index;
+		index = NULL;
+	 }
+	 if(meanindex != NULL){
+		delete meanindex;
+		meanindex = NULL;
+	 }
+
 	 if(stats){
 		delete stats;
 		stats = NULL;
@@ -662,22 +1233,47 @@ bool ufmfWriter::startWrite(){
 	nGrabbed = 0;
 	nWritten = 0;
 	nBGKeyFramesWritten = 0;
+	nFramesDroppedOverload = 0;
+	nFramesSkipped = 0;
+	writingRaw = 0;
+	memset(slotDroppedFrames,0,nSlots*sizeof(unsigned __int64));
+	// every compression thread starts awake, until the frame rate and compress time are known
+	nActiveThreads = (LONG)nThreads;
+	compressTicksEstimate = 0;
+	frameIntervalEstimate = 0;
+	lastAddedTimestamp = -1;
+	nFramesOverProvisioned = 0;
 	lastBGUpdateTime = -1;
 	lastBGKeyFrameTime = -1;
+	nBGModelsPublished = 0;
+	lastBGModelNumberWritten = 0;
+	BGCurrentGeneration = -1;
+	memset((void*)BGRefCounts,0,nBGModels*sizeof(LONG));
+	BGQueueHead = 0;
+	BGQueueTail = 0;
+	nBGRequestsBuffered = 0;
+	nBGKeyFramesQueued = 0;
+	nBGFramesDropped = 0;
+	nextFrameToReserve = 1;
 
 	logger->log(UFMF_DEBUG_3,"starting to write\n");
 
-	// open File
-	pFile = fopen(fileName,"wb");
-	if(pFile == NULL){
-		logger->log(UFMF_ERROR,"Error opening file %s for writing\n",fileName);
+	// open the first segment, which is the whole movie if it is not split
+	segmentNumber = 0;
+	nFramesPrevSegments = 0;
+	segmentStartTime = -1;
+	if(!openSegment(fileName)){
 		return false;
 	}
+	mappedOutput = output->isMapped();
 
-	// write header
-	if(!writeHeader()){
-		logger->log(UFMF_ERROR,"Error writing header\n");
-		return false;
+	// with mapped output, compression threads place keyframes and frames while the write thread
+	// would be writing checkpoints or switching files
+	if(checkpointFrames > 0 && mappedOutput){
+		logger->log(UFMF_WARNING,"Index checkpoints are not written with mapped output\n");
+	}
+	if((segmentFrames > 0 || segmentSeconds > 0 || segmentMB > 0) && mappedOutput){
+		logger->log(UFMF_WARNING,"Movies are not split into segments with mapped output\n");
 	}
 
 	// initialize semaphores
@@ -697,28 +1293,66 @@ bool ufmfWriter::startWrite(){
 			return false;
 		}
 
-		// initialize not ready to start compression threads
-		compressionThreadStartSignals[i] = CreateSemaphore(NULL,0,1,NULL);
-		if(compressionThreadStartSignals[i] == NULL){
-			logger->log(UFMF_ERROR,"Error creating compressionThreadStartSignals[%d] semaphore\n",i);
+		// adaptive threads: nothing to wake parked threads for yet
+		parkSignals[i] = CreateSemaphore(NULL,0,1,NULL);
+		if(parkSignals[i] == NULL){
+			logger->log(UFMF_ERROR,"Error creating parkSignals[%d] semaphore\n",i);
 			return false;
 		}
 
+	}
+
+	// slot semaphores. all slots and buffers start free
+	slotFreeSignal = CreateSemaphore(NULL,(LONG)nSlots,(LONG)nSlots,NULL);
+	if(slotFreeSignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating slotFreeSignal semaphore\n");
+		return false;
+	}
+	while(freeBuffers->pop(i));
+	for(i = 0; i < (int)nBuffers; i++){
+		freeBuffers->push(i);
+	}
+	bufferFreeSignal = CreateSemaphore(NULL,(LONG)nBuffers,(LONG)nBuffers,NULL);
+	if(bufferFreeSignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating bufferFreeSignal semaphore\n");
+		return false;
+	}
+	// one extra count per compression thread for the stop signals
+	slotQueuedSignal = CreateSemaphore(NULL,0,(LONG)(nSlots+nThreads),NULL);
+	if(slotQueuedSignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating slotQueuedSignal semaphore\n");
+		return false;
+	}
+	for(i = 0; i < (int)nSlots; i++){
+
 		// initialize value to 0 to signify not finished compressing
-		compressionThreadDoneSignals[i] = CreateSemaphore(NULL,0,1,NULL);
-		if(compressionThreadDoneSignals[i] == NULL){
-			logger->log(UFMF_ERROR,"Error creating compressionThreadDoneSignals[%d] semaphore\n",i);
+		slotDoneSignals[i] = CreateSemaphore(NULL,0,1,NULL);
+		if(slotDoneSignals[i] == NULL){
+			logger->log(UFMF_ERROR,"Error creating slotDoneSignals[%d] semaphore\n",i);
+			return false;
+		}
+
+		// mapped output: not this slot's turn to reserve file space
+		reserveTurnSignals[i] = CreateSemaphore(NULL,0,1,NULL);
+		if(reserveTurnSignals[i] == NULL){
+			logger->log(UFMF_ERROR,"Error creating reserveTurnSignals[%d] semaphore\n",i);
 			return false;
 		}
+		slotWaitingToReserve[i] = false;
 
 	}
 
-	// writing thread semaphore
+	// writing thread semaphores
 	writeThreadReadySignal = CreateSemaphore(NULL,0,1,NULL);
 	if(writeThreadReadySignal == NULL){
 		logger->log(UFMF_ERROR,"Error creating writeThreadReadySignal semaphore\n");
 		return false;
 	}
+	writeThreadStopSignal = CreateSemaphore(NULL,0,1,NULL);
+	if(writeThreadStopSignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating writeThreadStopSignal semaphore\n");
+		return false;
+	}
 
 	// bg semaphore
 	keyFrameWritten = CreateSemaphore(NULL,1,1,NULL);
@@ -727,6 +1361,35 @@ bool ufmfWriter::startWrite(){
 		return false;
 	}
 
+	// background model thread semaphores. one extra count for the stop signal
+	bgThreadReadySignal = CreateSemaphore(NULL,0,1,NULL);
+	if(bgThreadReadySignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating bgThreadReadySignal semaphore\n");
+		return false;
+	}
+	bgThreadStartSignal = CreateSemaphore(NULL,0,BGQUEUELENGTH+1,NULL);
+	if(bgThreadStartSignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating bgThreadStartSignal semaphore\n");
+		return false;
+	}
+	bgThreadStopSignal = CreateSemaphore(NULL,0,1,NULL);
+	if(bgThreadStopSignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating bgThreadStopSignal semaphore\n");
+		return false;
+	}
+	BGGenerationFreeSignal = CreateSemaphore(NULL,0,(LONG)nBGModels,NULL);
+	if(BGGenerationFreeSignal == NULL){
+		logger->log(UFMF_ERROR,"Error creating BGGenerationFreeSignal semaphore\n");
+		return false;
+	}
+	for(i = 0; i < BGQUEUELENGTH; i++){
+		BGQueueFilledSignals[i] = CreateSemaphore(NULL,0,1,NULL);
+		if(BGQueueFilledSignals[i] == NULL){
+			logger->log(UFMF_ERROR,"Error creating BGQueueFilledSignals[%d] semaphore\n",i);
+			return false;
+		}
+	}
+
 	isWriting = true;
 
 	// start compression threads
@@ -740,7 +1403,6 @@ bool ufmfWriter::startWrite(){
 			logger->log(UFMF_ERROR, "Error starting compression thread %d\n",i); 
 			return false; 
 		}
-		ReleaseSemaphore(compressionThreadReadySignals[i],1,NULL);
 	}
 
 	// start write thread
@@ -753,6 +1415,17 @@ bool ufmfWriter::startWrite(){
 		return false; 
 	}
 
+	// start background model thread
+	_bgThread = CreateThread(NULL,0,bgThread,this,0,&_bgThreadID);
+	if ( _bgThread == NULL ){ 
+		logger->log(UFMF_ERROR,"Error creating background model thread\n");
+		return false; 
+	}
+	if(WaitForSingleObject(bgThreadReadySignal, MAXWAITTIMEMS) != WAIT_OBJECT_0) { 
+		logger->log(UFMF_ERROR,"Error Starting Background Model Thread\n"); 
+		return false; 
+	}
+
 	if(stats){
 		stats->updateTimings(UTT_START_WRITING,stats_t0);
 	}
@@ -776,8 +1449,12 @@ unsigned __int64 ufmfWriter::stopWrite(){
 		return 0;
 	}
 
-	// stop all the writing and compressing threads
-	stopThreads(true);
+	// stop all the writing and compressing threads. if we couldn't wait for them, they may still be
+	// using the output, so the movie is left unfinished
+	if(!stopThreads(true)){
+		logger->log(UFMF_ERROR,"Error stopping the writer threads, not finishing the video file\n");
+		return 0;
+	}
 
 	// finish writing the movie -- write the indexes, close the file, etc.
 	if(!finishWriting()){
@@ -793,68 +1470,138 @@ unsigned __int64 ufmfWriter::stopWrite(){
 		stats->flushNow();
 	}
 
-	return nWritten;
+	return NumWritten();
 }
 
 // add a frame to the processing queue
 bool ufmfWriter::addFrame(unsigned char * frame, double timestamp, unsigned __int64 nFramesDroppedExternal, unsigned __int64 nFramesBufferedExternal){
+	return queueFrame(frame,timestamp,NULL,NULL,nFramesDroppedExternal,nFramesBufferedExternal,MAXWAITTIMEMS,false);
+}
 
-	int threadIndex;
+// saves copying the frame into the compression thread's buffer
+bool ufmfWriter::addFrameNoCopy(unsigned char * frame, double timestamp, ufmfFrameReleaseCallback release, void * releaseContext,
+								unsigned __int64 nFramesDroppedExternal, unsigned __int64 nFramesBufferedExternal){
+	if(release == NULL){
+		logger->log(UFMF_ERROR,"No release callback for frame lent to the writer\n");
+		return false;
+	}
+	return queueFrame(frame,timestamp,release,releaseContext,nFramesDroppedExternal,nFramesBufferedExternal,MAXWAITTIMEMS,false);
+}
+
+// add a frame to the processing queue, dropping a frame if there is no room
+bool ufmfWriter::tryAddFrame(unsigned char * frame, double timestamp, DWORD timeoutMS,
+							 unsigned __int64 nFramesDroppedExternal, unsigned __int64 nFramesBufferedExternal){
+	return queueFrame(frame,timestamp,NULL,NULL,nFramesDroppedExternal,nFramesBufferedExternal,timeoutMS,true);
+}
+
+bool ufmfWriter::tryAddFrameNoCopy(unsigned char * frame, double timestamp, ufmfFrameReleaseCallback release, void * releaseContext,
+								   DWORD timeoutMS, unsigned __int64 nFramesDroppedExternal, unsigned __int64 nFramesBufferedExternal){
+	if(release == NULL){
+		logger->log(UFMF_ERROR,"No release callback for frame lent to the writer\n");
+		return false;
+	}
+	return queueFrame(frame,timestamp,release,releaseContext,nFramesDroppedExternal,nFramesBufferedExternal,timeoutMS,true);
+}
+
+bool ufmfWriter::queueFrame(unsigned char * frame, double timestamp, ufmfFrameReleaseCallback release, void * releaseContext,
+							unsigned __int64 nFramesDroppedExternal, unsigned __int64 nFramesBufferedExternal, DWORD timeoutMS, bool canDrop){
+
+	int slot, buffer;
+	LONG g;
 	unsigned __int64 frameNumber;
 	ULARGE_INTEGER stats_t0, stats_t1;
 
 	if(stats){
 		stats_t1 = ufmfWriterStats::getTime();
+		stats_t0 = stats_t1;
+	}
+
+	// wait for a free buffer, or have the overload policy find one
+	buffer = takeFreeBuffer(timeoutMS);
+	if(buffer < 0 && canDrop){
+		buffer = makeRoom();
+	}
+	// and for a free slot. slots are freed in frame order, so it is the one after the last frame's.
+	// one can only be missing while the write thread has yet to skip nBuffers dropped frames
+	if(buffer >= 0 && WaitForSingleObject(slotFreeSignal,timeoutMS) != WAIT_OBJECT_0){
+		freeBuffers->push(buffer);
+		ReleaseSemaphore(bufferFreeSignal,1,NULL);
+		buffer = -1;
+	}
+	if(buffer < 0){
+		if(!canDrop){
+			logger->log(UFMF_ERROR,"Error waiting for a free buffer when adding frame %llu\n",nGrabbed+1);
+			return false;
+		}
+		// no room for this frame. it never gets a frame number, so nothing downstream sees it
+		nFramesDroppedOverload++;
+		logger->log(UFMF_DEBUG_7,"No free buffer, dropping the frame at %f\n",timestamp);
+		if(release != NULL){
+			release(releaseContext,frame);
+		}
+		return true;
 	}
 
 	nGrabbed++;
 	frameNumber = nGrabbed;
+	slot = (int)((frameNumber-1) % nSlots);
+	slotBuffers[slot] = buffer;
 
-	logger->log(UFMF_DEBUG_7,"Adding frame %llu\n",frameNumber);
-
-	// update background counts if necessary
-	if(!addToBGModel(frame,timestamp,frameNumber)){
-		logger->log(UFMF_ERROR,"Error adding frame to background model\n");
-		return false;
+	if(stats){
+		stats_t0 = stats->updateTimings(UTT_WAIT_FOR_COMPRESS_THREAD,stats_t0);
 	}
 
-	// reset background model if necessary, signal to write key frame
-	if(!updateBGModel(frame,timestamp,frameNumber)){
-		logger->log(UFMF_ERROR,"Error computing new background model\n");
-		return false;
-	}
+	logger->log(UFMF_DEBUG_7,"Adding frame %llu\n",frameNumber);
 
-	if(stats){
-		stats_t0 = ufmfWriterStats::getTime();
+	// the compression threads have caught up once half the buffers are free
+	if(writingRaw && frameNumber - nWritten <= nBuffers/2){
+		InterlockedExchange(&writingRaw,0);
+		logger->log(UFMF_DEBUG_3,"Compression caught up at frame %llu\n",frameNumber);
 	}
 
-	// wait for a compression thread to be ready
-	threadIndex = (int)WaitForMultipleObjects((DWORD)nThreads,compressionThreadReadySignals,false,MAXWAITTIMEMS);
-	if(threadIndex < 0 || threadIndex >= (int)nThreads){
-		logger->log(UFMF_ERROR,"Error waiting for a thread to be ready when adding a frame: %x\n",threadIndex+WAIT_OBJECT_0);
+	// queue updating the background counts and computing a new background model if necessary.
+	// the work itself is done in the background thread
+	if(!queueBGModelWork(timestamp,frameNumber,slot)){
+		logger->log(UFMF_ERROR,"Error queueing background model work\n");
 		return false;
 	}
 
-	if(stats){
-		stats_t0 = stats->updateTimings(UTT_WAIT_FOR_COMPRESS_THREAD,stats_t0);
+	// store this frame in this slot
+	slotFrameNumbers[slot] = frameNumber;
+	logger->log(UFMF_DEBUG_7,"Adding frame %llu to slot %d\n",frameNumber,slot);
+	// pin the current background model until this frame is written. if the background thread
+	// publishes a new one meanwhile, the old one may already be being reused, so pin again
+	while(true){
+		g = BGCurrentGeneration;
+		if(g < 0) break;
+		InterlockedIncrement(&BGRefCounts[g]);
+		if(BGCurrentGeneration == g) break;
+		unpinBGGeneration(g);
 	}
-
-	// store this frame for this thread
-	threadFrameNumbers[threadIndex] = frameNumber;
-	logger->log(UFMF_DEBUG_7,"Adding frame %d to thread %d\n",frameNumber,threadIndex);
-	Lock();
-	nUncompressedFramesBuffered++;
+	slotBGGenerations[slot] = g;
 	this->nFramesDroppedExternal = nFramesDroppedExternal;
 	this->nFramesBufferedExternal = nFramesBufferedExternal;
-	Unlock();
 
-	// copy over the data
-	memcpy(uncompressedFrames[threadIndex],frame,nPixels*sizeof(unsigned char));
-	threadTimestamps[threadIndex] = timestamp;
+	// copy over the data, unless the caller lends it to us until it is released
+	if(release == NULL){
+		memcpy(uncompressedFrames[buffer],frame,nPixels*sizeof(unsigned char));
+		slotFrames[slot] = uncompressedFrames[buffer];
+	}
+	else{
+		slotFrames[slot] = frame;
+	}
+	slotReleaseCallbacks[slot] = release;
+	slotReleaseContexts[slot] = releaseContext;
+	slotTimestamps[slot] = timestamp;
+
+	// signal that a compression thread can start on it. the queue has a cell for every slot
+	logger->log(UFMF_DEBUG_7,"Signaling that slot %d, frame %llu, can be compressed\n",slot,frameNumber);
+	compressQueue->push(slot);
+	ReleaseSemaphore(slotQueuedSignal,1,NULL);
 
-	// signal that the compression thread can start
-	logger->log(UFMF_DEBUG_7,"Signaling that thread %d can start compressing frame %llu\n",threadIndex,frameNumber);
-	ReleaseSemaphore(compressionThreadStartSignals[threadIndex],1,NULL);
+	if(minThreads < nThreads){
+		scaleThreads(timestamp);
+	}
 
 	if(stats){
 		stats->updateTimings(UTT_ADD_FRAME,stats_t1);
@@ -863,31 +1610,157 @@ bool ufmfWriter::addFrame(unsigned char * frame, double timestamp, unsigned __in
 	return true;
 }
 
-// set video file name, width, height
-// todo: resize buffers, background model if already allocated
-void ufmfWriter::setVideoParams(char * fileName, int wWidth, int wHeight){
-	strcpy(this->fileName, fileName);
-	this->wWidth = wWidth;
-	this->wHeight = wHeight;
-	this->nPixels = wWidth * wHeight;
+void ufmfWriter::scaleThreads(double timestamp){
 
-}
+	LONG nActive = nActiveThreads;
+	LONG target = (LONG)minThreads;
+	LONG i;
 
-// parameters:
-// [compression parameters:]
-// MaxBGNFrames: approximate number of frames used in background computation
-// BGUpdatePeriod: seconds between updates to the background model
-// BGKeyFramePeriod: seconds between background keyframes
-// boxLength: length of foreground boxes to store
-// backSubThresh: threshold for storing foreground pixels
-// nFramesInit: for the first nFramesInit, we will always update the background model
-// maxFracFgCompress: maximum fraction of pixels that can be foreground in order for us to try to compress the frame
-bool ufmfWriter::readParamsFile(const char * paramsFile){
+	if(lastAddedTimestamp >= 0 && timestamp > lastAddedTimestamp){
+		if(frameIntervalEstimate <= 0){
+			frameIntervalEstimate = timestamp - lastAddedTimestamp;
+		}
+		else{
+			frameIntervalEstimate += (timestamp - lastAddedTimestamp - frameIntervalEstimate) / 8;
+		}
+	}
+	lastAddedTimestamp = timestamp;
 
-	FILE * fp = fopen(paramsFile,"r");
-	bool failure = false;
-	const size_t maxsz = 1000;
-	char line[maxsz];
+	// threads needed to keep up: time to compress a frame over time between frames. the compress
+	// time grows with the foreground, so a busier scene wakes threads before frames back up
+	if(frameIntervalEstimate > 0 && compressTicksEstimate > 0){
+		target = max(target,(LONG)ceil(THREADHEADROOM * (double)compressTicksEstimate / 10000000.0 / frameIntervalEstimate));
+	}
+	// a frame was already waiting when this one was queued, so every awake thread is busy
+	if(compressQueue->size() > 1){
+		target = max(target,nActive+1);
+	}
+	target = min(target,(LONG)nThreads);
+
+	if(target > nActive){
+		// wake threads straight away. a thread that hasn't parked yet just finds its signal set
+		InterlockedExchange(&nActiveThreads,target);
+		for(i = nActive; i < target; i++){
+			ReleaseSemaphore(parkSignals[i],1,NULL);
+		}
+		nFramesOverProvisioned = 0;
+		logger->log(UFMF_DEBUG_5,"%d compression threads awake at frame %llu\n",(int)target,nGrabbed);
+	}
+	else if(target < nActive){
+		// park one at a time, once fewer have been enough for a while. the thread parks when it
+		// next looks for a frame
+		if(++nFramesOverProvisioned >= THREADPARKFRAMES){
+			InterlockedExchange(&nActiveThreads,nActive-1);
+			nFramesOverProvisioned = 0;
+			logger->log(UFMF_DEBUG_5,"%d compression threads awake at frame %llu\n",(int)(nActive-1),nGrabbed);
+		}
+	}
+	else{
+		nFramesOverProvisioned = 0;
+	}
+}
+
+int ufmfWriter::makeRoom(){
+
+	switch(overloadPolicy){
+
+	case UFMF_OVERLOAD_DROP_OLDEST:
+		// the frame being added takes over the dropped frame's buffer
+		return dropOldestQueuedFrame();
+
+	case UFMF_OVERLOAD_WRITE_RAW:
+		// frames a compression thread hasn't started on yet are stored as they are, which frees
+		// buffers quickly. the caller has already waited as long as it allows, so the frame being
+		// added only gets a buffer if one has come free since, and is dropped otherwise
+		if(InterlockedExchange(&writingRaw,1) == 0){
+			logger->log(UFMF_DEBUG_3,"Compression falling behind at frame %llu, storing frames without background subtraction\n",nGrabbed+1);
+		}
+		return takeFreeBuffer(0);
+
+	default:
+		return -1;
+	}
+}
+
+int ufmfWriter::takeFreeBuffer(DWORD timeoutMS){
+
+	int buffer;
+
+	if(WaitForSingleObject(bufferFreeSignal,timeoutMS) != WAIT_OBJECT_0){
+		return -1;
+	}
+	// every count on bufferFreeSignal has a buffer in the queue behind it
+	if(!freeBuffers->pop(buffer)){
+		logger->log(UFMF_ERROR,"Got a free buffer but the queue of free buffers is empty\n");
+		ReleaseSemaphore(bufferFreeSignal,1,NULL);
+		return -1;
+	}
+	return buffer;
+}
+
+int ufmfWriter::dropOldestQueuedFrame(){
+
+	int slot;
+	unsigned __int64 frameNumber;
+
+	// take it from the queue the way a compression thread would. every count on slotQueuedSignal
+	// has a frame in the queue behind it
+	if(WaitForSingleObject(slotQueuedSignal,0) != WAIT_OBJECT_0){
+		return -1;
+	}
+	if(!compressQueue->pop(slot)){
+		logger->log(UFMF_ERROR,"Got a queued frame to drop but the queue is empty\n");
+		ReleaseSemaphore(slotQueuedSignal,1,NULL);
+		return -1;
+	}
+	frameNumber = slotFrameNumbers[slot];
+	logger->log(UFMF_DEBUG_7,"Dropping queued frame %llu in slot %d\n",frameNumber,slot);
+
+	// the write thread skips it without freeing its buffer, and with mapped output it gives up
+	// its turn to reserve space
+	slotDroppedFrames[slot] = frameNumber;
+	nFramesDroppedOverload++;
+	copyFrameToBGQueue(slot);
+	releaseFrame(slot);
+	if(mappedOutput){
+		Lock();
+		if(nextFrameToReserve == frameNumber){
+			passReserveTurn();
+		}
+		Unlock();
+	}
+
+	InterlockedIncrement(&nCompressedFramesBuffered);
+	ReleaseSemaphore(slotDoneSignals[slot],1,NULL);
+
+	return slotBuffers[slot];
+}
+
+// set video file name, width, height
+// todo: resize buffers, background model if already allocated
+void ufmfWriter::setVideoParams(char * fileName, int wWidth, int wHeight){
+	strcpy(this->fileName, fileName);
+	this->wWidth = wWidth;
+	this->wHeight = wHeight;
+	this->nPixels = wWidth * wHeight;
+
+}
+
+// parameters:
+// [compression parameters:]
+// MaxBGNFrames: approximate number of frames used in background computation
+// BGUpdatePeriod: seconds between updates to the background model
+// BGKeyFramePeriod: seconds between background keyframes
+// boxLength: length of foreground boxes to store
+// backSubThresh: threshold for storing foreground pixels
+// nFramesInit: for the first nFramesInit, we will always update the background model
+// maxFracFgCompress: maximum fraction of pixels that can be foreground in order for us to try to compress the frame
+bool ufmfWriter::readParamsFile(const char * paramsFile){
+
+	FILE * fp = fopen(paramsFile,"r");
+	bool failure = false;
+	const size_t maxsz = 1000;
+	char line[maxsz];
 	char * paramName;
 	char * paramValueStr;
 	double paramValue;
@@ -934,10 +1807,22 @@ bool ufmfWriter::readParamsFile(const char * paramsFile){
 		if(logger)
 			logger->log(UFMF_DEBUG_3,"paramName = %s, paramValue = %lf\n",paramName,paramValue);
 
-		// maximum fraction of pixels that can be foreground to try compressing frame
+		// number of frames that can be waiting to be compressed or written. 
+		// raised to the number of compression threads if smaller
 		if(strcmp(paramName,"UFMFNBuffers") == 0){
-			//this->nBuffers = (unsigned __int32)paramValue;
+			this->nBuffers = (unsigned __int32)paramValue;
+		}
+		// what tryAddFrame drops when every buffer is in use: 0 = the frame being added,
+		// 1 = the oldest frame not yet being compressed, 2 = store frames uncompressed to catch up
+		else if(strcmp(paramName,"UFMFOverloadPolicy") == 0){
+			this->overloadPolicy = (ufmfOverloadPolicy)(int)paramValue;
+		}
+		// number of compression threads that are always awake. the rest of UFMFNThreads are
+		// parked while the frame rate and compress time don't need them. 0 keeps all of them awake
+		else if(strcmp(paramName,"UFMFMinThreads") == 0){
+			this->minThreads = (unsigned __int32)paramValue;
 		}
+		// maximum fraction of pixels that can be foreground to try compressing frame
 		else if(strcmp(paramName,"UFMFMaxFracFgCompress") == 0){
 			this->maxFracFgCompress = paramValue;
 		}
@@ -957,6 +1842,63 @@ bool ufmfWriter::readParamsFile(const char * paramsFile){
 		else if(strcmp(paramName,"UFMFMaxBoxLength") == 0){
 			this->boxLength = (int)paramValue;
 		}
+		// whether to merge adjacent foreground into rectangles of any size instead of boxes of at most UFMFMaxBoxLength
+		else if(strcmp(paramName,"UFMFMergeBoxes") == 0){
+			this->mergeBoxes = paramValue != 0;
+		}
+		// size of the blocks output is written in, in MB
+		else if(strcmp(paramName,"UFMFOutputBlockMB") == 0){
+			this->outputBlockMB = (unsigned __int32)paramValue;
+		}
+		// number of output blocks: how many can be waiting on the disk before the write thread waits
+		else if(strcmp(paramName,"UFMFOutputNBlocks") == 0){
+			this->nOutputBlocks = (int)paramValue;
+		}
+		// whether to write output blocks unbuffered, bypassing the system cache
+		else if(strcmp(paramName,"UFMFOutputUnbuffered") == 0){
+			this->outputUnbuffered = paramValue != 0;
+		}
+		// how output is written: 0 = stdio, 1 = I/O thread, 2 = overlapped writes, 3 = mapped file
+		else if(strcmp(paramName,"UFMFOutputBackend") == 0){
+			this->outputBackend = (ufmfOutputBackend)(int)paramValue;
+		}
+		// space to reserve for the file when it is created, in MB
+		else if(strcmp(paramName,"UFMFOutputPreallocateMB") == 0){
+			this->outputPreallocateMB = (unsigned __int32)paramValue;
+		}
+		// directories to stripe output across, separated by commas, ideally each on its own disk
+		else if(strcmp(paramName,"UFMFOutputTargets") == 0){
+			strncpy(this->outputTargets,paramValueStr,sizeof(this->outputTargets)-1);
+			this->outputTargets[sizeof(this->outputTargets)-1] = '\0';
+		}
+		// whether to put whole segments on the output targets in turn instead of striping each
+		// file across all of them block by block
+		else if(strcmp(paramName,"UFMFOutputStripeSegments") == 0){
+			this->stripeSegments = paramValue != 0;
+		}
+		// number of index entries kept in memory. once there are twice as many, the older half is
+		// spilled to a file next to the movie. 0 keeps the whole index in memory
+		else if(strcmp(paramName,"UFMFIndexSpillEntries") == 0){
+			this->indexSpillEntries = (unsigned __int32)paramValue;
+		}
+		// write a checkpoint of the index every this many frames, so that a movie whose writer
+		// crashed can be recovered with ufmfRecover. 0 for no checkpoints
+		else if(strcmp(paramName,"UFMFCheckpointFrames") == 0){
+			this->checkpointFrames = (unsigned __int32)paramValue;
+		}
+		// split the movie into self-contained files of at most this many frames, 0 for no limit.
+		// the first file has the movie's name, the following ones have _0001, _0002, ... added
+		else if(strcmp(paramName,"UFMFSegmentFrames") == 0){
+			this->segmentFrames = (unsigned __int32)paramValue;
+		}
+		// split the movie into files of at most this many seconds, 0 for no limit
+		else if(strcmp(paramName,"UFMFSegmentSeconds") == 0){
+			this->segmentSeconds = paramValue;
+		}
+		// split the movie into files of about this many MB, 0 for no limit
+		else if(strcmp(paramName,"UFMFSegmentMB") == 0){
+			this->segmentMB = (unsigned __int32)paramValue;
+		}
 		// threshold for background subtraction
 		else if(strcmp(paramName,"UFMFBackSubThresh") == 0){
 			this->backSubThresh = (float)paramValue;
@@ -965,6 +1907,16 @@ bool ufmfWriter::readParamsFile(const char * paramsFile){
 		else if(strcmp(paramName,"UFMFNFramesInit") == 0){
 			this->nFramesInit = (int)paramValue;
 		}
+		// number of background models that can be in use at once. more lets new models be
+		// published while the writer is further behind
+		else if(strcmp(paramName,"UFMFNBGModels") == 0){
+			this->nBGModels = (unsigned __int32)paramValue;
+		}
+		// track the per-pixel median incrementally instead of rescanning the counts at each update.
+		// the model is the same either way, which ufmfBGCheck checks
+		else if(strcmp(paramName,"UFMFBGIncrementalMedian") == 0){
+			this->BGIncrementalMedian = paramValue != 0;
+		}
 		else if(strcmp(paramName,"UFMFBGKeyFramePeriodInit") == 0){
 			s = paramValueStr;
 			if(logger) logger->log(UFMF_DEBUG_7,"UFMFBGKeyFramePeriodInit: ");
@@ -999,6 +1951,11 @@ bool ufmfWriter::readParamsFile(const char * paramsFile){
 		else if(strcmp(paramName,"UFMFNThreads") == 0){
 			this->nThreads = (unsigned __int32)paramValue;
 		}
+		// number of horizontal bands each frame is split into and compressed in parallel.
+		// frames are stored exactly as with one band
+		else if(strcmp(paramName,"UFMFNBands") == 0){
+			this->nBands = (int)paramValue;
+		}
 		else{
 			if(logger) logger->log(UFMF_WARNING,"Unknown parameter %s with value %f skipped\n",paramName,paramValue);
 			else fprintf(stderr,"Unknown parameter %s with value %f skipped\n",paramName,paramValue);
@@ -1023,64 +1980,149 @@ void ufmfWriter::setStatsParams(const char * statsName){
 
 // *** writing tools ***
 
-// write a frame
+// add a frame to the write batch
 __int64 ufmfWriter::writeFrame(CompressedFrame * im){
 
+	logger->log(UFMF_DEBUG_7,"writing compressed frame %d\n",im->frameNumber);
+
+	// with mapped output the compression thread already copied the chunk into the file
+	if(mappedOutput){
+		index->push_back((__int64)im->fileOffset,im->timestamp);
+		return (__int64)im->chunkLength;
+	}
+
+	// add the location it will be written to to the index
+	index->push_back((__int64)(output->tell() + writeBatchLength),im->timestamp);
+
+	// the whole chunk was serialized by the compression thread. it stays in its slot until flushed
+	writeBatchData[nWriteBatch] = im->chunkBuffer;
+	writeBatchBytes[nWriteBatch] = im->chunkLength;
+	nWriteBatch++;
+	writeBatchLength += im->chunkLength;
+
+	return (__int64)im->chunkLength;
+}
+
+// write the frames in the write batch
+bool ufmfWriter::flushFrames(){
+
 	ULARGE_INTEGER stats_t0;
+	bool res;
+
+	if(nWriteBatch == 0){
+		return true;
+	}
+
 	if(stats){
 		stats_t0 = ufmfWriterStats::getTime();
 	}
 
-	int i;
-	_int64 filePosStart;
-	_int64 filePosEnd;
-	_int64 frameSizeBytes;
-	//bool isCompressed;
+	res = output->write(writeBatchData,writeBatchBytes,nWriteBatch);
+	if(!res){
+		logger->log(UFMF_ERROR,"Error writing %llu bytes for %d frames\n",writeBatchLength,nWriteBatch);
+	}
+	nWriteBatch = 0;
+	writeBatchLength = 0;
 
-	logger->log(UFMF_DEBUG_7,"writing compressed frame %d\n",im->frameNumber);
+	if(stats){
+		stats->updateTimings(UTT_WRITE_FRAME,stats_t0);
+	}
+
+	return res;
+}
 
-	// location of this frame
-	filePosStart = _ftelli64(pFile);
-
-	// add current location to index
-	index.push_back(filePosStart);
-	index_timestamp.push_back(im->timestamp);
-
-	// write chunk type: 1
-	fwrite(&FRAMECHUNK,1,1,pFile);
-	// write timestamp: 8
-	fwrite(&im->timestamp,8,1,pFile);
-	// number of connected components
-	fwrite(&im->ncc,4,1,pFile);
-
-	// write each box
-	i = 0;
-	int area = 0;
-	for(unsigned int cc = 0; cc < im->ncc; cc++){
-		area = im->writeWidthBuffer[cc]*im->writeHeightBuffer[cc];
-		fwrite(&im->writeColBuffer[cc],2,1,pFile);
-		fwrite(&im->writeRowBuffer[cc],2,1,pFile);
-		fwrite(&im->writeWidthBuffer[cc],2,1,pFile);
-		fwrite(&im->writeHeightBuffer[cc],2,1,pFile);
-		fwrite(&im->writeDataBuffer[i],1,area,pFile);
+// lay out the FRAMECHUNK for im in im->chunkBuffer:
+// chunk type (1), timestamp (8), number of boxes (4), then for each box
+// x (2), y (2), width (2), height (2) and its pixels
+bool ufmfWriter::serializeFrame(CompressedFrame * im){
+
+	unsigned __int8 * p;
+	unsigned __int32 cc;
+	int i = 0;
+	int area;
+	unsigned __int64 chunkLength = 1 + 8 + 4 + 8*(unsigned __int64)im->ncc + (unsigned __int64)im->numPxWritten;
+
+	// grow the buffer if this frame has more boxes than any before it
+	if(chunkLength > im->chunkBufferSize){
+		delete [] im->chunkBuffer;
+		im->chunkBuffer = new unsigned __int8[chunkLength];
+		if(im->chunkBuffer == NULL){
+			im->chunkBufferSize = 0;
+			im->chunkLength = 0;
+			return false;
+		}
+		im->chunkBufferSize = chunkLength;
+	}
+
+	p = im->chunkBuffer;
+	*p = FRAMECHUNK; p += 1;
+	memcpy(p,&im->timestamp,8); p += 8;
+	memcpy(p,&im->ncc,4); p += 4;
+	for(cc = 0; cc < im->ncc; cc++){
+		area = (int)im->writeWidthBuffer[cc]*(int)im->writeHeightBuffer[cc];
+		memcpy(p,&im->writeColBuffer[cc],2); p += 2;
+		memcpy(p,&im->writeRowBuffer[cc],2); p += 2;
+		memcpy(p,&im->writeWidthBuffer[cc],2); p += 2;
+		memcpy(p,&im->writeHeightBuffer[cc],2); p += 2;
+		memcpy(p,&im->writeDataBuffer[i],area); p += area;
 		i += area;
 	}
+	im->chunkLength = chunkLength;
 
-	filePosEnd = _ftelli64(pFile);
-	frameSizeBytes = filePosEnd - filePosStart;
+	return true;
+}
 
-	//if(logger) logger->log(UFMF_DEBUG_5, "timestamp = %f\n",timestamp);
+// mapped output: take turns in frame order to lay out the file, so that frames and keyframes
+// are in the same order as with the other backends. only the reservation is serialized: the
+// copy into the mapped file overlaps with other threads' copies
+bool ufmfWriter::copyFrameToMappedOutput(int slot){
 
-	//if(stats) {
-	//	stats->updateTimings(UTT_COMPUTE_STATS);
-	//	stats->update(index, index_timestamp, frameSizeBytes, isCompressed, im->numFore, im->numPxWritten, im->ncc, nUncompressedFramesBuffered, 0, im->nWrites, nPixels, uncompressedFrame, BGCenter, UFMF_DEBUG_3);
-	//}
+	CompressedFrame * im = compressedFrames[slotBuffers[slot]];
+	int BGGeneration = slotBGGenerations[slot];
 
-	if(stats){
-		stats->updateTimings(UTT_WRITE_FRAME,stats_t0);
+	// wait for the previous frame to reserve its space
+	Lock();
+	if(nextFrameToReserve != im->frameNumber){
+		slotWaitingToReserve[slot] = true;
+		Unlock();
+		WaitForSingleObject(reserveTurnSignals[slot],INFINITE);
+	}
+	else{
+		Unlock();
+	}
+
+	// the keyframe goes before the first frame that uses it
+	if(BGGeneration >= 0 && BGModelNumbers[BGGeneration] != lastBGModelNumberWritten){
+		writeBGKeyFrame(BGCenters[BGGeneration],BGKeyFrameTimestamps[BGGeneration]);
+		lastBGModelNumberWritten = BGModelNumbers[BGGeneration];
+		logger->log(UFMF_DEBUG_3,"Wrote key frame %llu for frame %llu\n",lastBGModelNumberWritten,im->frameNumber);
 	}
 
-	return frameSizeBytes;
+	im->fileOffset = output->reserve(im->chunkLength);
+
+	// pass the turn on to the next frame
+	Lock();
+	passReserveTurn();
+	Unlock();
+
+	return output->writeReserved(im->fileOffset,im->chunkBuffer,im->chunkLength);
+
+}
+
+void ufmfWriter::passReserveTurn(){
+
+	int nextSlot;
+
+	do{
+		nextFrameToReserve++;
+		nextSlot = (int)((nextFrameToReserve-1) % nSlots);
+	} while(slotDroppedFrames[nextSlot] == nextFrameToReserve);
+
+	// wake its thread if it is already waiting
+	if(slotWaitingToReserve[nextSlot] && slotFrameNumbers[nextSlot] == nextFrameToReserve){
+		slotWaitingToReserve[nextSlot] = false;
+		ReleaseSemaphore(reserveTurnSignals[nextSlot],1,NULL);
+	}
 }
 
 // write the video header
@@ -1102,31 +2144,31 @@ bool ufmfWriter::writeHeader(){
 
 	// write "ufmf"
 	const char ufmfString[] = "ufmf";
-	fwrite(ufmfString,1,4,pFile); 
+	output->write(ufmfString,4); 
 	// write version
-	fwrite(&ufmfVersion,4,1,pFile);
+	output->write(&ufmfVersion,4);
 	// this is where we write the index location
-	indexPtrLocation = ftell(pFile);
+	indexPtrLocation = output->tell();
 	// write index location. 0 for now
-	fwrite(&indexLocation,8,1,pFile);
+	output->write(&indexLocation,8);
 
 	// max width, height: 2, 2
 	if(isFixedSize){
-		fwrite(&boxLength,2,1,pFile);
-		fwrite(&boxLength,2,1,pFile);
+		output->write(&boxLength,2);
+		output->write(&boxLength,2);
 	}
 	else{
-		fwrite(&wWidth,2,1,pFile);
-		fwrite(&wHeight,2,1,pFile);
+		output->write(&wWidth,2);
+		output->write(&wHeight,2);
 	}
 
 	// whether it is fixed size patches: 1
-	fwrite(&isFixedSize,1,1,pFile);
+	output->write(&isFixedSize,1);
 
 	// raw coding string length: 1
-	fwrite(&colorCodingLength,1,1,pFile);
+	output->write(&colorCodingLength,1);
 	// coding: length(coding)
-	fwrite(colorCoding,1,colorCodingLength,pFile);
+	output->write(colorCoding,colorCodingLength);
 
 	if(stats){
 		stats->updateTimings(UTT_WRITE_HEADER,stats_t0);
@@ -1136,6 +2178,141 @@ bool ufmfWriter::writeHeader(){
 
 }
 
+// open a file for the movie or a segment of it, and write its header
+bool ufmfWriter::openSegment(const char * segmentFileName){
+
+	char targetDirs[UFMFOUTPUTMAXTARGETS][1000];
+	char manifestName[1024];
+	char spillFileName[1000];
+	char keySpillFileName[1000];
+	FILE * manifest;
+	int len, keyLen;
+	int nTargets = ufmfOutput::parseTargets(outputTargets,targetDirs);
+
+	// whole segments on the targets in turn: segment k goes in directory k % nTargets, and
+	// fileName.segments lists where each segment went
+	if(stripeSegments && nTargets > 0){
+		if(!ufmfOutput::targetFileName(segmentFileName,targetDirs[segmentNumber % nTargets],segmentNumber,1,this->segmentFileName,sizeof(this->segmentFileName))){
+			logger->log(UFMF_ERROR,"Name of segment %d of %s in %s is too long\n",segmentNumber,fileName,targetDirs[segmentNumber % nTargets]);
+			return false;
+		}
+		len = snprintf(manifestName,sizeof(manifestName),"%s.segments",fileName);
+		manifest = (len < 0 || len >= (int)sizeof(manifestName)) ? NULL : fopen(manifestName,segmentNumber == 0 ? "w" : "a");
+		if(manifest == NULL || fprintf(manifest,"segment%d = %s\n",segmentNumber,this->segmentFileName) < 0){
+			logger->log(UFMF_WARNING,"Could not add %s to segment manifest %s\n",this->segmentFileName,manifestName);
+		}
+		if(manifest != NULL){
+			fclose(manifest);
+		}
+	}
+	else if(strlen(segmentFileName) < sizeof(this->segmentFileName)){
+		strcpy(this->segmentFileName,segmentFileName);
+	}
+	else{
+		logger->log(UFMF_ERROR,"File name %s is too long\n",segmentFileName);
+		return false;
+	}
+
+	// the index spill files are named after the segment, check that they fit before opening it
+	len = snprintf(spillFileName,sizeof(spillFileName),"%s.index",this->segmentFileName);
+	keyLen = snprintf(keySpillFileName,sizeof(keySpillFileName),"%s.keyindex",this->segmentFileName);
+	if(len < 0 || len >= (int)sizeof(spillFileName) || keyLen < 0 || keyLen >= (int)sizeof(keySpillFileName)){
+		logger->log(UFMF_ERROR,"Name of the index files of %s is too long\n",this->segmentFileName);
+		return false;
+	}
+
+	// open File. it is written in large blocks by its own thread
+	output = new ufmfOutput(logger,stats,outputBlockMB << 20,nOutputBlocks,outputUnbuffered,outputBackend,(unsigned __int64)outputPreallocateMB << 20);
+	if(!stripeSegments && nTargets > 0){
+		output->setTargets(outputTargets);
+	}
+	if(!output->open(this->segmentFileName)){
+		logger->log(UFMF_ERROR,"Error opening file %s for writing\n",this->segmentFileName);
+		delete output;
+		output = NULL;
+		return false;
+	}
+
+	// frame and keyframe indexes. old entries are spilled next to the movie
+	index = new ufmfIndex(logger,spillFileName,indexSpillEntries);
+	meanindex = new ufmfIndex(logger,keySpillFileName,indexSpillEntries);
+	lastCheckpointLocation = 0;
+	nFramesCheckpointed = 0;
+	nKeyFramesCheckpointed = 0;
+
+	// write header
+	if(!writeHeader()){
+		logger->log(UFMF_ERROR,"Error writing header\n");
+		return false;
+	}
+
+	return true;
+
+}
+
+// whether the current segment is full, so that im should go in a new one
+bool ufmfWriter::segmentIsFull(CompressedFrame * im){
+
+	if(mappedOutput || index->size() == 0){
+		return false;
+	}
+	if(segmentFrames > 0 && index->size() >= segmentFrames){
+		return true;
+	}
+	if(segmentSeconds > 0 && im->timestamp - segmentStartTime >= segmentSeconds){
+		return true;
+	}
+	if(segmentMB > 0 && output->tell() >= ((unsigned __int64)segmentMB << 20)){
+		return true;
+	}
+	return false;
+
+}
+
+// finish the current segment and open the next one. called by the write thread between frames:
+// compression threads don't use the output, so they keep going while the old file is closed
+bool ufmfWriter::startNextSegment(){
+
+	char nextFileName[1000];
+	const char * ext;
+	const char * sep;
+	size_t stemLength;
+	int len;
+
+	nFramesPrevSegments += index->size();
+	if(!finishWriting()){
+		logger->log(UFMF_ERROR,"Error finishing segment %d, %s\n",segmentNumber,segmentFileName);
+		return false;
+	}
+
+	// insert the segment number before the extension
+	segmentNumber++;
+	ext = strrchr(fileName,'.');
+	sep = max(strrchr(fileName,'\\'),strrchr(fileName,'/'));
+	stemLength = (ext != NULL && ext > sep) ? (size_t)(ext - fileName) : strlen(fileName);
+	if(stemLength > sizeof(nextFileName) - 16){
+		stemLength = sizeof(nextFileName) - 16;
+	}
+	memcpy(nextFileName,fileName,stemLength);
+	len = snprintf(nextFileName+stemLength,sizeof(nextFileName)-stemLength,"_%04d%s",segmentNumber,(ext != NULL && ext > sep) ? ext : "");
+	if(len < 0 || (size_t)len >= sizeof(nextFileName)-stemLength){
+		logger->log(UFMF_ERROR,"Name of segment %d of %s is too long\n",segmentNumber,fileName);
+		return false;
+	}
+
+	if(!openSegment(nextFileName)){
+		return false;
+	}
+
+	// the new segment starts with the background model of its first frame
+	lastBGModelNumberWritten = 0;
+
+	logger->log(UFMF_DEBUG_3,"Started segment %d, %s, after %llu frames\n",segmentNumber,nextFileName,nFramesPrevSegments);
+
+	return true;
+
+}
+
 // write the indexes, pointers, close the movie
 bool ufmfWriter::finishWriting(){
 
@@ -1144,26 +2321,29 @@ bool ufmfWriter::finishWriting(){
 		stats_t0 = ufmfWriterStats::getTime();
 	}
 
-	logger->log(UFMF_DEBUG_3, "writing video footer and closing %s\n", fileName);
+	if(output == NULL){
+		return false;
+	}
 
-	// write the index at the end of the file
-	_fseeki64(pFile,0,SEEK_END);
+	logger->log(UFMF_DEBUG_3, "writing video footer and closing %s\n", segmentFileName);
 
-	// write index chunk identifier
-	fwrite(&INDEX_DICT_CHUNK,1,1,pFile);
+	// write the index at the end of the file
+	// write index chunk identifier. through a copy, so that the constant needs no definition
+	unsigned __int8 chunkType = INDEX_DICT_CHUNK;
+	output->write(&chunkType,1);
 
 	// save location of index
-	indexLocation = _ftelli64(pFile);
+	indexLocation = output->tell();
 
 	// write index dictionary
 
 	// write a 'd' for dict
 	char d = 'd';
-	fwrite(&d,1,1,pFile);
+	output->write(&d,1);
 
 	// write the number of keys
 	unsigned __int8 nkeys = 2;
-	fwrite(&nkeys,1,1,pFile);
+	output->write(&nkeys,1);
 
 		// write index->frame
 
@@ -1171,44 +2351,40 @@ bool ufmfWriter::finishWriting(){
 		unsigned __int16 frameStringLength = sizeof(frameString) - 1;
 
 		// write the length of the key
-		fwrite(&frameStringLength,2,1,pFile);
+		output->write(&frameStringLength,2);
 		// write the key
-		fwrite(frameString,1,frameStringLength,pFile);
+		output->write(frameString,frameStringLength);
 
 		// write a 'd' for dict
-		fwrite(&d,1,1,pFile);
+		output->write(&d,1);
 
 		// write the number of keys
 		nkeys = 2;
-		fwrite(&nkeys,1,1,pFile);
+		output->write(&nkeys,1);
 
 			// write index->frame->loc
 			const char locString[] = "loc";
 			unsigned __int16 locStringLength = sizeof(locString) - 1;
 
 			// write the length of the key
-			fwrite(&locStringLength,2,1,pFile);
+			output->write(&locStringLength,2);
 			// write the key
-			fwrite(locString,1,locStringLength,pFile);
+			output->write(locString,locStringLength);
 
 			// write a for array
 			char a = 'a';
-			fwrite(&a,1,1,pFile);
+			output->write(&a,1);
 
 			// write the data type
 			char datatype = 'q';
-			fwrite(&datatype,1,1,pFile);
+			output->write(&datatype,1);
 
 			// write the number of bytes
-			unsigned __int32 nbytes = 8*index.size();
-			fwrite(&nbytes,4,1,pFile);
+			unsigned __int32 nbytes = (unsigned __int32)(8*index->size());
+			output->write(&nbytes,4);
 
 			// write the array
-			unsigned __int64 loc;
-			for (unsigned int i = 0 ; i < index.size(); i++ ){
-				loc = index[i];
-				fwrite(&loc,8,1,pFile);
-			}
+			index->writeLocs(output);
 
 			// end of index->frame->loc
 
@@ -1217,27 +2393,23 @@ bool ufmfWriter::finishWriting(){
 			unsigned __int16 timestampStringLength = sizeof(timestampString) - 1;
 
 			// write the length of the key
-			fwrite(&timestampStringLength,2,1,pFile);
+			output->write(&timestampStringLength,2);
 			// write the key
-			fwrite(timestampString,1,timestampStringLength,pFile);
+			output->write(timestampString,timestampStringLength);
 
 			// write a for array
-			fwrite(&a,1,1,pFile);
+			output->write(&a,1);
 
 			// write the data type
 			datatype = 'd';
-			fwrite(&datatype,1,1,pFile);
+			output->write(&datatype,1);
 
 			// write the number of bytes
-			nbytes = 8*index.size();
-			fwrite(&nbytes,4,1,pFile);
+			nbytes = (unsigned __int32)(8*index->size());
+			output->write(&nbytes,4);
 
 			// write the array
-			double timestamp;
-			for (unsigned int i = 0 ; i < index.size(); i++ ){
-				timestamp = index_timestamp[i];
-				fwrite(&timestamp,8,1,pFile);
-			}
+			index->writeTimestamps(output);
 
 			// end index->frame->timestamp
 
@@ -1248,82 +2420,76 @@ bool ufmfWriter::finishWriting(){
 		unsigned __int16 keyframeStringLength = sizeof(keyframeString) - 1;
 
 		// write the length of the key
-		fwrite(&keyframeStringLength,2,1,pFile);
+		output->write(&keyframeStringLength,2);
 		// write the key
-		fwrite(keyframeString,1,keyframeStringLength,pFile);
+		output->write(keyframeString,keyframeStringLength);
 	
 		// write a 'd' for dict
-		fwrite(&d,1,1,pFile);
+		output->write(&d,1);
 
 		// write the number of keys
 		nkeys = 1;
-		fwrite(&nkeys,1,1,pFile);
+		output->write(&nkeys,1);
 
 			// write index->keyframe->mean
 			const char meanString[] = "mean";
 			unsigned __int16 meanStringLength = sizeof(meanString) - 1;
 
 			// write the length of the key
-			fwrite(&meanStringLength,2,1,pFile);
+			output->write(&meanStringLength,2);
 			// write the key
-			fwrite(meanString,1,meanStringLength,pFile);
+			output->write(meanString,meanStringLength);
 
 			// write a 'd' for dict
-			fwrite(&d,1,1,pFile);
+			output->write(&d,1);
 
 			// write the number of keys
 			nkeys = 2;
-			fwrite(&nkeys,1,1,pFile);
+			output->write(&nkeys,1);
 
 				// write index->keyframe->mean->loc
 
 				// write the length of the key
-				fwrite(&locStringLength,2,1,pFile);
+				output->write(&locStringLength,2);
 				// write the key
-				fwrite(locString,1,locStringLength,pFile);
+				output->write(locString,locStringLength);
 
 				// write a for array
-				fwrite(&a,1,1,pFile);
+				output->write(&a,1);
 
 				// write the data type
 				datatype = 'q';
-				fwrite(&datatype,1,1,pFile);
+				output->write(&datatype,1);
 	
 				// write the number of bytes
-				nbytes = 8*meanindex.size();
-				fwrite(&nbytes,4,1,pFile);
+				nbytes = (unsigned __int32)(8*meanindex->size());
+				output->write(&nbytes,4);
 
 				// write the array
-				for (unsigned int i = 0 ; i < meanindex.size(); i++ ){
-					loc = meanindex[i];
-					fwrite(&loc,8,1,pFile);
-				}
+				meanindex->writeLocs(output);
 
 				// end of index->frame->loc
 
 				// write index->keyframe->mean->timestamp
 
 				// write the length of the key
-				fwrite(&timestampStringLength,2,1,pFile);
+				output->write(&timestampStringLength,2);
 				// write the key
-				fwrite(timestampString,1,timestampStringLength,pFile);
+				output->write(timestampString,timestampStringLength);
 
 				// write a for array
-				fwrite(&a,1,1,pFile);
+				output->write(&a,1);
 
 				// write the data type
 				datatype = 'd';
-				fwrite(&datatype,1,1,pFile);
+				output->write(&datatype,1);
 	
 				// write the number of bytes
-				nbytes = 8*meanindex.size();
-				fwrite(&nbytes,4,1,pFile);
+				nbytes = (unsigned __int32)(8*meanindex->size());
+				output->write(&nbytes,4);
 
 				// write the array
-				for (unsigned int i = 0 ; i < meanindex_timestamp.size(); i++ ){
-					timestamp = meanindex_timestamp[i];
-					fwrite(&timestamp,8,1,pFile);
-				}
+				meanindex->writeTimestamps(output);
 
 				// end index->keyframe->mean->timestamp
 
@@ -1333,24 +2499,31 @@ bool ufmfWriter::finishWriting(){
 
 	// end index
 
-	// write the index location
-	_fseeki64(pFile,indexPtrLocation,SEEK_SET);
-	fwrite(&indexLocation,8,1,pFile);
+	// wait for everything to be written, then write the index location. if either fails, the
+	// index pointer is left 0 and ufmfRecover can rebuild the index
+	bool res = output->finish() && output->writeAt(indexPtrLocation,&indexLocation,8);
 
 	//Close the file
-	fclose(pFile);
-	pFile = NULL;
+	res = output->close() && res;
+	if(!res){
+		logger->log(UFMF_ERROR,"Error writing %s\n",segmentFileName);
+	}
+	delete output;
+	output = NULL;
 
 	if(stats){
 		stats->updateTimings(UTT_WRITE_FOOTER,stats_t0);
 	}
 
-	meanindex.clear();
-	meanindex_timestamp.clear();
-	index.clear();
-	index_timestamp.clear();
+	// the index is in the movie now, so the spill files can go, unless the movie could not be written
+	index->close(res);
+	meanindex->close(res);
+	delete index;
+	index = NULL;
+	delete meanindex;
+	meanindex = NULL;
 
-	return true;
+	return res;
 }
 
 bool ufmfWriter::writeBGKeyFrame(float* BGCenter,double keyframeTimestamp){
@@ -1366,33 +2539,33 @@ bool ufmfWriter::writeBGKeyFrame(float* BGCenter,double keyframeTimestamp){
 	logger->log(UFMF_DEBUG_7,"writing keyframe\n");
 
 	// add to keyframe index
-	meanindex.push_back(_ftelli64(pFile));
-	meanindex_timestamp.push_back(keyframeTimestamp);
+	meanindex->push_back((__int64)output->tell(),keyframeTimestamp);
 
 	// write keyframe chunk identifier
-	fwrite(&KEYFRAMECHUNK,1,1,pFile);
+	unsigned __int8 chunkType = KEYFRAMECHUNK;
+	output->write(&chunkType,1);
 
 	// write the keyframe type
 	const char keyFrameType[] = "mean";
 	unsigned __int8 keyFrameTypeLength = sizeof(keyFrameType) - 1;
-	fwrite(&keyFrameTypeLength,1,1,pFile);
-	fwrite(keyFrameType,1,keyFrameTypeLength,pFile);
+	output->write(&keyFrameTypeLength,1);
+	output->write(keyFrameType,keyFrameTypeLength);
 
 	// write the data type
 	const char dataType = 'f';
-	fwrite(&dataType,1,1,pFile);
+	output->write(&dataType,1);
 
 	// width, height
-	fwrite(&wWidth,2,1,pFile);
-	fwrite(&wHeight,2,1,pFile);
+	output->write(&wWidth,2);
+	output->write(&wHeight,2);
 
 	// timestamp
-	fwrite(&keyframeTimestamp,8,1,pFile);
+	output->write(&keyframeTimestamp,8);
 
 	Lock();
 
 	// write the frame
-	fwrite(BGCenter,4,nPixels,pFile);
+	output->write(BGCenter,4*(unsigned __int64)nPixels);
 
 	nBGKeyFramesWritten++;
 	Unlock();
@@ -1404,75 +2577,154 @@ bool ufmfWriter::writeBGKeyFrame(float* BGCenter,double keyframeTimestamp){
 	return true;
 }
 
+// CHECKPOINT_CHUNK: chunk type (1), UFMFCHECKPOINTMAGIC (8), payload length (8), payload,
+// payload length (8), UFMFCHECKPOINTMAGIC (8). the payload is the location of the previous
+// checkpoint (8, 0 if none), the number of the first frame (8) and keyframe (8) it holds, the
+// number of frames (4) and keyframes (4), then the frame locations (8 each) and timestamps
+// (8 each), and the keyframe locations and timestamps. the trailing length and magic let
+// ufmfRecover find the last checkpoint by searching back from the end of the file, then it
+// follows the previous locations back to the first
+bool ufmfWriter::writeCheckpoint(){
+
+	unsigned __int64 firstFrame = nFramesCheckpointed;
+	unsigned __int64 firstKeyFrame = nKeyFramesCheckpointed;
+	unsigned __int32 nFrames = (unsigned __int32)(index->size() - firstFrame);
+	unsigned __int32 nKeyFrames = (unsigned __int32)(meanindex->size() - firstKeyFrame);
+	unsigned __int64 payloadLength = 8 + 8 + 8 + 4 + 4 + 16*(unsigned __int64)nFrames + 16*(unsigned __int64)nKeyFrames;
+	unsigned __int64 checkpointLocation = output->tell();
+	unsigned __int8 chunkType = CHECKPOINT_CHUNK;
+	bool res = true;
+
+	res = res && output->write(&chunkType,1);
+	res = res && output->write(UFMFCHECKPOINTMAGIC,8);
+	res = res && output->write(&payloadLength,8);
+	res = res && output->write(&lastCheckpointLocation,8);
+	res = res && output->write(&firstFrame,8);
+	res = res && output->write(&firstKeyFrame,8);
+	res = res && output->write(&nFrames,4);
+	res = res && output->write(&nKeyFrames,4);
+	res = res && index->writeLocs(output,firstFrame);
+	res = res && index->writeTimestamps(output,firstFrame);
+	res = res && meanindex->writeLocs(output,firstKeyFrame);
+	res = res && meanindex->writeTimestamps(output,firstKeyFrame);
+	res = res && output->write(&payloadLength,8);
+	res = res && output->write(UFMFCHECKPOINTMAGIC,8);
+	if(!res){
+		return false;
+	}
+
+	lastCheckpointLocation = checkpointLocation;
+	nFramesCheckpointed += nFrames;
+	nKeyFramesCheckpointed += nKeyFrames;
+	logger->log(UFMF_DEBUG_7,"Wrote index checkpoint of %u frames and %u keyframes at %llu\n",nFrames,nKeyFrames,checkpointLocation);
+
+	return true;
+
+}
+
 // *** compression tools ***
 
-bool ufmfWriter::addToBGModel(unsigned __int8 * frame, double timestamp, unsigned __int64 frameNumber){
+bool ufmfWriter::queueBGModelWork(double timestamp, unsigned __int64 frameNumber, int slot){
 
-	double dt = timestamp - lastBGUpdateTime;
+	// add to the counts if it has been long enough since the last frame was added
+	bool doAddFrame = (timestamp - lastBGUpdateTime >= BGUpdatePeriod) || (frameNumber < nFramesInit);
+	bool doUpdate = false;
 
-	if((dt < BGUpdatePeriod) && (frameNumber >= nFramesInit)) {
-		return true;
+	// compute a new model if the counts have changed and it has been long enough since the last keyframe
+	if(doAddFrame || lastBGUpdateTime > lastBGKeyFrameTime){
+		double BGKeyFramePeriodCurr = BGKeyFramePeriod;
+		if(nBGKeyFramesQueued > 0 && BGKeyFramePeriodInitLength > 0 && nBGKeyFramesQueued <= (unsigned __int64)BGKeyFramePeriodInitLength){
+			BGKeyFramePeriodCurr = BGKeyFramePeriodInit[nBGKeyFramesQueued-1];
+		}
+		doUpdate = (nBGKeyFramesQueued == 0) || (timestamp - lastBGKeyFrameTime >= BGKeyFramePeriodCurr);
 	}
 
-	ULARGE_INTEGER stats_t0;
-	if(stats){
-		stats_t0 = ufmfWriterStats::getTime();
+	slotBGRequests[slot] = -1;
+	if(!doAddFrame && !doUpdate){
+		return true;
 	}
 
-	logger->log(UFMF_DEBUG_7,"Adding frame %d to background model counts\n",frameNumber);
+	// if the background thread is behind, skip this frame; we will try again with the next one
+	Lock();
+	if(nBGRequestsBuffered >= BGQUEUELENGTH){
+		nBGFramesDropped++;
+		Unlock();
+		logger->log(UFMF_DEBUG_3,"Background model queue full, skipping frame %llu\n",frameNumber);
+		return true;
+	}
+	Unlock();
 
-	bg->addFrame(frame,timestamp);
-	// store update time
-	lastBGUpdateTime = timestamp;
+	logger->log(UFMF_DEBUG_7,"Queueing frame %llu for the background model, add = %d, update = %d\n",frameNumber,(int)doAddFrame,(int)doUpdate);
 
-	if(stats){
-		stats->updateTimings(UTT_UPDATE_BACKGROUND,stats_t0);
+	// only addFrame fills slots, and the background thread doesn't look at this slot until it is signaled.
+	// the frame itself is copied by the compression thread that takes it, off the capture thread
+	if(doAddFrame){
+		slotBGRequests[slot] = BGQueueTail;
+		lastBGUpdateTime = timestamp;
 	}
+	if(doUpdate){
+		lastBGKeyFrameTime = timestamp;
+		nBGKeyFramesQueued++;
+	}
+	BGQueueTimestamps[BGQueueTail] = timestamp;
+	BGQueueAddFrame[BGQueueTail] = doAddFrame;
+	BGQueueUpdate[BGQueueTail] = doUpdate;
+	BGQueueTail = (BGQueueTail + 1) % BGQUEUELENGTH;
+
+	Lock();
+	nBGRequestsBuffered++;
+	Unlock();
+	ReleaseSemaphore(bgThreadStartSignal,1,NULL);
 
 	return true;
 }
 
-bool ufmfWriter::updateBGModel(unsigned __int8 * frame, double timestamp, unsigned __int64 frameNumber){
+void ufmfWriter::copyFrameToBGQueue(int slot){
 
-	// if the background hasn't been updated, no need to write a new keyframe
-	if(lastBGUpdateTime <= lastBGKeyFrameTime){
-		return true;
-	}
+	int request = slotBGRequests[slot];
 
-	// time since last keyframe
-	double dt = timestamp - lastBGKeyFrameTime;
-	double BGKeyFramePeriodCurr = BGKeyFramePeriod;
-	unsigned __int64 nBGKeyFramesWrittenCurr;
-	unsigned __int64 minFrameBGModel1Copy;
+	if(request < 0) return;
+	memcpy(BGQueueFrames[request],slotFrames[slot],nPixels*sizeof(unsigned __int8));
+	slotBGRequests[slot] = -1;
+	ReleaseSemaphore(BGQueueFilledSignals[request],1,NULL);
+}
 
-	Lock();
-	nBGKeyFramesWrittenCurr = nBGKeyFramesWritten;
-	minFrameBGModel1Copy = minFrameBGModel1;
-	Unlock();
+void ufmfWriter::unpinBGGeneration(int g){
 
-	if(nBGKeyFramesWrittenCurr > 0 && nBGKeyFramesWrittenCurr <= BGKeyFramePeriodInitLength){
-		BGKeyFramePeriodCurr = BGKeyFramePeriodInit[nBGKeyFramesWrittenCurr-1];
+	// the current generation is never reused, and the background thread looks at every count
+	// after it publishes a new one, so only the others need to wake it. if the count is already
+	// at its maximum, the background thread has a wakeup waiting anyway
+	if(InterlockedDecrement(&BGRefCounts[g]) == 0 && g != BGCurrentGeneration){
+		ReleaseSemaphore(BGGenerationFreeSignal,1,NULL);
 	}
+}
 
-	// no need to write a new keyframe if it hasn't been long enough
-	// TODO: change nInput != nFramesInit to nInput != BGKeyFramePeriodInit
-	if((nBGKeyFramesWrittenCurr > 0) && (dt < BGKeyFramePeriodCurr)){// && (nInput != nFramesInit)){
-		return true;
+bool ufmfWriter::addToBGModel(unsigned __int8 * frame, double timestamp){
+
+	ULARGE_INTEGER stats_t0;
+	if(stats){
+		stats_t0 = ufmfWriterStats::getTime();
+	}
+
+	logger->log(UFMF_DEBUG_7,"Adding frame with timestamp %f to background model counts\n",timestamp);
+
+	bg->addFrame(frame,timestamp);
+
+	if(stats){
+		stats->updateTimings(UTT_UPDATE_BACKGROUND,stats_t0);
 	}
 
+	return true;
+}
+
+bool ufmfWriter::updateBGModel(double timestamp){
+
 	ULARGE_INTEGER stats_t0;
 	if(stats){
 		stats_t0 = ufmfWriterStats::getTime();
 	}
 
-	logger->log(UFMF_DEBUG_7,"Updating background model at frame %d\n",frameNumber);
-	//logger->log(UFMF_DEBUG_7,"waiting for keyframe %llu to be written\n",minFrameBGModel1Copy);
-	
-	// wait until the last key frame has been written
-	//if(WaitForSingleObject(keyFrameWritten,MAXWAITTIMEMS) != WAIT_OBJECT_0){
-	//	logger->log(UFMF_ERROR,"Timeout waiting for last keyframe to be written.\n");
-	//	return false;
-	//}
+	logger->log(UFMF_DEBUG_7,"Updating background model at timestamp %f\n",timestamp);
 
 	// update the model
 	if(!bg->updateModel()){
@@ -1480,69 +2732,54 @@ bool ufmfWriter::updateBGModel(unsigned __int8 * frame, double timestamp, unsign
 		return false;
 	}
 
-	Lock();
-
-	// sanity check: no frames should need to be written that are still using bound0
-	time_t startTime = time(NULL);
-	while(nWritten < minFrameBGModel1){
-		logger->log(UFMF_DEBUG_7,"Waiting for all frames using BGModel0 to be written\n");
-		Unlock();
-		Sleep(100);
-		if(difftime(time(NULL),startTime) > MAXWAITTIMEMS/1000.0){
-			logger->log(UFMF_ERROR,"Timeout waiting for all frames using background model 0 to be written");
+	// find a generation that no frame is using. the writer only holds on to old generations
+	// while it is behind, so this waits only if it is nBGModels-1 models behind
+	int g, k;
+	while(true){
+		for(k = 1, g = -1; k <= (int)nBGModels; k++){
+			g = (BGCurrentGeneration + k + (int)nBGModels) % (int)nBGModels;
+			if(g != BGCurrentGeneration && BGRefCounts[g] == 0) break;
+		}
+		if(k <= (int)nBGModels) break;
+		if(!isWriting){
+			return false;
+		}
+		logger->log(UFMF_DEBUG_7,"Waiting for a background model generation to be released\n");
+		// the signal may be left over from a generation we have already seen free, so look again
+		// either way. the stop signal comes when no frame will be written to release one
+		HANDLE signals[2] = {BGGenerationFreeSignal,bgThreadStopSignal};
+		if(WaitForMultipleObjects(2,signals,false,INFINITE) != WAIT_OBJECT_0){
 			return false;
 		}
-		Lock();
 	}
 
-	lastBGKeyFrameTime = timestamp;
-
-	// update using old buffer, which is bound0
+	// only the current generation can gain new frames, and addFrame drops a pin it takes on any
+	// other, so g stays free while we fill it
+	unsigned __int8 * BGLowerBound = BGLowerBounds[g];
+	unsigned __int8 * BGUpperBound = BGUpperBounds[g];
 	float tmp;
 	int i;
 	for(i = 0; i < nPixels; i++){
 		tmp = ceil(bg->BGCenter[i] - backSubThresh);
-		if(tmp < 0) BGLowerBound0[i] = 0;
-		else if(tmp > 255) BGLowerBound0[i] = 255;
-		else BGLowerBound0[i] = (unsigned __int8)tmp;
+		if(tmp < 0) BGLowerBound[i] = 0;
+		else if(tmp > 255) BGLowerBound[i] = 255;
+		else BGLowerBound[i] = (unsigned __int8)tmp;
 	}
 	for(i = 0; i < nPixels; i++){
 		tmp = floor(bg->BGCenter[i] + backSubThresh);
-		if(tmp < 0) BGUpperBound0[i] = 0;
-		else if(tmp > 255) BGUpperBound0[i] = 255;
-		else BGUpperBound0[i] = (unsigned __int8)tmp;
-	}
-	if(stats){
-		memcpy(BGCenter0,bg->BGCenter,nPixels*sizeof(float));
+		if(tmp < 0) BGUpperBound[i] = 0;
+		else if(tmp > 255) BGUpperBound[i] = 255;
+		else BGUpperBound[i] = (unsigned __int8)tmp;
 	}
+	memcpy(BGCenters[g],bg->BGCenter,nPixels*sizeof(float));
 
-	// swap the background subtraction images
-	unsigned char * tmpSwap;
-	tmpSwap = BGLowerBound0;
-	BGLowerBound0 = BGLowerBound1;
-	BGLowerBound1 = tmpSwap;
-	tmpSwap = BGUpperBound0;
-	BGUpperBound0 = BGUpperBound1;
-	BGUpperBound1 = tmpSwap;
-	if(stats){
-		float * tmpSwapFloat;
-		tmpSwapFloat = BGCenter0;
-		BGCenter0 = BGCenter1;
-		BGCenter1 = tmpSwapFloat;
-		double tmpSwapDouble = keyframeTimestamp0;
-		keyframeTimestamp0 = keyframeTimestamp1;
-		keyframeTimestamp1 = tmpSwapDouble;
-		unsigned __int64 tmpSwap64;
-		tmpSwap64 = minFrameBGModel0;
-		minFrameBGModel0 = minFrameBGModel1;
-		minFrameBGModel1 = tmpSwap64;
-	}
-
-	// we start using model 1 at this frame
-	minFrameBGModel1 = frameNumber;
-	keyframeTimestamp1 = timestamp;
+	// frames added from now on use generation g. the exchange makes g's contents visible first
+	nBGModelsPublished++;
+	BGModelNumbers[g] = nBGModelsPublished;
+	BGKeyFrameTimestamps[g] = timestamp;
+	InterlockedExchange(&BGCurrentGeneration,g);
 
-	Unlock();
+	logger->log(UFMF_DEBUG_7,"Published background model %llu in generation %d\n",nBGModelsPublished,g);
 
 	if(stats){
 		stats->updateTimings(UTT_COMPUTE_BACKGROUND,stats_t0);
@@ -1560,6 +2797,7 @@ DWORD WINAPI ufmfWriter::writeThread(void* param){
 	//MSG msg;
 	//bool didwrite;
 
+	ufmfSetThreadName("ufmf write");
 	SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_TIME_CRITICAL);
 	
 	// Signal that we are ready to begin writing
@@ -1576,17 +2814,37 @@ DWORD WINAPI ufmfWriter::writeThread(void* param){
 	return 0;
 }
 
+// create background model thread
+DWORD WINAPI ufmfWriter::bgThread(void* param){
+	ufmfWriter* writer = reinterpret_cast<ufmfWriter*>(param);
+
+	ufmfSetThreadName("ufmf bg");
+
+	// Signal that we are ready to process background model requests
+	ReleaseSemaphore(writer->bgThreadReadySignal, 1, NULL);  
+
+	// Continuously add frames to the background model and compute new models
+	while(writer->ProcessNextBGRequest())
+		;
+
+	return 0;
+}
+
 // create compression thread
 DWORD WINAPI ufmfWriter::compressionThread(void* param){
 	ufmfWriter* writer = reinterpret_cast<ufmfWriter*>(param);
 	int threadIndex;
+	char threadName[32];
 	//MSG msg;
 	//bool didwrite;
 
 	// get index for this thread
 	threadIndex = writer->threadCount++;
 
-	SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_TIME_CRITICAL);
+	snprintf(threadName,sizeof(threadName),"ufmf comp %d",threadIndex);
+	ufmfSetThreadName(threadName);
+	// threads that can be parked only help with bursts, so they don't preempt the camera driver
+	SetThreadPriority(GetCurrentThread(),threadIndex < (int)writer->minThreads ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_ABOVE_NORMAL);
 	
 	// Signal that we are ready to begin writing
 	ReleaseSemaphore(writer->compressionThreadReadySignals[threadIndex], 1, NULL);  
@@ -1602,80 +2860,139 @@ DWORD WINAPI ufmfWriter::compressionThread(void* param){
 	return 0;
 }
 
+// add the next queued frame to the background model, compute a new model if requested
+bool ufmfWriter::ProcessNextBGRequest(){
+
+	// wait for a request
+	WaitForSingleObject(bgThreadStartSignal,INFINITE);
+
+	// Check if we were signalled to stop. once we stop writing, no frames will use a new model
+	Lock();
+	if(!isWriting || nBGRequestsBuffered == 0){
+		Unlock();
+		logger->log(UFMF_DEBUG_3,"stopping background model thread, %llu background frames skipped\n",nBGFramesDropped);
+		return false;
+	}
+	Unlock();
+
+	if(BGQueueAddFrame[BGQueueHead]){
+		// wait for the frame to be copied in. the stop signal comes when the frame may never be
+		HANDLE signals[2] = {BGQueueFilledSignals[BGQueueHead],bgThreadStopSignal};
+		if(WaitForMultipleObjects(2,signals,false,INFINITE) != WAIT_OBJECT_0){
+			logger->log(UFMF_DEBUG_3,"stopping background model thread while waiting for a frame, %llu background frames skipped\n",nBGFramesDropped);
+			return false;
+		}
+		if(!addToBGModel(BGQueueFrames[BGQueueHead],BGQueueTimestamps[BGQueueHead])){
+			logger->log(UFMF_ERROR,"Error adding frame to background model\n");
+			return false;
+		}
+	}
+
+	// reset background model if necessary, signal to write key frame
+	if(BGQueueUpdate[BGQueueHead]){
+		if(!updateBGModel(BGQueueTimestamps[BGQueueHead])){
+			Lock();
+			bool res = isWriting;
+			Unlock();
+			if(res) logger->log(UFMF_ERROR,"Error computing new background model\n");
+			return false;
+		}
+	}
+
+	BGQueueHead = (BGQueueHead + 1) % BGQUEUELENGTH;
+	Lock();
+	nBGRequestsBuffered--;
+	Unlock();
+
+	return true;
+}
+
 // compress frame queued for this thread
 bool ufmfWriter::ProcessNextCompressFrame(int threadIndex) {
 	
-	ULARGE_INTEGER stats_t0;
+	// adaptive threads: stay parked while this thread isn't needed. stopThreads wakes every thread
+	while(threadIndex >= nActiveThreads && isWriting){
+		WaitForSingleObject(parkSignals[threadIndex],INFINITE);
+	}
+
+	ULARGE_INTEGER stats_t0, compress_t0;
+	LONG compressTicks;
 	if(stats){
 		stats_t0 = ufmfWriterStats::getTime();
 	}
 
 	unsigned __int64 frameNumber;
+	int slot;
 	bool res;
 
-	// wait for start signal
-	WaitForSingleObject(compressionThreadStartSignals[threadIndex],INFINITE);
+	// wait for a filled slot
+	WaitForSingleObject(slotQueuedSignal,INFINITE);
+	compress_t0 = ufmfWriterStats::getTime();
 
 	if(stats){
 		stats_t0 = stats->updateTimings(UTT_WAIT_FOR_UNCOMPRESSED_FRAME,stats_t0);
 	}
 
-	logger->log(UFMF_DEBUG_7,"starting compression thread %d on frame %u\n",threadIndex,threadFrameNumbers[threadIndex]);
-
-	// Check if we were signalled to stop compressing
-	Lock();
-	if(nUncompressedFramesBuffered == 0) {
+	// take the oldest filled slot. the queue is only empty if we were signalled to stop compressing
+	if(!compressQueue->pop(slot)) {
 		if(isWriting) {
-			Unlock();
 			logger->log(UFMF_ERROR, "Something went wrong in thread %d... Got signal to compress frame but no frames buffered and compress flag is still on\n",threadIndex);
 		}
-		else{
-			Unlock(); 
-		}
-		logger->log(UFMF_DEBUG_3,"nUncompressedFramesBuffered == 0, stopping compression thread %d\n",threadIndex);
+		logger->log(UFMF_DEBUG_3,"no frames queued, stopping compression thread %d\n",threadIndex);
 		return false;
 	}
-	nUncompressedFramesBuffered--;
-	Unlock();
 
-	// compress this frame
-	unsigned __int8 * BGLowerBoundCurr;
-	unsigned __int8 * BGUpperBoundCurr;
-	//unsigned __int8 * BGCenterCurr;
-	frameNumber = threadFrameNumbers[threadIndex];
-	Lock();
-	if(frameNumber < minFrameBGModel0){
-		logger->log(UFMF_ERROR,"Error: frameNumber %llu < minFrameBGModel0 %llu\n",frameNumber,minFrameBGModel0);
-		return false;
+	logger->log(UFMF_DEBUG_7,"starting compression thread %d on slot %d, frame %llu\n",threadIndex,slot,slotFrameNumbers[slot]);
+
+	// the background thread may be waiting for this frame, so it gets it first
+	copyFrameToBGQueue(slot);
+
+	// compress this frame with the generation pinned when it was added. it can't be changed
+	// until this frame has been written
+	unsigned __int8 * BGLowerBoundCurr = NULL;
+	unsigned __int8 * BGUpperBoundCurr = NULL;
+	frameNumber = slotFrameNumbers[slot];
+	// while the overload policy has the writer catching up, frames are stored as they are
+	if(slotBGGenerations[slot] >= 0 && !writingRaw){
+		logger->log(UFMF_DEBUG_7,"using bg generation %d to compress frame %llu\n",slotBGGenerations[slot],frameNumber);
+		BGLowerBoundCurr = BGLowerBounds[slotBGGenerations[slot]];
+		BGUpperBoundCurr = BGUpperBounds[slotBGGenerations[slot]];
+	}
+
+	CompressedFrame * im = compressedFrames[slotBuffers[slot]];
+	im->setData(slotFrames[slot],slotTimestamps[slot],frameNumber,BGLowerBoundCurr,BGUpperBoundCurr);
+	res = serializeFrame(im);
+
+	// adaptive threads: smooth the compress time over about 8 frames. it is sampled before the
+	// mapped copy, which waits for the threads with earlier frames and so grows with the number
+	// of threads rather than with the work per frame. threads can overwrite each other's updates,
+	// which only loses a sample
+	if(minThreads < nThreads){
+		compressTicks = (LONG)(ufmfWriterStats::getTime().QuadPart - compress_t0.QuadPart);
+		compressTicksEstimate = (compressTicksEstimate == 0) ? compressTicks : compressTicksEstimate + (compressTicks - compressTicksEstimate) / 8;
 	}
-	else if(frameNumber < minFrameBGModel1){
-		logger->log(UFMF_DEBUG_7,"using bg model 0 to compress frame %d\n",frameNumber);
-		BGLowerBoundCurr = BGLowerBound0;
-		BGUpperBoundCurr = BGUpperBound0;
-		//BGCenterCurr = BGCenter0;
+
+	if(!res){
+		logger->log(UFMF_ERROR,"Error serializing frame %llu in thread %d\n",frameNumber,threadIndex);
 	}
-	else{
-		logger->log(UFMF_DEBUG_7,"using bg model 1 to compress frame %d\n",frameNumber);
-		BGLowerBoundCurr = BGLowerBound1;
-		BGUpperBoundCurr = BGUpperBound1;
-		//BGCenterCurr = BGCenter1;
+	// with mapped output the chunk goes straight into the file from here
+	else if(mappedOutput && !copyFrameToMappedOutput(slot)){
+		logger->log(UFMF_ERROR,"Error copying frame %llu in thread %d to the output file\n",frameNumber,threadIndex);
 	}
-	Unlock();
 
-	compressedFrames[threadIndex]->setData(uncompressedFrames[threadIndex],threadTimestamps[threadIndex],
-		frameNumber,BGLowerBoundCurr,BGUpperBoundCurr);
+	// the compressed frame has its own copy of the pixels it keeps. stats compare against
+	// the original when the frame is written, so then it is held until after that
+	if(!stats){
+		releaseFrame(slot);
+	}
 
-	Lock(); // lock for nCompressedFramesBuffered
-	nCompressedFramesBuffered++;
-	logger->log(UFMF_DEBUG_7,"set nCompressedFramesBuffered to %d after compressing frame %llu\n",nCompressedFramesBuffered,frameNumber);
-	Unlock();
+	InterlockedIncrement(&nCompressedFramesBuffered);
+	logger->log(UFMF_DEBUG_7,"compressed frame %llu\n",frameNumber);
 
-	// signal that the compression thread is finished
-	ReleaseSemaphore(compressionThreadDoneSignals[threadIndex],1,NULL);
+	// signal that the frame in this slot can be written
+	ReleaseSemaphore(slotDoneSignals[slot],1,NULL);
 
-	Lock();
-	res = isWriting || nUncompressedFramesBuffered > 0;
-	Unlock();
+	res = isWriting || compressQueue->size() > 0;
 
 	if(stats){
 		stats->updateTimings(UTT_COMPUTE_FRAME,stats_t0);
@@ -1691,134 +3008,174 @@ bool ufmfWriter::ProcessNextWriteFrame(){
 		stats_t0 = ufmfWriterStats::getTime();
 	}
 
-	int threadIndex;
-	unsigned __int64 frameNumber;
-	int i;
-	int nReadyToWrite = 0;
-	time_t startTime = time(NULL);
+	int slot;
+	int i, n, nBuffersFreed;
+	unsigned __int64 frameNumber, firstFrameNumber;
+	DWORD waitResult;
+	int BGGeneration;
+	CompressedFrame * im;
+	__int64 frameSizeBytes;
+	bool res = true;
 
-	Lock();
-	nWritten++;
-	frameNumber = nWritten;
-	Unlock();
+	// frames are written in order, so we know which slot the next one is in
+	frameNumber = nWritten + 1;
+	firstFrameNumber = frameNumber;
+	slot = (int)((frameNumber-1) % nSlots);
+	HANDLE signals[2] = {slotDoneSignals[slot],writeThreadStopSignal};
 
-	logger->log(UFMF_DEBUG_7,"waiting for frame number %u to be compressed so that we can write it\n",frameNumber);
+	logger->log(UFMF_DEBUG_7,"waiting for frame number %llu in slot %d to be compressed so that we can write it\n",frameNumber,slot);
 
-	while(true){
+	// the frame comes first, so we only stop once every frame compressed is written
+	waitResult = WaitForMultipleObjects(2,signals,false,INFINITE);
+	if(waitResult == WAIT_OBJECT_0 + 1){
+		logger->log(UFMF_DEBUG_3,"write thread signalled to stop while waiting for frame %llu\n",frameNumber);
+		return false;
+	}
+	if(waitResult != WAIT_OBJECT_0){
+		logger->log(UFMF_ERROR,"Error waiting for frame %llu in slot %d in write thread: %x\n",frameNumber,slot,waitResult);
+		return false;
+	}
 
-		if(nReadyToWrite >= nThreads){
-			logger->log(UFMF_ERROR,"Found too many frames that need to be written! Something is wrong!\n");
-			return false;
+	// Check if we were signalled to stop writing
+	if(nCompressedFramesBuffered <= 0) {
+		if(isWriting) {
+			logger->log(UFMF_ERROR, "Something went wrong... Got signal to write frame %llu in slot %d but no compressed frames buffered and write flag is still on\n",frameNumber,slot);
 		}
+		return false;
+	}
 
-		// wait for any compressed frame to be filled
-		threadIndex = (int)WaitForMultipleObjects((DWORD)nThreads,compressionThreadDoneSignals,false,MAXWAITTIMEMS) - (int)WAIT_OBJECT_0;
-
-		if(threadIndex > nThreads || threadIndex < 0){
-			logger->log(UFMF_ERROR,"Error waiting for compressionThreadDoneSignals in write thread\n");
-			return false;
+	// take every frame after it that is already compressed, up to a full ring
+	for(n = 1; n < (int)nSlots; n++){
+		if(WaitForSingleObject(slotDoneSignals[(slot+n) % nSlots],0) != WAIT_OBJECT_0){
+			break;
 		}
-		// Check if we were signalled to stop writing
-		Lock(); // lock because we are accessing isWriting and nCompressedFramesBuffered
-		if(nCompressedFramesBuffered == 0) {
-			if(isWriting) {
-				logger->log(UFMF_ERROR, "Something went wrong... Got signal to write frame for thread %d containing frame %llu but no compressed frames buffered and write flag is still on\n",threadIndex,compressedFrames[threadIndex]->frameNumber);
+	}
+	logger->log(UFMF_DEBUG_7,"writing frames %llu through %llu\n",frameNumber,frameNumber+n-1);
+
+	if(stats){
+		stats->updateTimings(UTT_WAIT_FOR_COMPRESSED_FRAME,stats_t0);
+	}
+
+	for(i = 0; i < n; i++, frameNumber++){
+
+		slot = (int)((frameNumber-1) % nSlots);
+		BGGeneration = slotBGGenerations[slot];
+
+		// frames dropped to make room after they were queued are skipped
+		if(slotDroppedFrames[slot] == frameNumber){
+			logger->log(UFMF_DEBUG_7,"skipping dropped frame %llu\n",frameNumber);
+			InterlockedDecrement(&nCompressedFramesBuffered);
+			nFramesSkipped++;
+			nWritten = frameNumber;
+			if(BGGeneration >= 0){
+				unpinBGGeneration(BGGeneration);
 			}
-			Unlock(); 
-			return false;
+			continue;
 		}
-		Unlock();
-
-		logger->log(UFMF_DEBUG_7,"got frame %u when waiting to write frame %u\n",compressedFrames[threadIndex]->frameNumber,frameNumber);
 
-		readyToWrite[nReadyToWrite++] = threadIndex;
+		im = compressedFrames[slotBuffers[slot]];
+		if(im->frameNumber != frameNumber){
+			logger->log(UFMF_ERROR,"Got frame %llu in slot %d when waiting for frame %llu\n",im->frameNumber,slot,frameNumber);
+			res = false;
+			break;
+		}
 
-		// is this the next frame to write?
-		if(compressedFrames[threadIndex]->frameNumber == frameNumber){
+		// start a new file before this frame if the current segment is full
+		if(segmentIsFull(im) && (!flushFrames() || !startNextSegment())){
+			logger->log(UFMF_ERROR,"Error starting segment %d before frame %llu\n",segmentNumber,frameNumber);
+			res = false;
 			break;
 		}
-		if(compressedFrames[threadIndex]->frameNumber < frameNumber){
-			logger->log(UFMF_ERROR,"Got frame %llu when waiting for frame %llu -- we should have already written this frame.\n",compressedFrames[threadIndex]->frameNumber,frameNumber);
-			return false;
+		if(index->size() == 0){
+			segmentStartTime = im->timestamp;
 		}
 
-		if(difftime(time(NULL),startTime) > MAXWAITTIMEMS/1000.0){
-			logger->log(UFMF_ERROR,"Timeout waiting for a compressed frame");
-			return false;
+		// write background model if this is the first frame using it. frames pin generations
+		// in the order they are added, so model numbers only increase from frame to frame.
+		// with mapped output the compression thread already did this
+		if(!mappedOutput && BGGeneration >= 0 && BGModelNumbers[BGGeneration] != lastBGModelNumberWritten){
+			if(!flushFrames()){
+				res = false;
+				break;
+			}
+			writeBGKeyFrame(BGCenters[BGGeneration],BGKeyFrameTimestamps[BGGeneration]);
+			lastBGModelNumberWritten = BGModelNumbers[BGGeneration];
+			logger->log(UFMF_DEBUG_3,"Wrote key frame %llu for frame %llu\n",lastBGModelNumberWritten,frameNumber);
 		}
-	}
 
-	if(stats){
-		stats->updateTimings(UTT_WAIT_FOR_COMPRESSED_FRAME,stats_t0);
-	}
+		// add the compressed frame to the batch
+		frameSizeBytes = writeFrame(im);
+		if(frameSizeBytes <= 0){
+			logger->log(UFMF_ERROR,"Error writing frame %llu from slot %d\n",frameNumber,slot);
+			res = false;
+			break;
+		}
 
-	// replace the semaphores for future frames
-	for(i = 0; i < nReadyToWrite-1; i++){
-		logger->log(UFMF_DEBUG_7,"Putting buffer %d, frame %llu back in the queue to be written when waiting for frame %llu.\n",readyToWrite[i],compressedFrames[readyToWrite[i]]->frameNumber,frameNumber);
-		ReleaseSemaphore(compressionThreadDoneSignals[readyToWrite[i]],1,NULL);
-	}
+		// checkpoint the index
+		if(checkpointFrames > 0 && !mappedOutput && index->size() - nFramesCheckpointed >= checkpointFrames){
+			if(!flushFrames() || !writeCheckpoint()){
+				logger->log(UFMF_ERROR,"Error writing index checkpoint after frame %llu\n",frameNumber);
+				res = false;
+				break;
+			}
+		}
 
-	// update timings
+		InterlockedDecrement(&nCompressedFramesBuffered);
+		nWritten = frameNumber;
+
+		if(stats){
+			stats_t0 = ufmfWriterStats::getTime();
+			float * BGCenterCurr = BGGeneration >= 0 ? BGCenters[BGGeneration] : NULL;
+			stats->update(index->locs, index->timestamps, nFramesPrevSegments + index->base(), frameSizeBytes, im->isCompressed, 
+				im->numFore, im->numPxWritten, 
+				im->ncc, nFramesBufferedExternal, nFramesDroppedExternal, nFramesDroppedOverload, 
+				im->isWritten, im->foreStride, nPixels, slotFrames[slot], 
+				BGCenterCurr, UFMF_DEBUG_3);
+			stats->updateTimings(UTT_COMPUTE_STATS,stats_t0);
+		}
+		// the batch only holds the compressed chunk, so the original can go back now
+		releaseFrame(slot);
 
-	// write background model if nec
-	Lock();
-	bool isBGModel1 = frameNumber >= minFrameBGModel1;
-	bool writeKeyFrame1 = frameNumber == minFrameBGModel1;
-	bool writeKeyFrame0 = frameNumber == minFrameBGModel0;
-	double keyframeTimestamp0Copy = keyframeTimestamp0;
-	double keyframeTimestamp1Copy = keyframeTimestamp1;
-	Unlock();
-	if(writeKeyFrame0){
-		writeBGKeyFrame(BGCenter0,keyframeTimestamp0Copy);
-		logger->log(UFMF_DEBUG_3,"Wrote key frame 0 for frame %llu, releasing semaphore\n",frameNumber);
-		//ReleaseSemaphore(keyFrameWritten,1,NULL);
-	}
-	if(writeKeyFrame1){
-		writeBGKeyFrame(BGCenter1,keyframeTimestamp1Copy);
-		logger->log(UFMF_DEBUG_3,"Wrote key frame 1 for frame %llu, releasing semaphore\n",frameNumber);
-		//ReleaseSemaphore(keyFrameWritten,1,NULL);
+		// this frame is done with its background model
+		if(BGGeneration >= 0){
+			unpinBGGeneration(BGGeneration);
+		}
 	}
 
-
-	// write the compressed frame
-	threadIndex = readyToWrite[nReadyToWrite-1];
-
-	__int64 frameSizeBytes = writeFrame(compressedFrames[threadIndex]);
-	if(frameSizeBytes <= 0){
-		logger->log(UFMF_ERROR,"Error writing frame %u from thread %d\n",frameNumber,threadIndex);
-		return false;
+	// after an error the rest of the batch is not written, but it was taken, so its lent frames
+	// are given back and its slots freed with the others
+	for(; i < n; i++, frameNumber++){
+		slot = (int)((frameNumber-1) % nSlots);
+		InterlockedDecrement(&nCompressedFramesBuffered);
+		releaseFrame(slot);
+		if(slotBGGenerations[slot] >= 0){
+			unpinBGGeneration(slotBGGenerations[slot]);
+		}
 	}
 
-	Lock(); // lock to access isWriting and nCompressedFramesBuffered
-	nCompressedFramesBuffered--;
-	unsigned __int64 nFramesDroppedExternalCopy = nFramesDroppedExternal;
-	unsigned __int64 nFramesBufferedExternalCopy = nFramesBufferedExternal;
-	logger->log(UFMF_DEBUG_7,"set nCompressedFramesBuffered to %d after writing frame %llu\n",nCompressedFramesBuffered,frameNumber);
-	bool res = isWriting || nCompressedFramesBuffered > 0;
-	Unlock();
+	// the frames before it are in the batch, and the batch has to be out before their slots are reused
+	res = flushFrames() && res;
 
-	if(stats){
-		stats_t0 = ufmfWriterStats::getTime();
-		float * BGCenterCurr;
-		if(isBGModel1)
-			BGCenterCurr = BGCenter1;
-		else
-			BGCenterCurr = BGCenter0;
-		stats->update(index, index_timestamp, frameSizeBytes, compressedFrames[threadIndex]->isCompressed, 
-			compressedFrames[threadIndex]->numFore, compressedFrames[threadIndex]->numPxWritten, 
-			compressedFrames[threadIndex]->ncc, nFramesBufferedExternal, nFramesDroppedExternal, 
-			compressedFrames[threadIndex]->nWrites, nPixels, uncompressedFrames[threadIndex], 
-			BGCenterCurr, UFMF_DEBUG_3);
-		stats->updateTimings(UTT_COMPUTE_STATS,stats_t0);
+	// now their buffers can be reused too, apart from those of dropped frames, which went to
+	// the frames that replaced them
+	for(i = 0, nBuffersFreed = 0, frameNumber = firstFrameNumber; i < n; i++, frameNumber++){
+		slot = (int)((frameNumber-1) % nSlots);
+		if(slotDroppedFrames[slot] != frameNumber){
+			freeBuffers->push(slotBuffers[slot]);
+			nBuffersFreed++;
+		}
 	}
 
-	// signal that we've written the key frame
-	//if(writeKeyFrame)
-	//	ReleaseSemaphore(keyFrameWritten,1,NULL);
+	// signal that the slots can be filled again. slots go first: addFrame waits for a buffer and
+	// then expects a slot to be free
+	ReleaseSemaphore(slotFreeSignal,n,NULL);
+	if(nBuffersFreed > 0){
+		ReleaseSemaphore(bufferFreeSignal,nBuffersFreed,NULL);
+	}
+	logger->log(UFMF_DEBUG_7,"Freed %d slots\n",n);
 
-	// signal that the compression thread can be used again
-	ReleaseSemaphore(compressionThreadReadySignals[threadIndex],1,NULL);
-	logger->log(UFMF_DEBUG_7,"Released compressionThreadReadySignals[%d]\n",threadIndex);
+	// keep going until every frame that was added has been written
+	res = res && (isWriting || nWritten < nGrabbed);
 
 	return(res);
 
@@ -1827,6 +3184,7 @@ bool ufmfWriter::ProcessNextWriteFrame(){
 bool ufmfWriter::stopThreads(bool waitForFinish){
 
 	long value;
+	bool res = true;
 
 	logger->log(UFMF_DEBUG_7,"stopping threads\n");
 
@@ -1837,33 +3195,41 @@ bool ufmfWriter::stopThreads(bool waitForFinish){
 		isWriting = false;
 		Unlock();
 
-		// stop each compression thread
+		// stop the background model thread. frames are no longer being added, so any
+		// requests still queued are dropped
+		logger->log(UFMF_DEBUG_7,"stopping background model thread\n");
+		// the threads use the buffers, the models and the output until they exit, so nothing can
+		// be torn down before then, however long the disk takes
+		if(_bgThread){
+			ReleaseSemaphore(bgThreadStartSignal,1,NULL);
+			ReleaseSemaphore(bgThreadStopSignal,1,NULL);
+			if(WaitForSingleObject(_bgThread,INFINITE) != WAIT_OBJECT_0){
+				logger->log(UFMF_ERROR,"Error shutting down background model thread\n");
+				res = false;
+			}
+			CloseHandle(_bgThread);
+			_bgThread = NULL;
+		}
+
+		// stop the compression threads
+		if(!waitForFinish){
+			// empty the queue, so that the threads don't compress any more frames
+			int slot;
+			while(compressQueue->pop(slot));
+		}
+		// wake parked threads, so that they see the stop signal
+		for(int i = 0; i < (int)nThreads; i++){
+			ReleaseSemaphore(parkSignals[i],1,NULL);
+		}
+		// one extra count per thread. the frames still queued are taken first, and a thread
+		// that wakes to an empty queue with isWriting == false exits
+		ReleaseSemaphore(slotQueuedSignal,(LONG)nThreads,NULL);
 		for(int i = 0; i < (int)nThreads; i++){
 			logger->log(UFMF_DEBUG_7,"stopping compression thread %d\n",i);
-			ReleaseSemaphore(compressionThreadStartSignals[i],1,NULL);
 			if(_compressionThreads[i]){
-				if(!waitForFinish){
-					// set number of frames buffered to 0
-					Lock();
-					nUncompressedFramesBuffered = 0;
-					Unlock();
-					// increment semaphores so that the compression threads don't block forever. 
-					// since nUncompressedFramesBuffered == 0 and isWriting == false, we won't try to 
-					// compress a frame
-					ReleaseSemaphore(compressionThreadStartSignals[i], 1, NULL);
-				}
-				else{
-					Lock();
-					if(nUncompressedFramesBuffered == 0){
-						Unlock();
-						ReleaseSemaphore(compressionThreadStartSignals[i], 1, NULL);
-					}
-					else{
-						Unlock();
-					}
-				}
-				if(WaitForSingleObject(_compressionThreads[i],MAXWAITTIMEMS) != WAIT_OBJECT_0){
+				if(WaitForSingleObject(_compressionThreads[i],INFINITE) != WAIT_OBJECT_0){
 					logger->log(UFMF_ERROR,"Error shutting down compression thread %d\n",i);
+					res = false;
 				}
 				CloseHandle(_compressionThreads[i]);
 				_compressionThreads[i] = NULL;
@@ -1873,31 +3239,15 @@ bool ufmfWriter::stopThreads(bool waitForFinish){
 		logger->log(UFMF_DEBUG_7,"stopping write thread\n");
 		if(_writeThread){
 			if(!waitForFinish){
-				// set number of frames buffered to 0
-				Lock(); // lock for nCompressedFramesBuffered
-				nCompressedFramesBuffered = 0;
-				Unlock();
-				// increment semaphores so that the compression threads don't block forever. 
-				// since nCompressedFramesBuffered == 0 and isWriting == false, we won't try to 
-				// compress a frame
-				for(int j = 0; j < (int)nThreads; j++){
-					ReleaseSemaphore(compressionThreadDoneSignals[j], 1, NULL);
-				}
-				if(WaitForSingleObject(_writeThread, MAXWAITTIMEMS) != WAIT_OBJECT_0){
-					logger->log(UFMF_ERROR,"Error shutting down write thread\n");
-				}
+				// set number of frames buffered to 0, so that the write thread doesn't write any more frames
+				InterlockedExchange(&nCompressedFramesBuffered,0);
 			}
-			else{
-				Lock();
-				if(nCompressedFramesBuffered == 0){
-					Unlock();
-					for(int j = 0; j < (int)nThreads; j++){
-						ReleaseSemaphore(compressionThreadDoneSignals[j], 1, NULL);
-					}
-				}
-				else{
-					Unlock();
-				}
+			// the compression threads are done, so every frame still to be written is already
+			// compressed. the write thread writes those before it sees the stop signal
+			ReleaseSemaphore(writeThreadStopSignal,1,NULL);
+			if(WaitForSingleObject(_writeThread,INFINITE) != WAIT_OBJECT_0){
+				logger->log(UFMF_ERROR,"Error shutting down write thread\n");
+				res = false;
 			}
 
 			//Close thread handle
@@ -1905,12 +3255,31 @@ bool ufmfWriter::stopThreads(bool waitForFinish){
 			_writeThread = NULL;
 
 		}
+
+		// give back frames that were lent but won't be written. only once every thread is known to
+		// have exited: the owner reuses a frame as soon as it has it back, and a thread we couldn't
+		// wait for may still be reading it
+		if(slotReleaseCallbacks != NULL && res){
+			for(int i = 0; i < (int)nSlots; i++){
+				releaseFrame(i);
+			}
+		}
 	}
 
-	return true;
+	return res;
 
 }
 
+void ufmfWriter::releaseFrame(int slot){
+
+	ufmfFrameReleaseCallback release = slotReleaseCallbacks[slot];
+
+	if(release != NULL){
+		slotReleaseCallbacks[slot] = NULL;
+		release(slotReleaseContexts[slot],slotFrames[slot]);
+	}
+}
+
 // lock when accessing global data
 bool ufmfWriter::Lock() { 
 	if(WaitForSingleObject(lock, MAXWAITTIMEMS) != WAIT_OBJECT_0) { 
@@ -1929,7 +3298,7 @@ void ufmfWriter::deallocateBuffers(){
 
 	int i;
 	if(uncompressedFrames != NULL){
-		for(i = 0; i < (int)nThreads; i++){
+		for(i = 0; i < (int)nBuffers; i++){
 			if(uncompressedFrames[i] != NULL){
 				delete [] uncompressedFrames[i];
 				uncompressedFrames[i] = NULL;
@@ -1938,10 +3307,33 @@ void ufmfWriter::deallocateBuffers(){
 		delete [] uncompressedFrames;
 		uncompressedFrames = NULL;
 	}
-	nUncompressedFramesBuffered = 0;
+	if(slotBuffers != NULL){
+		delete [] slotBuffers;
+		slotBuffers = NULL;
+	}
+	if(freeBuffers != NULL){
+		delete freeBuffers;
+		freeBuffers = NULL;
+	}
+	if(slotFrames != NULL){
+		delete [] slotFrames;
+		slotFrames = NULL;
+	}
+	if(slotReleaseCallbacks != NULL){
+		delete [] slotReleaseCallbacks;
+		slotReleaseCallbacks = NULL;
+	}
+	if(slotReleaseContexts != NULL){
+		delete [] slotReleaseContexts;
+		slotReleaseContexts = NULL;
+	}
+	if(compressQueue != NULL){
+		delete compressQueue;
+		compressQueue = NULL;
+	}
 
 	if(compressedFrames != NULL){
-		for(i = 0; i < (int)nThreads; i++){
+		for(i = 0; i < (int)nBuffers; i++){
 			if(compressedFrames[i] != NULL){
 				delete compressedFrames[i];
 				compressedFrames[i] = NULL;
@@ -1952,20 +3344,54 @@ void ufmfWriter::deallocateBuffers(){
 	}
 	nCompressedFramesBuffered = 0;
 
-	if(threadTimestamps != NULL){
-		delete [] threadTimestamps;
-		threadTimestamps = NULL;
+	if(slotTimestamps != NULL){
+		delete [] slotTimestamps;
+		slotTimestamps = NULL;
 	}
 
-	if(threadFrameNumbers != NULL){
-		delete [] threadFrameNumbers;
-		threadFrameNumbers = NULL;
+	if(slotFrameNumbers != NULL){
+		delete [] slotFrameNumbers;
+		slotFrameNumbers = NULL;
 	}
+	if(slotDroppedFrames != NULL){
+		delete [] slotDroppedFrames;
+		slotDroppedFrames = NULL;
+	}
+
+	if(writeBatchData != NULL){
+		delete [] writeBatchData;
+		writeBatchData = NULL;
+	}
+	if(writeBatchBytes != NULL){
+		delete [] writeBatchBytes;
+		writeBatchBytes = NULL;
+	}
+	nWriteBatch = 0;
+	writeBatchLength = 0;
 
-	if(readyToWrite != NULL){
-		delete [] readyToWrite;
-		readyToWrite = NULL;
+	if(BGQueueFrames != NULL){
+		for(i = 0; i < BGQUEUELENGTH; i++){
+			if(BGQueueFrames[i] != NULL){
+				delete [] BGQueueFrames[i];
+				BGQueueFrames[i] = NULL;
+			}
+		}
+		delete [] BGQueueFrames;
+		BGQueueFrames = NULL;
+	}
+	if(BGQueueTimestamps != NULL){
+		delete [] BGQueueTimestamps;
+		BGQueueTimestamps = NULL;
 	}
+	if(BGQueueAddFrame != NULL){
+		delete [] BGQueueAddFrame;
+		BGQueueAddFrame = NULL;
+	}
+	if(BGQueueUpdate != NULL){
+		delete [] BGQueueUpdate;
+		BGQueueUpdate = NULL;
+	}
+	nBGRequestsBuffered = 0;
 }
 
 void ufmfWriter::deallocateBGModel(){
@@ -1974,21 +3400,55 @@ void ufmfWriter::deallocateBGModel(){
 		delete bg;
 		bg = NULL;
 	}
-	if(BGLowerBound0 != NULL){
-		delete [] BGLowerBound0;
-		BGLowerBound0 = NULL;
+	if(BGLowerBounds != NULL){
+		for(int i = 0; i < (int)nBGModels; i++){
+			if(BGLowerBounds[i] != NULL){
+				delete [] BGLowerBounds[i];
+				BGLowerBounds[i] = NULL;
+			}
+		}
+		delete [] BGLowerBounds;
+		BGLowerBounds = NULL;
+	}
+	if(BGUpperBounds != NULL){
+		for(int i = 0; i < (int)nBGModels; i++){
+			if(BGUpperBounds[i] != NULL){
+				delete [] BGUpperBounds[i];
+				BGUpperBounds[i] = NULL;
+			}
+		}
+		delete [] BGUpperBounds;
+		BGUpperBounds = NULL;
+	}
+	if(BGCenters != NULL){
+		for(int i = 0; i < (int)nBGModels; i++){
+			if(BGCenters[i] != NULL){
+				delete [] BGCenters[i];
+				BGCenters[i] = NULL;
+			}
+		}
+		delete [] BGCenters;
+		BGCenters = NULL;
+	}
+	if(BGKeyFrameTimestamps != NULL){
+		delete [] BGKeyFrameTimestamps;
+		BGKeyFrameTimestamps = NULL;
 	}
-	if(BGUpperBound0 != NULL){
-		delete [] BGUpperBound0;
-		BGUpperBound0 = NULL;
+	if(BGModelNumbers != NULL){
+		delete [] BGModelNumbers;
+		BGModelNumbers = NULL;
 	}
-	if(BGLowerBound1 != NULL){
-		delete [] BGLowerBound1;
-		BGLowerBound1 = NULL;
+	if(BGRefCounts != NULL){
+		delete [] (LONG*)BGRefCounts;
+		BGRefCounts = NULL;
 	}
-	if(BGUpperBound1 != NULL){
-		delete [] BGUpperBound1;
-		BGUpperBound1 = NULL;
+	if(slotBGGenerations != NULL){
+		delete [] slotBGGenerations;
+		slotBGGenerations = NULL;
+	}
+	if(slotBGRequests != NULL){
+		delete [] slotBGRequests;
+		slotBGRequests = NULL;
 	}
 }
 
@@ -2022,26 +3482,62 @@ void ufmfWriter::deallocateThreadStuff(){
 		compressionThreadReadySignals = NULL;
 	}
 
-	 if(compressionThreadStartSignals != NULL){
-		 for(i = 0; i < (int)nThreads; i++){
-			 if(compressionThreadStartSignals[i]){
-				 CloseHandle(compressionThreadStartSignals[i]);
-				 compressionThreadStartSignals[i] = NULL;
+	if(parkSignals != NULL){
+		for(i = 0; i < (int)nThreads; i++){
+			if(parkSignals[i]){
+				CloseHandle(parkSignals[i]);
+				parkSignals[i] = NULL;
+			}
+		}
+		delete [] parkSignals;
+		parkSignals = NULL;
+	}
+
+	 if(slotFreeSignal != NULL){
+		 CloseHandle(slotFreeSignal);
+		 slotFreeSignal = NULL;
+	 }
+
+	 if(bufferFreeSignal != NULL){
+		 CloseHandle(bufferFreeSignal);
+		 bufferFreeSignal = NULL;
+	 }
+
+	 if(slotQueuedSignal != NULL){
+		 CloseHandle(slotQueuedSignal);
+		 slotQueuedSignal = NULL;
+	 }
+
+	 if(slotDoneSignals != NULL){
+		 for(i = 0; i < (int)nSlots; i++){
+			 if(slotDoneSignals[i]){
+				 CloseHandle(slotDoneSignals[i]);
+				 slotDoneSignals[i] = NULL;
 			 }
 		 }
-		 delete [] compressionThreadStartSignals;
-		 compressionThreadStartSignals = NULL;
+		 delete [] slotDoneSignals;
+		 slotDoneSignals = NULL;
 	 }
 
-	 if(compressionThreadDoneSignals != NULL){
-		 for(i = 0; i < (int)nThreads; i++){
-			 if(compressionThreadDoneSignals[i]){
-				 CloseHandle(compressionThreadDoneSignals[i]);
-				 compressionThreadDoneSignals[i] = NULL;
+	 if(writeThreadStopSignal != NULL){
+		 CloseHandle(writeThreadStopSignal);
+		 writeThreadStopSignal = NULL;
+	 }
+
+	 if(reserveTurnSignals != NULL){
+		 for(i = 0; i < (int)nSlots; i++){
+			 if(reserveTurnSignals[i]){
+				 CloseHandle(reserveTurnSignals[i]);
+				 reserveTurnSignals[i] = NULL;
 			 }
 		 }
-		 delete [] compressionThreadDoneSignals;
-		 compressionThreadDoneSignals = NULL;
+		 delete [] reserveTurnSignals;
+		 reserveTurnSignals = NULL;
+	 }
+
+	 if(slotWaitingToReserve != NULL){
+		 delete [] slotWaitingToReserve;
+		 slotWaitingToReserve = NULL;
 	 }
 
 	 if(lock){
@@ -2054,6 +3550,38 @@ void ufmfWriter::deallocateThreadStuff(){
 		 keyFrameWritten = NULL;
 	 }
 
+	 if(_bgThread != NULL){
+		 CloseHandle(_bgThread);
+		 _bgThread = NULL;
+	 }
+	 if(bgThreadReadySignal != NULL){
+		 CloseHandle(bgThreadReadySignal);
+		 bgThreadReadySignal = NULL;
+	 }
+	 if(bgThreadStartSignal != NULL){
+		 CloseHandle(bgThreadStartSignal);
+		 bgThreadStartSignal = NULL;
+	 }
+	 if(bgThreadStopSignal != NULL){
+		 CloseHandle(bgThreadStopSignal);
+		 bgThreadStopSignal = NULL;
+	 }
+	 if(BGGenerationFreeSignal != NULL){
+		 CloseHandle(BGGenerationFreeSignal);
+		 BGGenerationFreeSignal = NULL;
+	 }
+	 if(BGQueueFilledSignals != NULL){
+		 for(int j = 0; j < BGQUEUELENGTH; j++){
+			 if(BGQueueFilledSignals[j] != NULL){
+				 CloseHandle(BGQueueFilledSignals[j]);
+				 BGQueueFilledSignals[j] = NULL;
+			 }
+		 }
+		 // allocated with the other request buffers, but freed here, after its handles are closed
+		 delete [] BGQueueFilledSignals;
+		 BGQueueFilledSignals = NULL;
+	 }
+
 	 if(stats){
 		 delete stats;
 		 stats = NULL;
@@ -1,13 +1,31 @@
 #ifndef __UFMFWRITER_H
 #define __UFMFWRITER_H
 
-#include "windows.h"
+#include "ufmfPlatform.h"
 #include "ufmfWriterStats.h"
 #include "ufmfLogger.h"
+#include "ufmfOutput.h"
+#include "ufmfIndex.h"
+#include "ufmfQueue.h"
 #include <vector>
 #include <math.h>
 #include <time.h>
 #define MAXWAITTIMEMS 10000
+#define BGQUEUELENGTH 8 // max number of frames waiting to be added to the background model
+#define UFMFCHECKPOINTMAGIC "ufmfckpt" // marks both ends of a checkpoint chunk, 8 characters
+#define THREADHEADROOM 1.5 // adaptive threads: keep this many times the compression threads the frame rate needs awake
+#define THREADPARKFRAMES 100 // adaptive threads: frames in a row that need fewer threads awake before one is parked
+
+// called by addFrameNoCopy's writer once it is done with a lent frame, from one of its own threads,
+// or from tryAddFrameNoCopy itself if the frame is dropped
+typedef void (*ufmfFrameReleaseCallback)(void * context, unsigned char * frame);
+
+// what tryAddFrame does when every slot is still in use after its timeout
+typedef enum {
+	UFMF_OVERLOAD_DROP_NEWEST = 0, // drop the frame being added
+	UFMF_OVERLOAD_DROP_OLDEST, // drop the oldest frame no compression thread has started on, and give its buffer to the frame being added
+	UFMF_OVERLOAD_WRITE_RAW // store frames without background subtraction until half the buffers are free again, so the compression threads catch up. the frame being added is dropped unless a buffer has come free
+} ufmfOverloadPolicy;
 
 class BackgroundModel {
 
@@ -15,10 +33,11 @@ public:
 
 	void init();
 	BackgroundModel();
-	BackgroundModel(unsigned __int32 nPixels, int minNFramesReset = 200);
+	BackgroundModel(unsigned __int32 nPixels, int minNFramesReset = 200, bool incrementalMedian = false);
 	~BackgroundModel();
 	bool addFrame(unsigned char * im, double timestamp);
 	bool updateModel();
+	const float * getBGCenter(); // the model as of the last updateModel, one value per pixel
 
 private:
 
@@ -27,6 +46,8 @@ private:
 	int BGNBins;
 	int BGBinSize;
 	float BGHalfBin;
+	int BGCountsStride; // bytes between the counts of consecutive pixels (BGNBins padded to an odd number of cache lines)
+	bool incrementalMedian; // whether to track the median bin per pixel instead of rescanning the counts at each update
 
 	int nPixels; // frame size
 
@@ -34,9 +55,11 @@ private:
 	unsigned __int64 nFramesAdded; // Number of frames added to the background model
 
 	// buffers
-	unsigned __int8 ** BGCounts; // counts per bin: note the limited resolution
+	unsigned __int8 * BGCounts; // counts per bin: note the limited resolution. one aligned block, BGCountsStride bytes per pixel
 	float * BGCenter; // current background model
 	float BGZ;
+	unsigned __int8 * BGMedianBin; // incremental median only: median bin at the last update, per pixel
+	unsigned __int16 * BGBelow; // incremental median only: sum of the counts in the bins below BGMedianBin, per pixel
 
 	friend class ufmfWriter;
 
@@ -49,17 +72,48 @@ public:
 
 	void init();
 	CompressedFrame();
-	CompressedFrame(unsigned short wWidth, unsigned short wHeight, unsigned __int32 boxLength = 30, double maxFracFgCompress = 1.0);
+	CompressedFrame(unsigned short wWidth, unsigned short wHeight, unsigned __int32 boxLength = 30, double maxFracFgCompress = 1.0, int nBands = 1);
 	bool setData(unsigned __int8 * im, double timestamp, unsigned __int64, 
 		unsigned __int8 * BGLowerBound, unsigned __int8 * BGUpperBound);
 	~CompressedFrame();
 
 private:
 
+	// threshold the rows of one band and find its boxes
+	void compressBand(int band);
+
+	// store the box with corner at (r,c), clipped so that it doesn't overlap pixels already written
+	// and doesn't extend past row rowEnd. box nBoxes and data at nPx are written, and both are advanced
+	void addBox(unsigned __int8 * im, int r, int c, int rowEnd, unsigned __int32 &nBoxes, int &nPx);
+
+	// store the rectangle with corner at (r,c) that covers the foreground run starting there
+	// and the rows below it that have foreground in the same columns. same arguments as addBox
+	void addMergedBox(unsigned __int8 * im, int r, int c, int rowEnd, unsigned __int32 &nBoxes, int &nPx);
+
+	// split the rows into nBands bands
+	void setBandRows();
+
+	// boxes are clipped at the top of each band. redo the boxes from the first one that stops there,
+	// as a single band would find them, until they reach past a row in the band just like the band's
+	// own do. from that row on the band's own boxes are the same, so they are appended
+	void mergeSeam(int band);
+
+	// whether the redone boxes firstRedone to endRedone-1 reach past row r exactly as the band's
+	// own boxes, saved in the seam buffers, do
+	bool seamAgrees(int r, unsigned __int32 firstRedone, unsigned __int32 endRedone, unsigned __int32 nSaved);
+
+	// mark the rows of the box at (r,c) from rowStart on as written
+	void markBoxWritten(int r, int c, int width, int height, int rowStart);
+
+	// band threads: compress bands 1 through nBands-1 while the calling thread does band 0
+	static DWORD WINAPI bandThread(void* param);
+	void stopBandThreads();
+
 	unsigned short wWidth; //Image Width
 	unsigned short wHeight; //Image Height
 	int nPixels;
-	bool * isFore; // whether each pixel is foreground or not
+	unsigned __int64 * isFore; // foreground mask: pixel (r,c) is bit c%64 of isFore[r*foreStride + c/64]
+	int foreStride; // 64-bit words per row of isFore
 	int numFore;
 	int numPxWritten;
 	bool isCompressed;
@@ -69,16 +123,44 @@ private:
 	unsigned __int16 * writeHeightBuffer; // heights
 	unsigned __int16 * writeWidthBuffer; // widths
 	unsigned __int8 * writeDataBuffer; // image data
-	unsigned __int16 * nWrites; // number of times a pixel has been written
+	unsigned __int64 * isWritten; // whether each pixel has been written, same layout as isFore
 	unsigned __int32 ncc;
 	double timestamp;
 	unsigned __int64 frameNumber;
+	unsigned __int8 * chunkBuffer; // the frame serialized as a FRAMECHUNK, written with one write
+	unsigned __int64 chunkLength; // bytes used in chunkBuffer
+	unsigned __int64 chunkBufferSize; // bytes allocated for chunkBuffer
+	unsigned __int64 fileOffset; // mapped output: where the chunk was copied to in the file
 
 	// parameters
 	unsigned __int32 boxLength; // length of boxes of foreground pixels to store
 	int boxArea; // boxLength^2
 	double maxFracFgCompress; // max fraction of pixels that can be foreground in order for us to compress
 	int maxNFgCompress; // max number of pixels that can be foreground in order for us to compress
+	bool countAllFore; // whether numFore must be exact for frames that are too busy to compress (for stats)
+	bool mergeBoxes; // whether to store merged rectangles of any size instead of boxes of at most boxLength
+	int nBands; // number of horizontal bands compressed in parallel
+
+	// band state. band b covers rows bandRowStarts[b] to bandRowStarts[b+1]-1, and its boxes and data
+	// are found at index bandRowStarts[b]*wWidth of the write buffers until they are merged
+	int * bandRowStarts;
+	int * bandNumFore; // foreground pixels in each band
+	unsigned __int32 * bandNcc; // boxes in each band
+	int * bandNumPxWritten; // pixels written in each band
+	unsigned __int8 * bandIm; // frame being compressed
+	unsigned __int8 * bandLowerBound; // background model it is compressed with
+	unsigned __int8 * bandUpperBound;
+	HANDLE * bandThreads;
+	HANDLE * bandStartSignals; // signals to band threads to start compressing their band
+	HANDLE * bandDoneSignals; // signals that band threads are set up or have finished their band
+	int bandThreadCount; // number of band threads started
+	bool bandThreadsStopping; // whether band threads should exit
+	unsigned __int64 * isForeOrig; // foreground mask as thresholded, before boxes clear it; only with several bands
+	unsigned __int16 * seamRowBuffer; // a band's own boxes while the seam above it is merged
+	unsigned __int16 * seamColBuffer;
+	unsigned __int16 * seamWidthBuffer;
+	unsigned __int16 * seamHeightBuffer;
+	unsigned __int32 seamBufferSize; // boxes allocated in the seam buffers
 
 
 	friend class ufmfWriter;
@@ -153,11 +235,29 @@ public:
 	// deallocate buffers
 	// write footers
 	// close file
+	// returns the number of frames written, 0 if the movie could not be finished
 	unsigned __int64 stopWrite();
 
 	// add a frame to be processed
 	bool addFrame(unsigned char * frame, double timestamp, unsigned __int64 nFramesDroppedExternal=0, unsigned __int64 nFramesBufferedExternal=0);
 
+	// add a frame without copying it. the writer reads frame in place until it calls release(releaseContext,frame),
+	// so the caller must leave it alone until then. every frame added is released, by stopWrite at the latest,
+	// unless stopWrite fails because the writer's threads couldn't be waited for.
+	// frames are not taken if it returns false
+	bool addFrameNoCopy(unsigned char * frame, double timestamp, ufmfFrameReleaseCallback release, void * releaseContext,
+		unsigned __int64 nFramesDroppedExternal=0, unsigned __int64 nFramesBufferedExternal=0);
+
+	// add a frame, waiting at most timeoutMS for a free buffer instead of failing after MAXWAITTIMEMS.
+	// if there is still none, the overload policy decides which frame is dropped, if any.
+	// false only on error: a dropped frame is not an error
+	bool tryAddFrame(unsigned char * frame, double timestamp, DWORD timeoutMS=0,
+		unsigned __int64 nFramesDroppedExternal=0, unsigned __int64 nFramesBufferedExternal=0);
+
+	// tryAddFrame without copying, as addFrameNoCopy. a frame that is dropped is released before this returns
+	bool tryAddFrameNoCopy(unsigned char * frame, double timestamp, ufmfFrameReleaseCallback release, void * releaseContext,
+		DWORD timeoutMS=0, unsigned __int64 nFramesDroppedExternal=0, unsigned __int64 nFramesBufferedExternal=0);
+
 	// set video file name, width, height
 	// todo: resize buffers if already allocated
 	void setVideoParams(char * fileName, int wWidth, int wHeight);
@@ -169,7 +269,10 @@ public:
 	void setStatsParams(const char * statsName);
 
     // get number of frames written
-	unsigned __int64 NumWritten() { return nWritten; }
+	unsigned __int64 NumWritten() { return nWritten - nFramesSkipped; }
+
+	// get number of frames dropped because the writer was overloaded
+	unsigned __int64 NumDropped() { return nFramesDroppedOverload; }
 
 private:
 
@@ -177,25 +280,85 @@ private:
 
 	// *** writing tools ***
 
-	// write a frame
+	// add a frame to the write batch and the index. returns its size in bytes
 	__int64 writeFrame(CompressedFrame * im);
 
+	// write the frames in the write batch with one write. call before anything else is written
+	bool flushFrames();
+
+	// hand frame to a compression thread, copying it unless release is set. waits timeoutMS for a
+	// free buffer, then fails, or if canDrop is set applies the overload policy
+	bool queueFrame(unsigned char * frame, double timestamp, ufmfFrameReleaseCallback release, void * releaseContext,
+		unsigned __int64 nFramesDroppedExternal, unsigned __int64 nFramesBufferedExternal, DWORD timeoutMS, bool canDrop);
+
+	// every buffer is in use: apply the overload policy. returns the buffer it got for the frame
+	// being added, which has been taken, or -1 if that frame has to be dropped
+	int makeRoom();
+
+	// drop the oldest frame waiting for a compression thread and return its buffer, -1 if there is none
+	int dropOldestQueuedFrame();
+
+	// take a free buffer, waiting at most timeoutMS for one. -1 if there is none
+	int takeFreeBuffer(DWORD timeoutMS);
+
+	// adaptive threads: after timestamp's frame is queued, wake compression threads if the frame
+	// rate and compress time need more, or park one if fewer have been enough for a while
+	void scaleThreads(double timestamp);
+
+	// give the frame in slot back to the caller if it was lent
+	void releaseFrame(int slot);
+
+	// serialize a compressed frame into its chunk buffer, so that it can be written with one write
+	bool serializeFrame(CompressedFrame * im);
+
+	// mapped output: reserve space for the frame in slot in frame order,
+	// after its keyframe if it needs one, and copy it in
+	bool copyFrameToMappedOutput(int slot);
+
+	// mapped output, with the lock held: move the turn to reserve on from the frame that had it,
+	// past any dropped frames, and wake the thread of the next frame if it is waiting
+	void passReserveTurn();
+
 	// write the video header
 	bool writeHeader();
 
+	// open the file for the movie or a segment of it and write its header
+	bool openSegment(const char * segmentFileName);
+
+	// whether the current segment is full, so that im starts the next one
+	bool segmentIsFull(CompressedFrame * im);
+
+	// finish the current segment and open the next one
+	bool startNextSegment();
+
 	// finish writing
 	bool finishWriting();
 
 	// write a background keyframe to file
 	bool writeBGKeyFrame(float* BGCenter,double keyframeTimestamp);
 
+	// write the index entries added since the last checkpoint, so that a crashed movie can be recovered
+	bool writeCheckpoint();
+
 	// *** compression tools ***
 
+	// decide whether the frame going into slot should be added to the background model and whether
+	// a new model should be computed, and hand that work to the background thread. the first model
+	// is queued like the others, and frames added before it is published are stored raw
+	bool queueBGModelWork(double timestamp, unsigned __int64 frameNumber, int slot);
+
+	// copy the frame in slot to the background thread's queue if it asked for it
+	void copyFrameToBGQueue(int slot);
+
+	// drop a frame's pin on background model generation g, waking the background thread if it
+	// may be waiting for g
+	void unpinBGGeneration(int g);
+
 	// add to bg model counts
-	bool addToBGModel(unsigned __int8 * frame, double timestamp, unsigned __int64 frameNumber);
+	bool addToBGModel(unsigned __int8 * frame, double timestamp);
 
 	// reset background model
-	bool updateBGModel(unsigned __int8 * frame, double timestamp, unsigned __int64 frameNumber);
+	bool updateBGModel(double timestamp);
 
 	// *** threading tools ***
 
@@ -205,10 +368,16 @@ private:
 	// start compression thread
 	static DWORD WINAPI compressionThread(void* param);  //compression function declaration
 
-	// compress frame with thread threadIndex 
+	// start background model thread
+	static DWORD WINAPI bgThread(void* param);  //background model function declaration
+
+	// process the next queued background model request
+	bool ProcessNextBGRequest();
+
+	// compress the next frame waiting in a slot with thread threadIndex
 	bool ProcessNextCompressFrame(int threadIndex);
 
-	// write next frame
+	// write the next frame, and every frame after it that is already compressed
 	bool ProcessNextWriteFrame();
 
 	// stop all threads
@@ -234,48 +403,103 @@ private:
 
 	// *** output ufmf state ***
 
-	FILE * pFile; //File Target
+	ufmfOutput * output; //File Target
+	bool mappedOutput; // whether output is mapped, so that compression threads copy frames into it
+	char segmentFileName[1000]; // file the current segment is written to
+	int segmentNumber; // number of the current segment, 0 for the first
+	unsigned __int64 nFramesPrevSegments; // frames written to earlier segments
+	double segmentStartTime; // timestamp of the first frame of the current segment
 	unsigned __int64 indexLocation; // Location of index in file
 	unsigned __int64 indexPtrLocation; // Location in file of pointer to index location
-	std::vector<__int64> index; // Location of each frame in the file
-	std::vector<__int64> meanindex; // Location of each bg center in the file
-	std::vector<double> index_timestamp; // timestamp of each frame in the file
-	std::vector<double> meanindex_timestamp; // timestamp for each bg center in the file
+	ufmfIndex * index; // Location and timestamp of each frame in the file
+	ufmfIndex * meanindex; // Location and timestamp of each bg center in the file
+	unsigned __int64 lastCheckpointLocation; // Location of the last checkpoint chunk, 0 if none
+	unsigned __int64 nFramesCheckpointed; // frames in the index up to the last checkpoint
+	unsigned __int64 nKeyFramesCheckpointed; // keyframes in the index up to the last checkpoint
 
 	// *** writing state ***
 
-	unsigned __int64 nGrabbed; // Number of frames for which addframe  has been called
-	unsigned __int64 nWritten; //Track number of frames written to disk
+	volatile unsigned __int64 nGrabbed; // Number of frames for which addframe  has been called
+	volatile unsigned __int64 nWritten; //Track number of frames written to disk
 	unsigned __int64 nBGKeyFramesWritten; // Number of background images written
 	unsigned __int64 nFramesDroppedExternal; // Number of frames dropped by the external process
 	unsigned __int64 nFramesBufferedExternal; // Number of frames buffered by the external process
-	bool isWriting; // Whether we are still compressing, still writing
+	volatile bool isWriting; // Whether we are still compressing, still writing
+	volatile unsigned __int64 nFramesDroppedOverload; // Number of frames the overload policy dropped; only changed by the thread adding frames
+	unsigned __int64 nFramesSkipped; // Number of those that had a frame number and were skipped by the write thread
+	volatile LONG writingRaw; // whether the overload policy has frames stored without background subtraction
 
 	// *** threading/buffering state ***
 
+	// frames in flight are held in a ring of nSlots slots: frame n is in slot (n-1) % nSlots.
+	// addFrame fills slots in order, any compression thread compresses the next filled slot,
+	// and the write thread waits on the slot of the next frame only, then writes it together with
+	// the run of compressed frames after it and frees their slots.
+	// each frame's pixels and compressed chunk are in one of nBuffers buffers, which the slot
+	// points to. buffers are taken from freeBuffers when a frame is added and given back when it
+	// has been written, except that a frame dropped from the queue gives its buffer straight to
+	// the frame that replaces it. its slot stays in the ring until the write thread skips it, so
+	// with UFMF_OVERLOAD_DROP_OLDEST there are twice as many slots as buffers
+	// handing a frame on doesn't take the lock: slots go through compressQueue, the counters
+	// are updated with interlocked operations, and the semaphores only wake waiting threads
+
 	// buffer for grabbed, uncompressed frames
 	unsigned char ** uncompressedFrames;
+	// buffer of the frame in each slot
+	int * slotBuffers;
+	// buffers no frame is using
+	ufmfQueue * freeBuffers;
+	// frame in each slot: its uncompressedFrames buffer, or a frame lent by the caller
+	unsigned char ** slotFrames;
+	// how to give back each slot's lent frame, NULL if it is not lent or has been given back
+	ufmfFrameReleaseCallback * slotReleaseCallbacks;
+	void ** slotReleaseContexts;
 	// timestamps of buffered frames
-	double * threadTimestamps;
+	double * slotTimestamps;
 	// buffer for compressed frames
 	CompressedFrame ** compressedFrames;
-	// buffers grabbed while waiting for the next frame to write
-	int * readyToWrite;
-	// number of uncompressed frames buffered
-	int nUncompressedFramesBuffered;
+	// filled slots waiting for a compression thread, in frame order
+	ufmfQueue * compressQueue;
 	// number of compressed frames buffered
-	int nCompressedFramesBuffered;
-	unsigned __int64 * threadFrameNumbers; // which grabbed frame is processed by each thread -- used for writing frames in order
+	volatile LONG nCompressedFramesBuffered;
+	unsigned __int64 * slotFrameNumbers; // which grabbed frame is in each slot
+	unsigned __int64 * slotDroppedFrames; // last frame dropped from each slot after it was queued, 0 for none
+	// frames the write thread has indexed but not yet written. their chunks stay in their
+	// slots until the batch is flushed
+	const void ** writeBatchData;
+	unsigned __int64 * writeBatchBytes;
+	int nWriteBatch;
+	unsigned __int64 writeBatchLength; // bytes in the write batch
 
 	HANDLE _writeThread; // write ThreadVariable
 	DWORD _writeThreadID; //write thread ID returned by Windows
 	HANDLE* _compressionThreads; // compression ThreadVariables
 	DWORD* _compressionThreadIDs; //compression thread IDs returned by Windows
 	int threadCount; // current number of compression threads
+	// adaptive threads: compression threads from nActiveThreads up wait on their parkSignals
+	// instead of the queue. only the thread adding frames changes nActiveThreads
+	volatile LONG nActiveThreads; // compression threads awake
+	HANDLE * parkSignals; // wake each parked compression thread
+	volatile LONG compressTicksEstimate; // smoothed time to compress a frame, in 100 ns ticks
+	double frameIntervalEstimate; // smoothed seconds between frames added
+	double lastAddedTimestamp; // timestamp of the last frame added, -1 for none
+	int nFramesOverProvisioned; // frames in a row that needed fewer threads than are awake
 	HANDLE writeThreadReadySignal; // signal that write thread is set up
-	HANDLE * compressionThreadReadySignals; // signals that compression threads are set up and ready to process a frame
-	HANDLE * compressionThreadStartSignals; // signals to compression threads to start processing a frame
-	HANDLE* compressionThreadDoneSignals; // signal that the compression frame has finished processing a frame and the frame is ready to be written
+	HANDLE _bgThread; // background model ThreadVariable
+	DWORD _bgThreadID; // background model thread ID returned by Windows
+	HANDLE bgThreadReadySignal; // signal that background model thread is set up
+	HANDLE bgThreadStartSignal; // counts requests queued for the background model thread
+	HANDLE bgThreadStopSignal; // tells the background model thread to stop waiting for a frame to be copied
+	HANDLE BGGenerationFreeSignal; // signal that a generation other than the current one is no longer pinned
+	HANDLE * compressionThreadReadySignals; // signals that compression threads are set up
+	HANDLE slotFreeSignal; // counts slots addFrame can fill
+	HANDLE bufferFreeSignal; // counts buffers in freeBuffers
+	HANDLE slotQueuedSignal; // counts filled slots waiting for a compression thread, plus stop requests
+	HANDLE * slotDoneSignals; // signal that the frame in each slot has been compressed and is ready to be written
+	HANDLE writeThreadStopSignal; // tells the write thread to stop once it has written every compressed frame
+	HANDLE * reserveTurnSignals; // mapped output: signals to the compression thread working on each slot that its frame is next to reserve file space
+	bool * slotWaitingToReserve; // mapped output: whether the thread working on each slot is waiting for its turn to reserve
+	unsigned __int64 nextFrameToReserve; // mapped output: next frame to reserve file space
 	HANDLE lock; // semaphore for keeping different threads from accessing the same global variables at the same time
 
 	HANDLE keyFrameWritten; // whether the last computed key frame has been written
@@ -287,17 +511,31 @@ private:
 	double lastBGUpdateTime; // last time the background was updated
 	double lastBGKeyFrameTime; // last time a keyframe was written
 	BackgroundModel * bg;
-	// lower and upper bounds available for thresholding
-	unsigned __int8 * BGLowerBound0; // per-pixel lower bound on background
-	unsigned __int8 * BGUpperBound0; // per-pixel upper bound on background
-	float * BGCenter0; 
-	unsigned __int8 * BGLowerBound1; // per-pixel lower bound on background
-	unsigned __int8 * BGUpperBound1; // per-pixel upper bound on background
-	float * BGCenter1; 
-	unsigned __int64 minFrameBGModel0; // first frame that can be used with background model 0
-	unsigned __int64 minFrameBGModel1; // first frame that can be used with background model 1
-	double keyframeTimestamp0; // timestamp for key frame in buffer 0
-	double keyframeTimestamp1; // timestamp for key frame in buffer 1
+	// ring of nBGModels background model generations available for thresholding. a generation
+	// can be reused once no frame pins it and it is not the current one
+	unsigned __int8 ** BGLowerBounds; // per-pixel lower bound on background for each generation
+	unsigned __int8 ** BGUpperBounds; // per-pixel upper bound on background for each generation
+	float ** BGCenters; // background model for each generation
+	double * BGKeyFrameTimestamps; // timestamp for the key frame of each generation
+	unsigned __int64 * BGModelNumbers; // which published model is stored in each generation, used to write each keyframe once
+	volatile LONG * BGRefCounts; // number of frames added but not yet written using each generation
+	volatile LONG BGCurrentGeneration; // generation used for newly added frames, -1 until the first model is published
+	int * slotBGGenerations; // generation pinned by the frame in each slot
+	unsigned __int64 nBGModelsPublished; // number of background models computed by the background thread
+	unsigned __int64 lastBGModelNumberWritten; // model number of the last keyframe written; only touched by the write thread
+
+	// requests for the background thread: a ring of BGQUEUELENGTH slots filled by addFrame
+	unsigned __int8 ** BGQueueFrames; // copies of frames to add to the counts, made by the compression threads
+	HANDLE * BGQueueFilledSignals; // signal that the frame for each request has been copied
+	int * slotBGRequests; // request the frame in each slot is to be copied to, -1 if none
+	double * BGQueueTimestamps; // timestamp of the frame for each request
+	bool * BGQueueAddFrame; // whether to add the frame to the counts
+	bool * BGQueueUpdate; // whether to compute a new background model after that
+	int BGQueueHead; // next slot the background thread will process; only touched by the background thread
+	int BGQueueTail; // next slot addFrame will fill; only touched by addFrame
+	int nBGRequestsBuffered; // number of slots in use
+	unsigned __int64 nBGKeyFramesQueued; // number of new background models requested
+	unsigned __int64 nBGFramesDropped; // number of background samples skipped because the queue was full
 	//unsigned __int8 ** BGCounts; // counts per bin: note the limited resolution
 	//float * BGCenter; // current background model
 	//unsigned __int8 * BGLowerBound; // per-pixel lower bound on background
@@ -315,6 +553,10 @@ private:
 	// *** threading parameters ***
 
 	unsigned __int32 nThreads; // number of compression threads
+	unsigned __int32 minThreads; // compression threads always awake. if fewer than nThreads, the others are parked while they aren't needed
+	unsigned __int32 nBuffers; // number of frames that can be in flight, at least nThreads
+	unsigned __int32 nSlots; // slots in the ring of frames in flight: nBuffers, or twice that if frames can be dropped from the queue
+	ufmfOverloadPolicy overloadPolicy; // what tryAddFrame drops when every slot is in use
 
 	// *** video parameters ***
 
@@ -338,6 +580,8 @@ private:
 	int BGKeyFramePeriodInitLength;
 	int nBGUpdatesPerKeyFrame;
 	float MaxBGZ;
+	bool BGIncrementalMedian; // whether the background model tracks the per-pixel median incrementally
+	unsigned __int32 nBGModels; // number of background model generations that can be in use at once
 	//int BGBinSize;
 	//int BGNBins; 
 	//float BGHalfBin;
@@ -345,12 +589,29 @@ private:
 	// * ufmf parameters *
 	unsigned __int8 isFixedSize; // whether patches are of a fixed size
 	unsigned __int32 boxLength; // length of boxes of foreground pixels to store
+	bool mergeBoxes; // whether to merge adjacent foreground into rectangles of any size
 	double maxFracFgCompress; // max fraction of pixels that can be foreground in order for us to compress
+	int nBands; // number of bands each frame is split into and compressed in parallel
+
+	// * output parameters *
+	unsigned __int32 outputBlockMB; // size of the blocks output is written in
+	int nOutputBlocks; // number of output blocks
+	bool outputUnbuffered; // whether output bypasses the system cache
+	ufmfOutputBackend outputBackend; // how output is written
+	unsigned __int32 outputPreallocateMB; // space reserved for the file when it is created
+	char outputTargets[4096]; // directories output is striped across, separated by commas. empty for the movie's directory
+	bool stripeSegments; // whether whole segments go to the targets in turn, rather than each file being striped
+	unsigned __int32 indexSpillEntries; // index entries kept in memory before older ones are spilled to a file
+	unsigned __int32 checkpointFrames; // frames between index checkpoints, 0 for none
+	unsigned __int32 segmentFrames; // max frames per segment file, 0 for no limit
+	double segmentSeconds; // max seconds per segment file, 0 for no limit
+	unsigned __int32 segmentMB; // size at which a segment file is ended, 0 for no limit
 
 	// chunk identifiers
 	static const unsigned __int8 KEYFRAMECHUNK = 0;
 	static const unsigned __int8 FRAMECHUNK = 1;
 	static const unsigned __int8 INDEX_DICT_CHUNK = 2;
+	static const unsigned __int8 CHECKPOINT_CHUNK = 3;
 
 	// *** statistics parameters ***
 	char statFileName[256];
@@ -35,6 +35,7 @@ typedef enum {
 	UTT_WAIT_FOR_UNCOMPRESSED_FRAME,
 	UTT_WAIT_FOR_COMPRESSED_FRAME,
 	UTT_STOP_WRITE,
+	UTT_WAIT_FOR_IO,
 	UTT_NUM_TIMINGS
 } ufmfTimingType;
 
@@ -63,6 +64,7 @@ class ufmfWriterStats {
 	double sumNumBoxesSquared;
 	double duration;
 	unsigned int numDropped;
+	unsigned __int64 numDroppedWriter; // frames the writer dropped because it was overloaded
 	double maxFPS, minFPS, sigFPS;
 	double sumFPS, sumFPSSquared;
 
@@ -105,10 +107,10 @@ public:
 
 	void printStreamHeader(){
 		logger->log(UFMF_DEBUG_3, "streamStart\n"); 
-		logger->log(UFMF_DEBUG_3, "frame,nFramesBuffered,timestamp,isCompressed,FPS,nFramesDropped,bytes,nForegroundPx,nPxWritten,nBoxes,meanPixelError,maxPixelError,maxFilterError");
+		logger->log(UFMF_DEBUG_3, "frame,nFramesBuffered,timestamp,isCompressed,FPS,nFramesDropped,nFramesDroppedWriter,bytes,nForegroundPx,nPxWritten,nBoxes,meanPixelError,maxPixelError,maxFilterError");
 		if(statPrintTimings){
-			                      // START_WRITING,    WRITE_HEADER,   WRITE_FOOTER,   ADD_FRAME,   UPDATE_BACKGROUND,   COMPUTE_BACKGROUND,   WRITE_KEYFRAME,   COMPUTE_FRAME,    WRITE_FRAME,   COMPUTE_STATS,       WAIT_FOR_COMPRESS_THREAD,     WAIT_FOR_UNCOMPRESSED_FRAME, WAIT_FOR_COMPRESSED_FRAME, UTT_STOP_WRITE
-			logger->log(UFMF_DEBUG_3,",startWritingTime,writeHeaderTime,writeFooterTime,addFrameTime,updateBackgroundTime,computeBackgroundTime,writeKeyFrameTime,compressFrameTime,writeFrameTime,computeStatisticsTime,waitForCompressionThreadTime,waitForUncompressedFrameTime,waitForCompressedFrameTime,stopWritingTime");
+			                      // START_WRITING,    WRITE_HEADER,   WRITE_FOOTER,   ADD_FRAME,   UPDATE_BACKGROUND,   COMPUTE_BACKGROUND,   WRITE_KEYFRAME,   COMPUTE_FRAME,    WRITE_FRAME,   COMPUTE_STATS,       WAIT_FOR_COMPRESS_THREAD,     WAIT_FOR_UNCOMPRESSED_FRAME, WAIT_FOR_COMPRESSED_FRAME, UTT_STOP_WRITE, WAIT_FOR_IO
+			logger->log(UFMF_DEBUG_3,",startWritingTime,writeHeaderTime,writeFooterTime,addFrameTime,updateBackgroundTime,computeBackgroundTime,writeKeyFrameTime,compressFrameTime,writeFrameTime,computeStatisticsTime,waitForCompressionThreadTime,waitForUncompressedFrameTime,waitForCompressedFrameTime,stopWritingTime,waitForIOTime");
 		}
 		logger->log(UFMF_DEBUG_3,"\n");
 	}
@@ -117,7 +119,7 @@ public:
 	}
 	void printSummaryHeader(){
 		logger->log(UFMF_DEBUG_0, "summaryStart\n"); 
-		logger->log(UFMF_DEBUG_0, "nFrames,nFramesDroppedTotal,nFramesUncompressed,nFramesNoBackSub,meanFPS,stdFPS,maxFPS,minFPS,meanBandWidth,maxBandWidth,meanFrameSize,stdFrameSize,maxFrameSize,meanCompressionRate,meanNForegroundPx,stdNForegroundPx,maxNForegroundPx,meanNPxWritten,stdNPxWritten,maxNPxWritten,meanNBoxes,stdNBoxes,maxNBoxes");
+		logger->log(UFMF_DEBUG_0, "nFrames,nFramesDroppedTotal,nFramesDroppedWriter,nFramesUncompressed,nFramesNoBackSub,meanFPS,stdFPS,maxFPS,minFPS,meanBandWidth,maxBandWidth,meanFrameSize,stdFrameSize,maxFrameSize,meanCompressionRate,meanNForegroundPx,stdNForegroundPx,maxNForegroundPx,meanNPxWritten,stdNPxWritten,maxNPxWritten,meanNBoxes,stdNBoxes,maxNBoxes");
 		for(int i = 0; i < NUM_FOREGROUND_BINS; i++){
 			logger->log(UFMF_DEBUG_0,",fracFramesWithFracFgPx>%f",foregroundThresholds[i]);
 		}
@@ -125,8 +127,8 @@ public:
 			logger->log(UFMF_DEBUG_0,",meanMeanPixelError,stdMeanPixelError,maxMeanPixelError,meanMaxPixelError,stdMaxPixelError,maxMaxPixelError,meanMaxFilterError,stdMaxFilterError,maxMaxFilterError");
 		}
 		if(statPrintTimings){
-			//                         startWritingTime,                                           writeHeaderTime,                                         writeFooterTime,                                         addFrameTime,                                   updateBackgroundTime,                                                   computeBackgroundTime,                                                     writeKeyFrameTime,                                             compressFrameTime,                                             writeFrameTime,                                       computeStatisticsTime,                                                     waitForCompressionThreadTime,                                                                   waitForUncompressedFrameTime,                                                                   waitForCompressedFrameTime,                                                               stopWritingTime
-			logger->log(UFMF_DEBUG_0,",meanStartWritingTime,maxStartWritingTime,nStartWritingCalls,meanWriteHeaderTime,maxWriteHeaderTime,nWriteHeaderCalls,meanWriteFooterTime,maxWriteFooterTime,nWriteFooterCalls,meanAddFrameTime,maxAddFrameTime,nAddFrameCalls,meanUpdateBackgroundTime,maxUpdateBackgroundTime,nUpdateBackgroundCalls,meanComputeBackgroundTime,maxComputeBackgroundTime,nComputeBackgroundCalls,meanWriteKeyFrameTime,maxWriteKeyFrameTime,nWriteKeyFrameCalls,meanCompressFrameTime,maxCompressFrameTime,nCompressFrameCalls,meanWriteFrameTime,maxWriteFrameTime,nWriteFrameCalls,meanComputeStatisticsTime,maxComputeStatisticsTime,nComputeStatisticsCalls,meanWaitForCompressionThreadTime,maxWaitForCompressionThreadTime,nWaitForCompressionThreadCalls,meanWaitForUncompressedFrameTime,maxWaitForUncompressedFrameTime,nWaitForUncompressedFrameCalls,meanWaitForCompressedFrameTime,maxWaitForCompressedFrameTime,nWaitForCompressedFrameCalls,meanStopWritingTime,maxStopWritingTime,nStopWritingCalls");
+			//                         startWritingTime,                                           writeHeaderTime,                                         writeFooterTime,                                         addFrameTime,                                   updateBackgroundTime,                                                   computeBackgroundTime,                                                     writeKeyFrameTime,                                             compressFrameTime,                                             writeFrameTime,                                       computeStatisticsTime,                                                     waitForCompressionThreadTime,                                                                   waitForUncompressedFrameTime,                                                                   waitForCompressedFrameTime,                                                               stopWritingTime,                                          waitForIOTime
+			logger->log(UFMF_DEBUG_0,",meanStartWritingTime,maxStartWritingTime,nStartWritingCalls,meanWriteHeaderTime,maxWriteHeaderTime,nWriteHeaderCalls,meanWriteFooterTime,maxWriteFooterTime,nWriteFooterCalls,meanAddFrameTime,maxAddFrameTime,nAddFrameCalls,meanUpdateBackgroundTime,maxUpdateBackgroundTime,nUpdateBackgroundCalls,meanComputeBackgroundTime,maxComputeBackgroundTime,nComputeBackgroundCalls,meanWriteKeyFrameTime,maxWriteKeyFrameTime,nWriteKeyFrameCalls,meanCompressFrameTime,maxCompressFrameTime,nCompressFrameCalls,meanWriteFrameTime,maxWriteFrameTime,nWriteFrameCalls,meanComputeStatisticsTime,maxComputeStatisticsTime,nComputeStatisticsCalls,meanWaitForCompressionThreadTime,maxWaitForCompressionThreadTime,nWaitForCompressionThreadCalls,meanWaitForUncompressedFrameTime,maxWaitForUncompressedFrameTime,nWaitForUncompressedFrameCalls,meanWaitForCompressedFrameTime,maxWaitForCompressedFrameTime,nWaitForCompressedFrameCalls,meanStopWritingTime,maxStopWritingTime,nStopWritingCalls,meanWaitForIOTime,maxWaitForIOTime,nWaitForIOCalls");
 		}
 		logger->log(UFMF_DEBUG_0,"\n");
 	}
@@ -171,6 +173,7 @@ public:
 		sumFrameSizeBytesSquared = sumForegroundPixelsSquared = sumNumWrittenSquared = sumNumBoxesSquared = 0;
 		maxFPS = -1.0; minFPS = 999999;
 		sumFPS = 0.0; sumFPSSquared = 0;
+		numDropped = 0; numDroppedWriter = 0;
 
 		foregroundThresholds[0] = .05;  foregroundThresholds[1] = .1; foregroundThresholds[2] = .25;
 		foregroundBinCounts[0] = foregroundBinCounts[1] = foregroundBinCounts[2] = 0;
@@ -187,7 +190,7 @@ public:
 
 		const char *updateNames[UTT_NUM_TIMINGS] = { "none", "Start Writing", "Write Header", "Write Footer", "Add Frame", "Update Background", "Compute Background", 
 													 "Write Key Frame", "Compress Frame", "Write Frame", "Compute Statistics", "Wait For Compression Thread", 
-													 "Wait For Uncompressed Frame", "Wait For Compressed Frame", "Stop Writing" };
+													 "Wait For Uncompressed Frame", "Wait For Compressed Frame", "Stop Writing", "Wait For IO" };
 		for(int i = 0; i < UTT_NUM_TIMINGS; i++) {
 			timings[i].sum = timings[i].maxDur = timings[i].lastDur = 0;
 			timings[i].num = 0;
@@ -233,33 +236,37 @@ public:
 		if(box_err) delete [] box_err;
 	}
 	
-	// Call this on every frame written to update stats
-	void update(std::vector<__int64> &index, std::vector<double> &index_timestamp, _int64 frameSize, bool isCompressedFrame, int numForeground, int numWritten, int numBoxes, 
-				unsigned __int64 numBuffered, unsigned __int64 numDropped, unsigned short *nWrites, int numPixels, unsigned __int8 *frame, float *background, 
+	// Call this on every frame written to update stats. index and index_timestamp hold the most recent
+	// frames, starting from frame indexBase
+	void update(std::vector<__int64> &index, std::vector<double> &index_timestamp, unsigned __int64 indexBase, _int64 frameSize, bool isCompressedFrame, int numForeground, int numWritten, int numBoxes, 
+				unsigned __int64 numBuffered, unsigned __int64 numDropped, unsigned __int64 numDroppedWriter, const unsigned __int64 *isWritten, int isWrittenStride, int numPixels, unsigned __int8 *frame, float *background, 
 				ufmfDebugLevel level) {
 
 		if(numFrames == 0 && index_timestamp.size() > 0) { startTime = index_timestamp[0]; }
-		unsigned int beg = numFrames;
+		// position of the current frame in index
+		unsigned int last = numFrames - (unsigned int)indexBase;
+		unsigned int beg = last;
 		int i;
 		double bandwidth=0;
 		//__int64 frameSize=0;
 		double currTime = 0;
 
 		this->numDropped = numDropped;
+		this->numDroppedWriter = numDroppedWriter;
 		
 		// Find the frame BANDWIDTH_COMPUTATION_TIME_WINDOW_SEC seconds backwards in time to compute the bandwidth
 		// maxBytesPerSec: the maximum number of bytes written per second, smoothed over 
 		// windows of length BANDWIDTH_COMPUTATION_TIME_WINDOW_SEC
-		assert(numFrames == index.size()-1);
+		assert(last == index.size()-1);
 		// find the frame more than BANDWIDTH_COMPUTATION_TIME_WINDOW_SEC seconds before the current frame
-		while(beg > 0 && index_timestamp[beg] > index_timestamp[numFrames]-BANDWIDTH_COMPUTATION_TIME_WINDOW_SEC)
+		while(beg > 0 && index_timestamp[beg] > index_timestamp[last]-BANDWIDTH_COMPUTATION_TIME_WINDOW_SEC)
 			beg--;
 		bandwidth = -1;
 		// how long ago was this frame?
-		double dt = beg < numFrames ? (index_timestamp[numFrames]-index_timestamp[beg]) : 0;
+		double dt = beg < last ? (index_timestamp[last]-index_timestamp[beg]) : 0;
 		if(dt) {
 			// how many bytes were written, normalized by number of seconds
-			bandwidth = (index[numFrames]-index[beg]) / dt;
+			bandwidth = (index[last]-index[beg]) / dt;
 			// update maximum if index_timestamp[numFrames] - index_timestamp[beg] < index_timestamp[numFrames] - BANDWIDTH
 			// -> -index_timestamp[beg] < BANDWIDTH
 			// -> index_timestamp[beg] > BANDWIDTH
@@ -268,8 +275,8 @@ public:
 			}
 		}
 
-		if(numFrames > 0){
-			lastSPF = index_timestamp[numFrames]-index_timestamp[numFrames-1];
+		if(last > 0){
+			lastSPF = index_timestamp[last]-index_timestamp[last-1];
 			lastFPS = 1.0/lastSPF;
 			if(lastFPS > maxFPS) maxFPS = lastFPS;
 			if(lastFPS < minFPS) minFPS = lastFPS;
@@ -308,8 +315,8 @@ public:
 			nFramesCompressed++;
 		}
 
-		duration = index_timestamp[numFrames]-startTime;
-		currTime = index_timestamp[numFrames];
+		duration = index_timestamp[last]-startTime;
+		currTime = index_timestamp[last];
 		numFrames++; 
 
 		// for computing average number of bytes per frame
@@ -328,7 +335,7 @@ public:
 		double aveErr = 0; //, unused;
 		unsigned char *framePtr;
 		float *backgroundPtr;
-		unsigned short *nWritesPtr;
+		const unsigned __int64 *isWrittenPtr;
 		if(logger && statPrintFrameErrors && (numFrames%statComputeFrameErrorFreq == 0)) {
 
 			if(printDebugMode) logger->log(level, "computing compression error rate\n"); 
@@ -359,13 +366,13 @@ public:
 					memset(line_err[i]-1, 0, (width+1)*sizeof(int));
 				memset(box_err, 0, width*sizeof(int));
 
-				for(y = 0, framePtr = frame, backgroundPtr = background, nWritesPtr = nWrites; 
-					y < height; y++, framePtr += width, backgroundPtr += width, nWritesPtr += width) {
+				for(y = 0, framePtr = frame, backgroundPtr = background, isWrittenPtr = isWritten; 
+					y < height; y++, framePtr += width, backgroundPtr += width, isWrittenPtr += isWrittenStride) {
 					newest_line_err = line_err[y%ERROR_FILTER_WIDTH];
 					oldest_line_err = line_err[(y+1)%ERROR_FILTER_WIDTH];
 					for(x = 0; x < width; x++) { 
 						// Compute the error at pixel x,y
-						if(nWritesPtr[x]==0) { 
+						if(((isWrittenPtr[x >> 6] >> (x & 63)) & 1) == 0) { 
 							if(framePtr[x] >= backgroundPtr[x]){
 								diff = (int)(framePtr[x] - (unsigned char)backgroundPtr[x]);
 							}
@@ -426,12 +433,12 @@ public:
 
 		if(logger && streamPrintFreq && (numFrames%streamPrintFreq == 0)) { 
 			if(printDebugMode){
-				logger->log(level, "ufmf frame %d: buffered=%llu, dropped=%llu, timestamp=%f, is_compressed=%d, fps=%f, bytes=%d, foreground_pixels=%d, num_pixels_written=%d, num_boxes=%d, lastAveErr=%f, lastMaxPxErr=%f, lastMaxFiltErr=%f\n", 
-					(int)numFrames, numBuffered, numDropped, currTime, (int)isCompressedFrame, lastFPS, (int)frameSize, numForeground, numWritten, numBoxes, (float)lastAveErr, (float)lastMaxPxErr, (float)(lastMaxFiltErr/filterZ)); 
+				logger->log(level, "ufmf frame %d: buffered=%llu, dropped=%llu, dropped_writer=%llu, timestamp=%f, is_compressed=%d, fps=%f, bytes=%d, foreground_pixels=%d, num_pixels_written=%d, num_boxes=%d, lastAveErr=%f, lastMaxPxErr=%f, lastMaxFiltErr=%f\n", 
+					(int)numFrames, numBuffered, numDropped, numDroppedWriter, currTime, (int)isCompressedFrame, lastFPS, (int)frameSize, numForeground, numWritten, numBoxes, (float)lastAveErr, (float)lastMaxPxErr, (float)(lastMaxFiltErr/filterZ)); 
 			}
 			else{
-				logger->log(level, "%d,%llu,%f,%d,%f,%llu,%d,%d,%d,%d,%f,%f,%f",
-					(int)numFrames, numBuffered, currTime, (int)isCompressedFrame, lastFPS, (int)numDropped, (int)frameSize, numForeground, numWritten, numBoxes, (float)lastAveErr, (float)lastMaxPxErr, (float)(lastMaxFiltErr/filterZ));
+				logger->log(level, "%d,%llu,%f,%d,%f,%llu,%llu,%d,%d,%d,%d,%f,%f,%f",
+					(int)numFrames, numBuffered, currTime, (int)isCompressedFrame, lastFPS, numDropped, numDroppedWriter, (int)frameSize, numForeground, numWritten, numBoxes, (float)lastAveErr, (float)lastMaxPxErr, (float)(lastMaxFiltErr/filterZ));
 			}
 			if(statPrintTimings){
 				printTimings(level, false);
@@ -445,14 +452,18 @@ public:
 		}
 	}
 
+	// time in 100 ns ticks on a steady clock, only meaningful as a difference between two calls
 	static ULARGE_INTEGER getTime(){
 
-		SYSTEMTIME systemTime;
-		GetSystemTime( &systemTime );
-		FILETIME fileTime;
-		SystemTimeToFileTime( &systemTime, &fileTime );
+		static LARGE_INTEGER frequency = {0};
+		LARGE_INTEGER counter;
 		ULARGE_INTEGER uli;
-		uli.LowPart = fileTime.dwLowDateTime; uli.HighPart = fileTime.dwHighDateTime;
+
+		if(frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&counter);
+		// split so the multiply can't overflow
+		uli.QuadPart = (unsigned __int64)(counter.QuadPart / frequency.QuadPart) * 10000000 +
+			(unsigned __int64)(counter.QuadPart % frequency.QuadPart) * 10000000 / frequency.QuadPart;
 		return uli;
 
 	}
@@ -557,9 +568,10 @@ public:
 		double stdFilteredErr = sqrt( MAX(0,sumFilteredErrSquared / (double)nFramesComputeFrameError - meanFilteredErr*meanFilteredErr) );
 
 		if(printDebugMode){
-			sprintf(str, "num_frames=%u, num_dropped=%u, num_frames_raw=%u, num_frames_nobacksub=%u, fps=(%f ave, %f std, %f max, %f min), bandwidth=(%f KB/s ave, %f KB/s peak), frame_size=(%f KB ave, %f std, %f KB peak), compression_rate=%f, foreground_pixels=(%f ave, %f std, %f peak), num_pixels_written=(%f ave, %f std, %f peak), num_boxes=(%f ave, %f std, %f peak)", 
+			sprintf(str, "num_frames=%u, num_dropped=%u, num_dropped_writer=%llu, num_frames_raw=%u, num_frames_nobacksub=%u, fps=(%f ave, %f std, %f max, %f min), bandwidth=(%f KB/s ave, %f KB/s peak), frame_size=(%f KB ave, %f std, %f KB peak), compression_rate=%f, foreground_pixels=(%f ave, %f std, %f peak), num_pixels_written=(%f ave, %f std, %f peak), num_boxes=(%f ave, %f std, %f peak)", 
 				numFrames, // nFrames
 				numDropped, // nFramesDroppedTotal
+				numDroppedWriter, // nFramesDroppedWriter
 				(numFrames-(unsigned int)nFramesCompressed), // nFramesUncompressed
 				(numFrames-(unsigned int)nFramesBackSub), // nFramesNoBackSub
 				((double)numFrames / duration), // average fps
@@ -572,9 +584,10 @@ public:
 				meanNumBoxes, stdNumBoxes, (double)maxNumBoxes); // meanNBoxes, stdNBoxes, maxNBoxes
 		}
 		else{
-			sprintf(str,"%u,%u,%u,%u,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
+			sprintf(str,"%u,%u,%llu,%u,%u,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
 				numFrames, // nFrames
 				numDropped, // nFramesDroppedTotal
+				numDroppedWriter, // nFramesDroppedWriter
 				(numFrames-(unsigned int)nFramesCompressed), // nFramesUncompressed
 				(numFrames-(unsigned int)nFramesBackSub), // nFramesNoBackSub
 				((double)numFrames / duration), // average fps